@@ -5,6 +5,29 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_AVX2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#endif
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
 
 #ifdef _WIN32
 
@@ -26,12 +49,368 @@ void add_history(char *unused) {}
 #include <editline/readline.h>
 #endif
 
+/* Name Table */
+
+// Interns names (function names, file names) and hands out small integer ids,
+// so hot-path records can store an int instead of copying strings.
+static char **lname_strs = NULL;
+static int lname_count = 0;
+static int *lname_slots = NULL; // open addressing table of ids, -1 is empty
+static int lname_cap = 0;
+
+static unsigned int lname_hash(char *s)
+{
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	while (*s)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int lname_id(char *s)
+{
+	// grow when the table is half full
+	if (lname_count * 2 >= lname_cap)
+	{
+		int cap = lname_cap ? lname_cap * 2 : 256;
+		int *slots = malloc(sizeof(int) * cap);
+		memset(slots, -1, sizeof(int) * cap);
+		for (int i = 0; i < lname_count; i++)
+		{
+			unsigned int j = lname_hash(lname_strs[i]) & (cap - 1);
+			while (slots[j] != -1)
+			{
+				j = (j + 1) & (cap - 1);
+			}
+			slots[j] = i;
+		}
+		free(lname_slots);
+		lname_slots = slots;
+		lname_cap = cap;
+	}
+
+	unsigned int j = lname_hash(s) & (lname_cap - 1);
+	while (lname_slots[j] != -1)
+	{
+		if (strcmp(lname_strs[lname_slots[j]], s) == 0)
+		{
+			return lname_slots[j];
+		}
+		j = (j + 1) & (lname_cap - 1);
+	}
+
+	lname_strs = realloc(lname_strs, sizeof(char *) * (lname_count + 1));
+	lname_strs[lname_count] = malloc(strlen(s) + 1);
+	strcpy(lname_strs[lname_count], s);
+	lname_slots[j] = lname_count;
+	return lname_count++;
+}
+
+char *lname_str(int id)
+{
+	return lname_strs[id];
+}
+
+/* Tracing */
+
+// Events are buffered as fixed size records and only formatted as JSON when
+// the buffer fills up or the trace is closed, so tracing can stay on for a
+// whole batch run. Output uses the Chrome trace event format (JSON array
+// form, which stays loadable in Perfetto even if the closing ']' is missing).
+#define TRACE_BUF_EVENTS 65536
+
+typedef struct
+{
+	int name;
+	char cat;
+	char ph;
+	long long ts; // monotonic nanoseconds
+} trace_ev;
+
+static FILE *trace_file = NULL;
+static trace_ev *trace_buf = NULL;
+static int trace_len = 0;
+static int trace_written = 0;
+static long long trace_t0 = 0;
+
+long long clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static char *trace_cat_name(char cat)
+{
+	switch (cat)
+	{
+	case 'l':
+		return "lambda";
+	case 'f':
+		return "form";
+	case 'L':
+		return "load";
+	}
+	return "other";
+}
+
+// write a name as a JSON string, escaping what JSON requires
+static void trace_write_name(char *s)
+{
+	fputc('"', trace_file);
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			fputc('\\', trace_file);
+			fputc(*s, trace_file);
+		}
+		else if ((unsigned char)*s < 0x20)
+		{
+			fprintf(trace_file, "\\u%04x", *s);
+		}
+		else
+		{
+			fputc(*s, trace_file);
+		}
+	}
+	fputc('"', trace_file);
+}
+
+static void trace_flush(void)
+{
+	for (int i = 0; i < trace_len; i++)
+	{
+		trace_ev *ev = &trace_buf[i];
+		fputs(trace_written++ ? ",\n{\"name\":" : "\n{\"name\":", trace_file);
+		trace_write_name(lname_str(ev->name));
+		fprintf(trace_file, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+				trace_cat_name(ev->cat), ev->ph, (ev->ts - trace_t0) / 1000.0);
+	}
+	trace_len = 0;
+}
+
+void trace_open(char *path)
+{
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL)
+	{
+		fprintf(stderr, "Could not open trace file %s\n", path);
+		return;
+	}
+	trace_buf = malloc(sizeof(trace_ev) * TRACE_BUF_EVENTS);
+	trace_t0 = clock_ns();
+	fputc('[', trace_file);
+	atexit(trace_close);
+}
+
+void trace_close(void)
+{
+	if (trace_file == NULL)
+	{
+		return;
+	}
+	trace_flush();
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	free(trace_buf);
+	trace_file = NULL;
+}
+
+// record a begin ('B') or end ('E') event
+void trace_event(int name, char cat, char ph)
+{
+	if (trace_len == TRACE_BUF_EVENTS)
+	{
+		trace_flush();
+	}
+	trace_ev *ev = &trace_buf[trace_len++];
+	ev->name = name;
+	ev->cat = cat;
+	ev->ph = ph;
+	ev->ts = clock_ns();
+}
+
+/* Hardware Performance Counters */
+
+// With --perf, cycles, instructions, cache misses and branch misses are read
+// around every named function call and the deltas are attributed (inclusive
+// of nested calls) to the name the function was called by. Linux only; if the
+// counters cannot be opened the interpreter runs without them.
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_COUNTERS };
+
+typedef struct
+{
+	long long calls;
+	long long counts[PERF_COUNTERS];
+} perf_stat;
+
+static int perf_fd = -1;		   // group leader, -1 when counters are off
+static int perf_slot[PERF_COUNTERS]; // position of each counter in a group read, -1 if unavailable
+static int perf_nslots = 0;
+static perf_stat *perf_stats = NULL;
+static int perf_nstats = 0;
+
+#ifdef __linux__
+static int perf_open_counter(unsigned long long config, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+void perf_open(void)
+{
+#ifdef __linux__
+	unsigned long long configs[PERF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+
+	perf_fd = perf_open_counter(configs[0], -1);
+	if (perf_fd == -1)
+	{
+		fprintf(stderr, "Performance counters unavailable (%s), continuing without them\n", strerror(errno));
+		return;
+	}
+	perf_slot[0] = perf_nslots++;
+
+	for (int i = 1; i < PERF_COUNTERS; i++)
+	{
+		perf_slot[i] = perf_open_counter(configs[i], perf_fd) == -1 ? -1 : perf_nslots++;
+	}
+
+	ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	atexit(perf_report);
+#else
+	fprintf(stderr, "Performance counters are only supported on Linux, continuing without them\n");
+#endif
+}
+
+// read the current value of all counters in the group
+void perf_read(long long *counts)
+{
+	unsigned long long buf[1 + PERF_COUNTERS];
+	if (read(perf_fd, buf, sizeof(buf)) <= 0)
+	{
+		memset(counts, 0, sizeof(long long) * PERF_COUNTERS);
+		return;
+	}
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		counts[i] = perf_slot[i] == -1 ? 0 : buf[1 + perf_slot[i]];
+	}
+}
+
+// attribute the counter deltas since 'before' to function 'name'
+void perf_account(int name, long long *before)
+{
+	long long after[PERF_COUNTERS];
+	perf_read(after);
+
+	if (name >= perf_nstats)
+	{
+		int n = name + 64;
+		perf_stats = realloc(perf_stats, sizeof(perf_stat) * n);
+		memset(perf_stats + perf_nstats, 0, sizeof(perf_stat) * (n - perf_nstats));
+		perf_nstats = n;
+	}
+
+	perf_stat *st = &perf_stats[name];
+	st->calls++;
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		st->counts[i] += after[i] - before[i];
+	}
+}
+
+static int perf_cmp(const void *x, const void *y)
+{
+	long long a = perf_stats[*(const int *)x].counts[PERF_CYCLES];
+	long long b = perf_stats[*(const int *)y].counts[PERF_CYCLES];
+	return (a < b) - (a > b);
+}
+
+// print per function counters, most cycles first
+void perf_report(void)
+{
+	int *order = malloc(sizeof(int) * (perf_nstats + 1));
+	int n = 0;
+	for (int i = 0; i < perf_nstats; i++)
+	{
+		if (perf_stats[i].calls)
+		{
+			order[n++] = i;
+		}
+	}
+	qsort(order, n, sizeof(int), perf_cmp);
+
+	fprintf(stderr, "\n%-24s %10s %14s %14s %6s %12s %12s\n",
+			"function (inclusive)", "calls", "cycles", "instructions", "IPC", "cache-miss", "branch-miss");
+	for (int i = 0; i < n; i++)
+	{
+		perf_stat *st = &perf_stats[order[i]];
+		double ipc = st->counts[PERF_CYCLES] ? (double)st->counts[PERF_INSTRUCTIONS] / st->counts[PERF_CYCLES] : 0;
+		fprintf(stderr, "%-24s %10lld %14lld %14lld %6.2f %12lld %12lld\n",
+				lname_str(order[i]), st->calls, st->counts[PERF_CYCLES], st->counts[PERF_INSTRUCTIONS], ipc,
+				st->counts[PERF_CACHE_MISSES], st->counts[PERF_BRANCH_MISSES]);
+	}
+	for (int i = 1; i < PERF_COUNTERS; i++)
+	{
+		if (perf_slot[i] == -1)
+		{
+			fprintf(stderr, "(some counters were unavailable and are reported as 0)\n");
+			break;
+		}
+	}
+	free(order);
+}
+
+// name used for a top level form in the trace: its leading symbol if any
+static int trace_form_name(lval *v)
+{
+	if (v->type == LVAL_SEXPR && v->count > 0 && v->cell[0]->type == LVAL_SYM)
+	{
+		return lname_id(v->cell[0]->sym);
+	}
+	return lname_id("form");
+}
+
 /* LISP Value and Associated Functions */
 
+// number of lvals allocated so far, used by 'time' and 'bench'
+long long lval_allocs = 0;
+
+// allocate memory for a new lval
+lval *lval_alloc(void)
+{
+	lval_allocs++;
+	lval *v = malloc(sizeof(lval));
+	v->fused = 0;
+	v->opt = OPT_NONE;
+	v->expanded = 0;
+	v->refs = 0;
+	return v;
+}
+
 // initalize lval num type
 lval *lval_num(double x)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_NUM;
 	v->num = x;
 	return v;
@@ -40,7 +419,7 @@ lval *lval_num(double x)
 // initialize lval err type
 lval *lval_err(char *fmt, ...)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_ERR;
 
 	va_list va;
@@ -59,7 +438,7 @@ lval *lval_err(char *fmt, ...)
 // initialize lval symbol type
 lval *lval_sym(char *s)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_SYM;
 	v->sym = malloc(strlen(s) + 1);
 	strcpy(v->sym, s);
@@ -69,27 +448,29 @@ lval *lval_sym(char *s)
 // initialize lval s-expression type
 lval *lval_sexpr(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_SEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 // initialize lval q-expression type
 lval *lval_qexpr(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_QEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 // initialize lval func type (for bultin in func)
 lval *lval_fun(lbuiltin func)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_FUN;
 	v->builtin = func;
 	return v;
@@ -98,7 +479,7 @@ lval *lval_fun(lbuiltin func)
 // initialize lval lambda type (for user defined func)
 lval *lval_lambda(lval *formals, lval *body)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_FUN;
 	v->builtin = NULL; // this is used to differentiate between builtin and user defined functions
 	v->env = lenv_new();
@@ -110,7 +491,7 @@ lval *lval_lambda(lval *formals, lval *body)
 // initialize bool type, by default is false
 lval *lval_bool(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_BOOL;
 	v->num = false;
 	return v;
@@ -118,16 +499,250 @@ lval *lval_bool(void)
 
 lval *lval_str(char *s)
 {
-	lval *v = malloc(sizeof(lval));
+	return lval_str_n(s, strlen(s));
+}
+
+// initialize string from the first n bytes of s. Short strings are stored
+// inline in the value and need no allocation of their own.
+lval *lval_str_n(char *s, size_t n)
+{
+	lval *v = lval_alloc();
 	v->type = LVAL_STR;
-	v->str = malloc(strlen(s) + 1);
-	strcpy(v->str, s);
+	v->slen = n;
+	if (n < STR_INLINE)
+	{
+		v->sbuf = NULL;
+		memcpy(v->sso, s, n);
+		v->sso[n] = '\0';
+		return v;
+	}
+	v->sbuf = lstrbuf_new(n);
+	v->soff = 0;
+	memcpy(v->sbuf->data, s, n);
+	v->sbuf->data[n] = '\0';
+	v->sbuf->len = n;
+	return v;
+}
+
+lstrbuf *lstrbuf_new(size_t cap)
+{
+	lstrbuf *b = malloc(sizeof(lstrbuf));
+	b->rc = 1;
+	b->len = 0;
+	b->cap = cap;
+	b->data = malloc(cap + 1);
+	b->data[0] = '\0';
+	return b;
+}
+
+void lstrbuf_del(lstrbuf *b)
+{
+	if (--b->rc > 0)
+	{
+		return;
+	}
+	free(b->data);
+	free(b);
+}
+
+// first byte of the string, not NUL terminated
+char *lval_sdata(lval *v)
+{
+	return v->sbuf ? v->sbuf->data + v->soff : v->sso;
+}
+
+// the string as a NUL terminated C string. Slices that stop short of the
+// end of their buffer are first moved to a buffer of their own.
+char *lval_cstr(lval *v)
+{
+	if (v->sbuf == NULL)
+	{
+		v->sso[v->slen] = '\0';
+	}
+	else if (v->soff + v->slen != v->sbuf->len)
+	{
+		lstrbuf *b = v->sbuf;
+		lval *x = lval_str_n(lval_sdata(v), v->slen);
+		v->sbuf = x->sbuf;
+		if (x->sbuf == NULL)
+		{
+			memcpy(v->sso, x->sso, STR_INLINE);
+		}
+		else
+		{
+			v->soff = 0;
+		}
+		x->sbuf = NULL;
+		lval_del(x);
+		lstrbuf_del(b);
+	}
+	return lval_sdata(v);
+}
+
+// make room to extend string v to n bytes and return its data. When v ends at
+// the end of its buffer the buffer grows in place (geometrically), so
+// repeated appends are amortized O(1) even while copies of v exist.
+char *lval_str_reserve(lval *v, size_t n)
+{
+	lstrbuf *b = v->sbuf;
+	if (b == NULL)
+	{
+		// inline strings belong to v alone
+		if (n < STR_INLINE)
+		{
+			return lval_cstr(v);
+		}
+		b = lstrbuf_new(n);
+		memcpy(b->data, lval_sdata(v), v->slen);
+		b->len = v->slen;
+		v->sbuf = b;
+		v->soff = 0;
+		return b->data;
+	}
+
+	size_t end = v->soff + v->slen;
+	if (end == b->len && v->soff + n <= b->cap)
+	{
+		return lval_sdata(v);
+	}
+
+	size_t cap = n > 2 * b->cap ? n : 2 * b->cap;
+	if (end == b->len)
+	{
+		b->data = realloc(b->data, v->soff + cap + 1);
+		b->cap = v->soff + cap;
+		return lval_sdata(v);
+	}
+
+	// someone else has already extended this buffer, start a new one
+	lstrbuf *c = lstrbuf_new(cap);
+	memcpy(c->data, lval_sdata(v), v->slen);
+	c->len = v->slen;
+	lstrbuf_del(b);
+	v->sbuf = c;
+	v->soff = 0;
+	return c->data;
+}
+
+// set the length of a string after writing its bytes through
+// lval_str_reserve
+void lval_str_setlen(lval *v, size_t n)
+{
+	v->slen = n;
+	lval_sdata(v)[n] = '\0';
+	if (v->sbuf)
+	{
+		v->sbuf->len = v->soff + n;
+	}
+}
+
+// narrow string v to the n bytes starting at byte i
+void lval_str_slice(lval *v, size_t i, size_t n)
+{
+	if (v->sbuf)
+	{
+		v->soff += i;
+	}
+	else
+	{
+		memmove(v->sso, v->sso + i, n);
+	}
+	v->slen = n;
+}
+
+// append n bytes to string v. s may only point into v's own buffer when
+// room for the result was already reserved.
+void lval_str_append(lval *v, const char *s, size_t n)
+{
+	char *d = lval_str_reserve(v, v->slen + n);
+	memcpy(d + v->slen, s, n);
+	lval_str_setlen(v, v->slen + n);
+}
+
+// initialize empty hash map
+lval *lval_map(void)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_MAP;
+	v->map = lmap_new(0, 8);
+	return v;
+}
+
+// initialize empty hash set
+lval *lval_set(void)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_SET;
+	v->map = lmap_new(1, 8);
+	return v;
+}
+
+// initialize empty ordered map
+lval *lval_omap(void)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_OMAP;
+	v->root = lbnode_new(1);
+	v->count = 0;
+	return v;
+}
+
+// initialize empty priority queue
+lval *lval_pq(void)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_PQ;
+	v->heap = malloc(sizeof(lheap));
+	v->heap->rc = 1;
+	v->heap->count = 0;
+	v->heap->cap = 0;
+	v->heap->items = NULL;
+	return v;
+}
+
+// initialize empty persistent vector
+lval *lval_pvec(void)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_PVEC;
+	v->pnode = lpnode_new(1);
+	v->pshift = 0;
+	v->count = 0;
+	return v;
+}
+
+// initialize vector of count doubles, contents uninitialized
+lval *lval_f64vec(int count)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_F64VEC;
+	v->vec = malloc(sizeof(lvec));
+	v->vec->rc = 1;
+	v->vec->count = count;
+	v->vec->data = malloc(sizeof(double) * (count ? count : 1));
+	return v;
+}
+
+// initialize rows x cols matrix, contents uninitialized. Shapes built from
+// user input are checked with mat_shape_ok first.
+lval *lval_mat(int rows, int cols)
+{
+	size_t count = (size_t)rows * (size_t)cols;
+	lval *v = lval_f64vec((int)count);
+	v->type = LVAL_MAT;
+	v->rows = rows;
+	v->cols = cols;
 	return v;
 }
 
 // cleanup memory allocated to lval
 void lval_del(lval *v)
 {
+	if (v->refs)
+	{
+		v->refs--;
+		return;
+	}
 
 	switch (v->type)
 	{
@@ -142,7 +757,10 @@ void lval_del(lval *v)
 		free(v->sym);
 		break;
 	case LVAL_STR:
-		free(v->str);
+		if (v->sbuf)
+		{
+			lstrbuf_del(v->sbuf);
+		}
 		break;
 	case LVAL_FUN:
 		if (!v->builtin)
@@ -161,6 +779,41 @@ void lval_del(lval *v)
 			lval_del(v->cell[i]);
 		}
 		free(v->cell);
+		if (v->code)
+		{
+			if (v->code->jit)
+			{
+				jit_free(v->code->jit);
+			}
+			free(v->code->sig);
+			free(v->code);
+		}
+		break;
+
+	case LVAL_MAP:
+	case LVAL_SET:
+		lmap_del(v->map);
+		break;
+
+	case LVAL_OMAP:
+		lbnode_del(v->root);
+		break;
+
+	case LVAL_PVEC:
+		lpnode_del(v->pnode);
+		break;
+
+	case LVAL_SEQ:
+		lseq_del(v->seq);
+		break;
+
+	case LVAL_PQ:
+		lheap_del(v->heap);
+		break;
+
+	case LVAL_F64VEC:
+	case LVAL_MAT:
+		lvec_del(v->vec);
 		break;
 	}
 
@@ -188,9 +841,29 @@ lval *lval_pop(lval *v, int i)
 	// Reallocate the memory used
 	v->cell = realloc(v->cell, sizeof(lval *) * v->count);
 
+	// an optimizer hint no longer describes v
+	v->opt = OPT_NONE;
 	return x;
 }
 
+// another owner for v, which must not be modified from then on. Lambdas share
+// their formals and body between copies this way.
+lval *lval_share(lval *v)
+{
+	v->refs++;
+	return v;
+}
+
+// the lcode record of the list v, allocated on first use
+lcode *lval_code(lval *v)
+{
+	if (v->code == NULL)
+	{
+		v->code = calloc(1, sizeof(lcode));
+	}
+	return v->code;
+}
+
 // Pop value from expression at index i and delete the LISP Value
 lval *lval_take(lval *v, int i)
 {
@@ -215,8 +888,10 @@ lval *lval_join(lval *x, lval *y)
 // Also copies the environments within LISP values.
 lval *lval_copy(lval *v)
 {
-	lval *x = malloc(sizeof(lval));
+	lval *x = lval_alloc();
 	x->type = v->type;
+	x->fused = v->fused;
+	x->opt = v->opt;
 
 	switch (v->type)
 	{
@@ -235,8 +910,8 @@ lval *lval_copy(lval *v)
 		{
 			x->builtin = NULL;
 			x->env = lenv_copy(v->env);
-			x->formals = lval_copy(v->formals);
-			x->body = lval_copy(v->body);
+			x->formals = lval_share(v->formals);
+			x->body = lval_share(v->body);
 		}
 		break;
 
@@ -251,12 +926,30 @@ lval *lval_copy(lval *v)
 		break;
 
 	case LVAL_STR:
-		x->str = malloc(strlen(v->str) + 1);
-		strcpy(x->str, v->str);
+		x->sbuf = v->sbuf;
+		if (x->sbuf)
+		{
+			x->sbuf->rc++;
+			x->soff = v->soff;
+		}
+		else
+		{
+			memcpy(x->sso, v->sso, STR_INLINE);
+		}
+		x->slen = v->slen;
 		break;
 
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
+		x->num = v->num;
+		x->expanded = v->expanded;
+		x->opt_deps = v->opt_deps;
+		x->code = NULL;
+		if (v->code && v->code->aot)
+		{
+			// compiled bodies reach builtin_lambda as copies of the source
+			lval_code(x)->aot = v->code->aot;
+		}
 		x->count = v->count;
 		x->cell = malloc(sizeof(lval *) * x->count);
 		for (int i = 0; i < x->count; i++)
@@ -264,6 +957,44 @@ lval *lval_copy(lval *v)
 			x->cell[i] = lval_copy(v->cell[i]);
 		}
 		break;
+
+	case LVAL_MAP:
+	case LVAL_SET:
+		// tables are shared until one of the copies is modified
+		x->map = v->map;
+		x->map->rc++;
+		break;
+
+	case LVAL_OMAP:
+		x->root = v->root;
+		x->root->rc++;
+		x->count = v->count;
+		break;
+
+	case LVAL_PVEC:
+		x->pnode = v->pnode;
+		x->pnode->rc++;
+		x->pshift = v->pshift;
+		x->count = v->count;
+		break;
+
+	case LVAL_SEQ:
+		x->seq = v->seq;
+		x->seq->rc++;
+		break;
+
+	case LVAL_PQ:
+		x->heap = v->heap;
+		x->heap->rc++;
+		break;
+
+	case LVAL_F64VEC:
+	case LVAL_MAT:
+		x->vec = v->vec;
+		x->vec->rc++;
+		x->rows = v->rows;
+		x->cols = v->cols;
+		break;
 	}
 
 	return x;
@@ -291,7 +1022,12 @@ int lval_eq(lval *x, lval *y)
 	case LVAL_SYM:
 		return (strcmp(x->sym, y->sym) == 0);
 	case LVAL_STR:
-		return (strcmp(x->str, y->str) == 0);
+		// views of the same bytes, e.g. copies of one interned literal
+		if (x->sbuf && x->sbuf == y->sbuf && x->soff == y->soff)
+		{
+			return x->slen == y->slen;
+		}
+		return x->slen == y->slen && memcmp(lval_sdata(x), lval_sdata(y), x->slen) == 0;
 
 	case LVAL_FUN:
 		if (x->builtin || y->builtin)
@@ -319,1203 +1055,8034 @@ int lval_eq(lval *x, lval *y)
 		}
 		return 1;
 		break;
-	}
-	return 0;
-}
-
-// Reading LISP Values from terminal
-
-lval *lval_read_str(char *s, int *i)
-{
-
-	char *lval_str_unescapable = "abfnrtv\\\'\"";
-	// char *lval_str_escapable = "\a\b\f\n\r\t\v\\\'\"";
-
-	char *part = calloc(1, 1);
-
-	/* More forward one step past initial " character */
-	(*i)++;
-	while (s[*i] != '"')
-	{
 
-		char c = s[*i];
+	case LVAL_SEQ:
+		// sequences are only equal to their own copies
+		return x->seq == y->seq;
 
-		/* If end of input then there is an unterminated string literal */
-		if (c == '\0')
+	case LVAL_MAP:
+	case LVAL_SET:
+		if (x->map == y->map)
 		{
-			free(part);
-			return lval_err("Unexpected end of input");
+			return 1;
 		}
-
-		/* If backslash then unescape character after it */
-		if (c == '\\')
+		if (x->map->count != y->map->count)
 		{
-			(*i)++;
-			/* Check next character is escapable */
-			if (strchr(lval_str_unescapable, s[*i]))
+			return 0;
+		}
+		// every entry of x must be in y with an equal value
+		for (int i = 0; i < x->map->cap; i++)
+		{
+			lval *k = x->map->keys[i];
+			if (k == NULL)
 			{
-				c = lval_str_unescape(s[*i]);
+				continue;
 			}
-			else
+			int j = lmap_find(y->map, k, x->map->hashes[i]);
+			if (y->map->keys[j] == NULL)
 			{
-				free(part);
-				return lval_err("Invalid escape sequence %c", s[*i]);
+				return 0;
+			}
+			if (x->map->vals && !lval_eq(x->map->vals[i], y->map->vals[j]))
+			{
+				return 0;
 			}
 		}
+		return 1;
 
-		part = realloc(part, strlen(part) + 2);
-		part[strlen(part) + 1] = '\0';
-		part[strlen(part) + 0] = c;
-		(*i)++;
-	}
-	/* Move forward past final " character */
-	(*i)++;
-
-	lval *x = lval_str(part);
-
-	free(part);
-	return x;
-}
-
-lval *lval_read_sym(char *s, int *i)
-{
-
-	char *part = calloc(1, 1);
-
-	/* While valid identifier characters */
-	while (strchr(
-			   "abcdefghijklmnopqrstuvwxyz"
-			   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-			   "0123456789_.+-*\\%/=<>!&",
-			   s[*i]) &&
-		   s[*i] != '\0')
-	{
-
-		part = realloc(part, strlen(part) + 2);
-		part[strlen(part) + 1] = '\0';
-		part[strlen(part) + 0] = s[*i];
-		(*i)++;
-	}
+	case LVAL_F64VEC:
+	case LVAL_MAT:
+		if (x->vec->count != y->vec->count || (x->type == LVAL_MAT && x->cols != y->cols))
+		{
+			return 0;
+		}
+		for (int i = 0; i < x->vec->count; i++)
+		{
+			if (x->vec->data[i] != y->vec->data[i])
+			{
+				return 0;
+			}
+		}
+		return 1;
 
-	int is_num = strchr("-.0123456789", part[0]) != NULL;
-	for (int j = 1; j < strlen(part); j++)
+	case LVAL_OMAP:
+	case LVAL_PQ:
+	case LVAL_PVEC:
 	{
-		if (strchr(".0123456789", part[j]) == NULL)
+		// equal when the entries are equal in key, priority or index order
+		if (lval_len(x) != lval_len(y))
 		{
-			is_num = 0;
-			break;
+			return 0;
 		}
+		lval *xs = lval_entries(x);
+		lval *ys = lval_entries(y);
+		int r = lval_eq(xs, ys);
+		lval_del(xs);
+		lval_del(ys);
+		return r;
 	}
-	if (strlen(part) == 1 && part[0] == '-')
-	{
-		is_num = 0;
 	}
+	return 0;
+}
 
-	lval *x = NULL;
-	if (is_num)
+static unsigned int hash_bytes(unsigned int h, char *s)
+{
+	// FNV-1a
+	while (*s)
 	{
-		errno = 0;
-		double v = strtod(part, NULL);
-		x = (errno != ERANGE) ? lval_num(v) : lval_err("Invalid Number %s", part);
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
 	}
-	else
+	return h;
+}
+
+static unsigned int hash_mem(unsigned int h, char *s, size_t n)
+{
+	// FNV-1a
+	for (size_t i = 0; i < n; i++)
 	{
-		x = lval_sym(part);
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
 	}
+	return h;
+}
 
-	free(part);
-	return x;
+static unsigned int hash_mix(unsigned long long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (unsigned int)x;
 }
 
-lval *lval_read_expr(char *s, int *i, char end)
+// hash a LISP value, consistent with lval_eq
+unsigned int lval_hash(lval *v)
 {
-	/* Either create new qexpr or sexpr */
-	lval *x = (end == '}') ? lval_qexpr() : lval_sexpr();
+	unsigned int h = 2166136261u ^ v->type;
 
-	/* While not at end character keep reading lvals */
-	while (s[*i] != end)
+	switch (v->type)
 	{
-		lval *y = lval_read(s, i);
-		/* If an error then return this and stop */
-		if (y->type == LVAL_ERR)
+	case LVAL_NUM:
+	case LVAL_BOOL:
+	{
+		// +0 and -0 are equal so they must hash the same
+		double d = v->num == 0 ? 0 : v->num;
+		unsigned long long bits;
+		memcpy(&bits, &d, sizeof(bits));
+		return hash_mix(bits ^ v->type);
+	}
+	case LVAL_ERR:
+		return hash_bytes(h, v->err);
+	case LVAL_SYM:
+		return hash_bytes(h, v->sym);
+	case LVAL_STR:
+		return hash_mem(h, lval_sdata(v), v->slen);
+	case LVAL_FUN:
+		if (v->builtin)
 		{
-			lval_del(x);
-			return y;
+			return hash_mix((unsigned long long)(size_t)v->builtin);
 		}
-		else
+		return lval_hash(v->formals) * 31 + lval_hash(v->body);
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		for (int i = 0; i < v->count; i++)
 		{
-			lval_add(x, y);
+			h = (h ^ lval_hash(v->cell[i])) * 16777619u;
 		}
-	}
-
-	/* Move past end character */
-	(*i)++;
-	return x;
-}
-
-lval *lval_read(char *s, int *i)
-{
-	/* Skip all trailing whitespace and comments */
-	while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0')
+		return h;
+	case LVAL_F64VEC:
+	case LVAL_MAT:
+		h ^= v->cols;
+		for (int i = 0; i < v->vec->count; i++)
+		{
+			double d = v->vec->data[i] == 0 ? 0 : v->vec->data[i];
+			unsigned long long bits;
+			memcpy(&bits, &d, sizeof(bits));
+			h = (h ^ hash_mix(bits)) * 16777619u;
+		}
+		return h;
+	case LVAL_SEQ:
+		return h ^ hash_mix((unsigned long long)(size_t)v->seq);
+	case LVAL_OMAP:
+	case LVAL_PQ:
+	case LVAL_PVEC:
 	{
-		if (s[*i] == ';')
+		lval *xs = lval_entries(v);
+		h ^= lval_hash(xs);
+		lval_del(xs);
+		return h;
+	}
+	case LVAL_MAP:
+	case LVAL_SET:
+		// order independent, slot order differs between equal tables
+		for (int i = 0; i < v->map->cap; i++)
 		{
-			while (s[*i] != '\n' && s[*i] != '\0')
+			if (v->map->keys[i])
 			{
-				(*i)++;
+				h += hash_mix(v->map->hashes[i] + (v->map->vals ? (unsigned long long)lval_hash(v->map->vals[i]) << 32 : 0));
 			}
 		}
-		(*i)++;
+		return h;
 	}
+	return h;
+}
 
-	lval *x = NULL;
+// String literals of a file being loaded are interned, so every occurrence
+// of the same literal shares one buffer and compares equal by identity.
+// Inline strings are cheap to copy already and are not interned.
+typedef struct
+{
+	int count;
+	int cap;
+	lstrbuf **bufs;
+} lstr_interns;
 
-	/* If we reach end of input then we're missing something */
-	if (s[*i] == '\0')
-	{
-		return lval_err("Unexpected end of input");
-	}
+static lstr_interns *str_interns = NULL;
 
-	/* If next character is ( then read S-Expr */
-	else if (s[*i] == '(')
+// a string with the bytes s[0..n), shared with an earlier literal when
+// interning is on
+lval *lval_str_literal(char *s, size_t n)
+{
+	if (str_interns == NULL || n < STR_INLINE)
 	{
-		(*i)++;
-		x = lval_read_expr(s, i, ')');
+		return lval_str_n(s, n);
 	}
 
-	/* If next character is { then read Q-Expr */
-	else if (s[*i] == '{')
+	lstr_interns *t = str_interns;
+	if (2 * (t->count + 1) > t->cap)
 	{
-		(*i)++;
-		x = lval_read_expr(s, i, '}');
+		int cap = t->cap ? 2 * t->cap : 64;
+		lstrbuf **bufs = calloc(cap, sizeof(lstrbuf *));
+		for (int i = 0; i < t->cap; i++)
+		{
+			lstrbuf *b = t->bufs[i];
+			if (b)
+			{
+				int j = hash_mem(2166136261u, b->data, b->len) & (cap - 1);
+				while (bufs[j])
+				{
+					j = (j + 1) & (cap - 1);
+				}
+				bufs[j] = b;
+			}
+		}
+		free(t->bufs);
+		t->bufs = bufs;
+		t->cap = cap;
 	}
 
-	/* If next character is part of a symbol then read symbol */
-	else if (strchr(
-				 "abcdefghijklmnopqrstuvwxyz"
-				 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-				 "0123456789_+-*\\%/=<>!&",
-				 s[*i]))
+	int j = hash_mem(2166136261u, s, n) & (t->cap - 1);
+	while (t->bufs[j])
 	{
-		x = lval_read_sym(s, i);
+		lstrbuf *b = t->bufs[j];
+		if (b->len == n && memcmp(b->data, s, n) == 0)
+		{
+			lval *v = lval_alloc();
+			v->type = LVAL_STR;
+			v->sbuf = b;
+			v->sbuf->rc++;
+			v->soff = 0;
+			v->slen = n;
+			return v;
+		}
+		j = (j + 1) & (t->cap - 1);
 	}
 
-	/* If next character is " then read string */
-	else if (strchr("\"", s[*i]))
-	{
-		x = lval_read_str(s, i);
-	}
+	lval *v = lval_str_n(s, n);
+	t->bufs[j] = v->sbuf;
+	t->bufs[j]->rc++;
+	t->count++;
+	return v;
+}
 
-	/* Encountered some unexpected character */
-	else
+// intern the literals read until str_intern_end
+void str_intern_begin(void)
+{
+	str_interns = calloc(1, sizeof(lstr_interns));
+}
+
+// drop the table; the literals keep their shared buffers
+void str_intern_end(void)
+{
+	for (int i = 0; i < str_interns->cap; i++)
 	{
-		x = lval_err("Unexpected character %c", s[*i]);
+		if (str_interns->bufs[i])
+		{
+			lstrbuf_del(str_interns->bufs[i]);
+		}
 	}
+	free(str_interns->bufs);
+	free(str_interns);
+	str_interns = NULL;
+}
 
-	/* Skip all trailing whitespace and comments */
-	while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0')
+// order of the unequal values x and y of a type with no natural order when
+// their hashes collide, decided by their contents
+static int lval_cmp_tie(lval *x, lval *y)
+{
+	switch (x->type)
 	{
-		if (s[*i] == ';')
+	case LVAL_FUN:
+		if (x->builtin && y->builtin)
 		{
-			while (s[*i] != '\n' && s[*i] != '\0')
+			// builtins are only equal to themselves
+			return (size_t)x->builtin < (size_t)y->builtin ? -1 : 1;
+		}
+		if (x->builtin || y->builtin)
+		{
+			return x->builtin ? -1 : 1;
+		}
+		else
+		{
+			int c = lval_cmp(x->formals, y->formals);
+			return c != 0 ? c : lval_cmp(x->body, y->body);
+		}
+
+	case LVAL_SEQ:
+		return (size_t)x->seq < (size_t)y->seq ? -1 : 1;
+
+	case LVAL_F64VEC:
+	case LVAL_MAT:
+		if (x->type == LVAL_MAT && x->cols != y->cols)
+		{
+			return x->cols < y->cols ? -1 : 1;
+		}
+		for (int i = 0; i < x->vec->count && i < y->vec->count; i++)
+		{
+			double a = x->vec->data[i], b = y->vec->data[i];
+			if (a != b)
 			{
-				(*i)++;
+				return (a > b) - (a < b);
 			}
 		}
-		(*i)++;
+		return (x->vec->count > y->vec->count) - (x->vec->count < y->vec->count);
 	}
 
-	return x;
+	// containers compare their entries in order
+	lval *xs = lval_entries(x);
+	lval *ys = lval_entries(y);
+	int c = lval_cmp(xs, ys);
+	lval_del(xs);
+	lval_del(ys);
+	return c;
 }
 
-// Evaluating expressions in LISP values
-lval *lval_eval_sexpr(lenv *e, lval *v)
+// total order on LISP values, used by ordered maps, priority queues and sort.
+// Values of different types are ordered by type; returns <0, 0 or >0.
+int lval_cmp(lval *x, lval *y)
 {
-
-	// evaluate children of s-expression
-	for (int i = 0; i < v->count; i++)
+	if (x->type != y->type)
 	{
-		v->cell[i] = lval_eval(e, v->cell[i]);
+		return x->type < y->type ? -1 : 1;
 	}
 
-	// check if any children evaluates to an error
-	for (int i = 0; i < v->count; i++)
+	switch (x->type)
+	{
+	case LVAL_NUM:
+	case LVAL_BOOL:
+		return (x->num > y->num) - (x->num < y->num);
+	case LVAL_ERR:
+		return strcmp(x->err, y->err);
+	case LVAL_SYM:
+		return strcmp(x->sym, y->sym);
+	case LVAL_STR:
 	{
-		if (v->cell[i]->type == LVAL_ERR)
+		size_t n = x->slen < y->slen ? x->slen : y->slen;
+		int c = memcmp(lval_sdata(x), lval_sdata(y), n);
+		return c != 0 ? c : (x->slen > y->slen) - (x->slen < y->slen);
+	}
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		// lexicographic, a prefix orders first
+		for (int i = 0; i < x->count && i < y->count; i++)
 		{
-			return lval_take(v, i);
+			int c = lval_cmp(x->cell[i], y->cell[i]);
+			if (c != 0)
+			{
+				return c;
+			}
 		}
+		return (x->count > y->count) - (x->count < y->count);
 	}
 
-	// empty expression
-	if (v->count == 0)
+	// no natural order (functions, containers), fall back to hashes
+	if (lval_eq(x, y))
 	{
-		return v;
+		return 0;
 	}
-
-	// single expression
-	if (v->count == 1)
+	unsigned int hx = lval_hash(x);
+	unsigned int hy = lval_hash(y);
+	if (hx != hy)
 	{
-		return lval_take(v, 0);
+		return hx < hy ? -1 : 1;
 	}
+	return lval_cmp_tie(x, y);
+}
 
-	// ensure first element is function
-	lval *f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN)
-	{
-		lval *err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
-		lval_del(v);
-		lval_del(f);
-		return err;
-	}
+/* Hash Maps and Sets */
 
-	lval *result = lval_call(e, f, v);
-	lval_del(f);
-	return result;
+// create an empty table with room for cap slots, cap must be a power of two
+lmap *lmap_new(int is_set, int cap)
+{
+	lmap *m = malloc(sizeof(lmap));
+	m->rc = 1;
+	m->count = 0;
+	m->cap = cap;
+	m->hashes = malloc(sizeof(unsigned int) * cap);
+	m->keys = calloc(cap, sizeof(lval *));
+	m->vals = is_set ? NULL : calloc(cap, sizeof(lval *));
+	return m;
 }
 
-lval *lval_eval(lenv *e, lval *v)
+// drop one reference to the table, freeing it with its entries on the last one
+void lmap_del(lmap *m)
 {
-	if (v->type == LVAL_SYM)
+	if (--m->rc > 0)
 	{
-		lval *x = lenv_get(e, v);
-		lval_del(v);
-		return x;
+		return;
 	}
-
-	if (v->type == LVAL_SEXPR)
+	for (int i = 0; i < m->cap; i++)
 	{
-		return lval_eval_sexpr(e, v);
+		if (m->keys[i])
+		{
+			lval_del(m->keys[i]);
+			if (m->vals)
+			{
+				lval_del(m->vals[i]);
+			}
+		}
 	}
-	return v;
+	free(m->hashes);
+	free(m->keys);
+	free(m->vals);
+	free(m);
 }
 
-// Printing LISP values to terminal
-void lval_expr_print(lval *v, char open, char close)
+// make sure v holds the only reference to its table before modifying it
+lmap *lmap_own(lval *v)
 {
-	if (v->count == 0)
+	lmap *m = v->map;
+	if (m->rc == 1)
 	{
-		printf("ok");
+		return m;
 	}
-	else
+
+	lmap *n = lmap_new(m->vals == NULL, m->cap);
+	n->count = m->count;
+	for (int i = 0; i < m->cap; i++)
 	{
-		putchar(open);
-		for (int i = 0; i < v->count; i++)
+		if (m->keys[i])
 		{
-
-			// print lval within cell
-			lval_print(v->cell[i]);
-
-			// don't print trailing space
-			if (i != (v->count - 1))
+			n->hashes[i] = m->hashes[i];
+			n->keys[i] = lval_copy(m->keys[i]);
+			if (m->vals)
 			{
-				putchar(' ');
+				n->vals[i] = lval_copy(m->vals[i]);
 			}
 		}
-		putchar(close);
 	}
+	m->rc--;
+	v->map = n;
+	return n;
 }
 
-void lval_print_str(lval *v)
+// slot holding key k (hash h), or the empty slot where it would be inserted
+int lmap_find(lmap *m, lval *k, unsigned int h)
 {
-	char *lval_str_escapable = "\a\b\f\n\r\t\v\\\'\"";
-	putchar('"');
-	/* Loop over the characters in the string */
-	for (int i = 0; i < strlen(v->str); i++)
+	int mask = m->cap - 1;
+	int i = h & mask;
+	while (m->keys[i])
 	{
-		if (strchr(lval_str_escapable, v->str[i]))
-		{
-			/* If the character is escapable then escape it */
-			printf("%s", lval_str_escape(v->str[i]));
-		}
-		else
+		if (m->hashes[i] == h && lval_eq(m->keys[i], k))
 		{
-			/* Otherwise print character as it is */
-			putchar(v->str[i]);
+			return i;
 		}
+		i = (i + 1) & mask;
 	}
-	putchar('"');
+	return i;
 }
 
-void lval_print(lval *v)
+static void lmap_grow(lmap *m)
 {
-	switch (v->type)
+	int old_cap = m->cap;
+	unsigned int *hashes = m->hashes;
+	lval **keys = m->keys;
+	lval **vals = m->vals;
+
+	m->cap *= 2;
+	m->hashes = malloc(sizeof(unsigned int) * m->cap);
+	m->keys = calloc(m->cap, sizeof(lval *));
+	m->vals = vals ? calloc(m->cap, sizeof(lval *)) : NULL;
+
+	for (int i = 0; i < old_cap; i++)
 	{
-	case LVAL_NUM:
-		printf("%.2f", v->num);
-		break;
-	case LVAL_BOOL:
-		printf("%s", v->num ? "true" : "false");
-		break;
-	case LVAL_ERR:
-		printf("Error: %s", v->err);
-		break;
-	case LVAL_SYM:
-		printf("%s", v->sym);
-		break;
-	case LVAL_STR:
-		lval_print_str(v);
-		break;
-	case LVAL_SEXPR:
-		lval_expr_print(v, '(', ')');
-		break;
-	case LVAL_QEXPR:
-		lval_expr_print(v, '{', '}');
-		break;
-	case LVAL_FUN:
-		if (v->builtin)
-		{
-			printf("<builtin>");
-		}
-		else
+		if (keys[i])
 		{
-			printf("(\\ ");
-			lval_print(v->formals);
-			putchar(' ');
-			lval_print(v->body);
-			putchar(')');
+			int j = hashes[i] & (m->cap - 1);
+			while (m->keys[j])
+			{
+				j = (j + 1) & (m->cap - 1);
+			}
+			m->hashes[j] = hashes[i];
+			m->keys[j] = keys[i];
+			if (vals)
+			{
+				m->vals[j] = vals[i];
+			}
 		}
-		break;
 	}
-}
 
-void lval_println(lval *v)
-{
-	lval_print(v);
-	putchar('\n');
+	free(hashes);
+	free(keys);
+	free(vals);
 }
 
-lval *lval_call(lenv *e, lval *f, lval *a)
+// insert or replace key k. Takes ownership of k and v (v is NULL for sets).
+void lmap_put(lmap *m, lval *k, lval *v)
 {
+	// keep the load factor under 3/4
+	if ((m->count + 1) * 4 > m->cap * 3)
+	{
+		lmap_grow(m);
+	}
 
-	if (f->builtin)
+	unsigned int h = lval_hash(k);
+	int i = lmap_find(m, k, h);
+	if (m->keys[i])
 	{
-		return f->builtin(e, a);
+		lval_del(k);
+		if (m->vals)
+		{
+			lval_del(m->vals[i]);
+			m->vals[i] = v;
+		}
+		return;
 	}
 
-	int given = a->count;
-	int total = f->formals->count;
+	m->hashes[i] = h;
+	m->keys[i] = k;
+	if (m->vals)
+	{
+		m->vals[i] = v;
+	}
+	m->count++;
+}
 
-	while (a->count)
+// remove key k if present, returns whether it was
+int lmap_remove(lmap *m, lval *k)
+{
+	int mask = m->cap - 1;
+	int i = lmap_find(m, k, lval_hash(k));
+	if (m->keys[i] == NULL)
+	{
+		return 0;
+	}
+
+	lval_del(m->keys[i]);
+	if (m->vals)
 	{
+		lval_del(m->vals[i]);
+	}
+	m->keys[i] = NULL;
+	m->count--;
 
-		if (f->formals->count == 0)
+	// shift later entries of the probe run back so lookups don't stop early
+	int j = i;
+	while (1)
+	{
+		j = (j + 1) & mask;
+		if (m->keys[j] == NULL)
 		{
-			lval_del(a);
-			return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
+			break;
 		}
-
-		lval *sym = lval_pop(f->formals, 0);
-
-		if (strcmp(sym->sym, "&") == 0)
+		int home = m->hashes[j] & mask;
+		// entry at j can move to i if its home slot is not in (i, j]
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
 		{
-			if (f->formals->count != 1)
+			m->hashes[i] = m->hashes[j];
+			m->keys[i] = m->keys[j];
+			if (m->vals)
 			{
-				lval_del(a);
-				return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+				m->vals[i] = m->vals[j];
+				m->vals[j] = NULL;
 			}
-
-			lval *nsym = lval_pop(f->formals, 0);
-			lenv_put(f->env, nsym, builtin_list(e, a));
-			lval_del(sym);
-			lval_del(nsym);
-			break;
+			m->keys[j] = NULL;
+			i = j;
 		}
-
-		lval *val = lval_pop(a, 0);
-
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
 	}
+	return 1;
+}
 
-	lval_del(a);
+/* Ordered Maps and Priority Queues */
 
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0)
-	{
+lbnode *lbnode_new(int leaf)
+{
+	lbnode *n = malloc(sizeof(lbnode));
+	n->rc = 1;
+	n->n = 0;
+	n->leaf = leaf;
+	return n;
+}
 
-		// Check to ensure that & is not passed invalidly.
-		if (f->formals->count != 2)
+// drop one reference to a node, freeing its subtree on the last one
+void lbnode_del(lbnode *n)
+{
+	if (--n->rc > 0)
+	{
+		return;
+	}
+	for (int i = 0; i < n->n; i++)
+	{
+		lval_del(n->keys[i]);
+		lval_del(n->vals[i]);
+	}
+	if (!n->leaf)
+	{
+		for (int i = 0; i <= n->n; i++)
 		{
-			return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+			lbnode_del(n->kids[i]);
 		}
+	}
+	free(n);
+}
 
-		// Pop and delete '&' symbol
-		lval_del(lval_pop(f->formals, 0));
-
-		// Pop next symbol and create empty list
-		lval *sym = lval_pop(f->formals, 0);
-		lval *val = lval_qexpr();
-
-		// Bind to environment and delete
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+// make sure the node at *p is not shared before modifying it, copying it if it is
+static lbnode *lbnode_own(lbnode **p)
+{
+	lbnode *n = *p;
+	if (n->rc == 1)
+	{
+		return n;
 	}
 
-	if (f->formals->count == 0)
+	lbnode *c = lbnode_new(n->leaf);
+	c->n = n->n;
+	for (int i = 0; i < n->n; i++)
 	{
-		f->env->par = e;
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+		c->keys[i] = lval_copy(n->keys[i]);
+		c->vals[i] = lval_copy(n->vals[i]);
 	}
-	else
+	if (!n->leaf)
 	{
-		return lval_copy(f);
+		for (int i = 0; i <= n->n; i++)
+		{
+			c->kids[i] = n->kids[i];
+			c->kids[i]->rc++;
+		}
 	}
+	n->rc--;
+	*p = c;
+	return c;
 }
 
-/* LISP Environment and Associated Functions */
-
-// initalize new env
-lenv *lenv_new(void)
-{
-	lenv *v = malloc(sizeof(lenv));
-	v->par = NULL;
-	v->count = 0;
-	v->syms = NULL;
-	v->vals = NULL;
-	return v;
-}
-
-// delete env and cleanup memory
-void lenv_del(lenv *v)
+// index of the first key in n not less than k
+static int lbnode_search(lbnode *n, lval *k)
 {
-	for (int i = 0; i < v->count; i++)
+	int i = 0;
+	while (i < n->n && lval_cmp(n->keys[i], k) < 0)
 	{
-		free(v->syms[i]);
-		lval_del(v->vals[i]);
+		i++;
 	}
-
-	free(v->syms);
-	free(v->vals);
-	free(v);
+	return i;
 }
 
-// get value of variable k (lval* k) from environment (lenv* e)
-// also recursively check in parent environment for variable.
-lval *lenv_get(lenv *e, lval *k)
+// value stored under k, or NULL
+lval *lbtree_get(lbnode *n, lval *k)
 {
-	for (int i = 0; i < e->count; i++)
+	while (1)
 	{
-		if (strcmp(e->syms[i], k->sym) == 0)
+		int i = lbnode_search(n, k);
+		if (i < n->n && lval_cmp(n->keys[i], k) == 0)
+		{
+			return n->vals[i];
+		}
+		if (n->leaf)
 		{
-			return lval_copy(e->vals[i]);
+			return NULL;
 		}
+		n = n->kids[i];
 	}
+}
 
-	// check also in parent env
-	if (e->par)
-	{
-		return lenv_get(e->par, k);
-	}
-	else
+// split the full child i of x (both owned) around its median key
+static void lbnode_split(lbnode *x, int i)
+{
+	int t = BTREE_MIN_DEGREE;
+	lbnode *y = lbnode_own(&x->kids[i]);
+	lbnode *z = lbnode_new(y->leaf);
+
+	z->n = t - 1;
+	memcpy(z->keys, y->keys + t, sizeof(lval *) * (t - 1));
+	memcpy(z->vals, y->vals + t, sizeof(lval *) * (t - 1));
+	if (!y->leaf)
 	{
-		return lval_err("Unbound Symbol '%s'", k->sym);
+		memcpy(z->kids, y->kids + t, sizeof(lbnode *) * t);
 	}
+	y->n = t - 1;
+
+	memmove(x->kids + i + 2, x->kids + i + 1, sizeof(lbnode *) * (x->n - i));
+	memmove(x->keys + i + 1, x->keys + i, sizeof(lval *) * (x->n - i));
+	memmove(x->vals + i + 1, x->vals + i, sizeof(lval *) * (x->n - i));
+	x->kids[i + 1] = z;
+	x->keys[i] = y->keys[t - 1];
+	x->vals[i] = y->vals[t - 1];
+	x->n++;
 }
 
-// Put a variable and its value in the environment
-// Puts in the local enviroment (notice no check for parent env)
-void lenv_put(lenv *e, lval *k, lval *v)
+// insert or replace k in ordered map m. Takes ownership of k and v.
+// Returns whether a new key was added.
+int lbtree_put(lval *m, lval *k, lval *v)
 {
+	lbnode *x = lbnode_own(&m->root);
 
-	// check if variable already exists in env
-	for (int i = 0; i < e->count; i++)
+	if (x->n == BTREE_MAX_KEYS)
 	{
-		if (strcmp(e->syms[i], k->sym) == 0)
+		lbnode *r = lbnode_new(0);
+		r->kids[0] = x;
+		m->root = r;
+		lbnode_split(r, 0);
+		x = r;
+	}
+
+	while (1)
+	{
+		int i = lbnode_search(x, k);
+		if (i < x->n && lval_cmp(x->keys[i], k) == 0)
 		{
-			lval_del(e->vals[i]); // delete current value
-			e->vals[i] = lval_copy(v);
-			return;
+			lval_del(k);
+			lval_del(x->vals[i]);
+			x->vals[i] = v;
+			return 0;
 		}
-	}
 
-	// if variable does not exist, allocate space and add new variable to env
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-	e->syms = realloc(e->syms, sizeof(lval *) * e->count);
+		if (x->leaf)
+		{
+			memmove(x->keys + i + 1, x->keys + i, sizeof(lval *) * (x->n - i));
+			memmove(x->vals + i + 1, x->vals + i, sizeof(lval *) * (x->n - i));
+			x->keys[i] = k;
+			x->vals[i] = v;
+			x->n++;
+			m->count++;
+			return 1;
+		}
 
-	// copy contents
-	e->vals[e->count - 1] = lval_copy(v);
-	e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->syms[e->count - 1], k->sym);
+		lbnode_own(&x->kids[i]);
+		if (x->kids[i]->n == BTREE_MAX_KEYS)
+		{
+			lbnode_split(x, i);
+			int c = lval_cmp(k, x->keys[i]);
+			if (c == 0)
+			{
+				continue;
+			}
+			if (c > 0)
+			{
+				i++;
+			}
+		}
+		x = x->kids[i];
+	}
 }
 
-// define a varialbe in a global environment
-void lenv_def(lenv *e, lval *k, lval *v)
+// merge child i+1 and key i of x into child i (all owned)
+static void lbnode_merge(lbnode *x, int i)
 {
-	while (e->par)
+	lbnode *y = x->kids[i];
+	lbnode *z = x->kids[i + 1];
+
+	y->keys[y->n] = x->keys[i];
+	y->vals[y->n] = x->vals[i];
+	memcpy(y->keys + y->n + 1, z->keys, sizeof(lval *) * z->n);
+	memcpy(y->vals + y->n + 1, z->vals, sizeof(lval *) * z->n);
+	if (!y->leaf)
 	{
-		e = e->par;
+		memcpy(y->kids + y->n + 1, z->kids, sizeof(lbnode *) * (z->n + 1));
 	}
-	lenv_put(e, k, v);
+	y->n += z->n + 1;
+
+	memmove(x->keys + i, x->keys + i + 1, sizeof(lval *) * (x->n - i - 1));
+	memmove(x->vals + i, x->vals + i + 1, sizeof(lval *) * (x->n - i - 1));
+	memmove(x->kids + i + 1, x->kids + i + 2, sizeof(lbnode *) * (x->n - i - 1));
+	x->n--;
+
+	// entries now belong to y
+	free(z);
 }
 
-// copy environment to a new LIST environment
-// does not delete previous environmnet
-lenv *lenv_copy(lenv *e)
+// make sure child i of x (owned) has at least BTREE_MIN_DEGREE keys before
+// descending into it, by borrowing from a sibling or merging. Returns the
+// index of the child to descend into.
+static int lbnode_fill(lbnode *x, int i)
 {
-	lenv *n = malloc(sizeof(lenv));
-	n->par = e->par;
-	n->count = e->count;
-	n->syms = malloc(sizeof(char *) * n->count);
-	n->vals = malloc(sizeof(char *) * n->count);
-	for (int i = 0; i < n->count; i++)
+	int t = BTREE_MIN_DEGREE;
+	lbnode *c = lbnode_own(&x->kids[i]);
+	if (c->n >= t)
 	{
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
-		n->vals[i] = lval_copy(e->vals[i]);
+		return i;
 	}
 
-	return n;
-}
+	if (i > 0 && x->kids[i - 1]->n >= t)
+	{
+		// rotate the last key of the left sibling through x
+		lbnode *l = lbnode_own(&x->kids[i - 1]);
+		memmove(c->keys + 1, c->keys, sizeof(lval *) * c->n);
+		memmove(c->vals + 1, c->vals, sizeof(lval *) * c->n);
+		if (!c->leaf)
+		{
+			memmove(c->kids + 1, c->kids, sizeof(lbnode *) * (c->n + 1));
+			c->kids[0] = l->kids[l->n];
+		}
+		c->keys[0] = x->keys[i - 1];
+		c->vals[0] = x->vals[i - 1];
+		c->n++;
+		x->keys[i - 1] = l->keys[l->n - 1];
+		x->vals[i - 1] = l->vals[l->n - 1];
+		l->n--;
+		return i;
+	}
 
-/* Builtin Functions*/
+	if (i < x->n && x->kids[i + 1]->n >= t)
+	{
+		// rotate the first key of the right sibling through x
+		lbnode *r = lbnode_own(&x->kids[i + 1]);
+		c->keys[c->n] = x->keys[i];
+		c->vals[c->n] = x->vals[i];
+		if (!c->leaf)
+		{
+			c->kids[c->n + 1] = r->kids[0];
+			memmove(r->kids, r->kids + 1, sizeof(lbnode *) * r->n);
+		}
+		c->n++;
+		x->keys[i] = r->keys[0];
+		x->vals[i] = r->vals[0];
+		memmove(r->keys, r->keys + 1, sizeof(lval *) * (r->n - 1));
+		memmove(r->vals, r->vals + 1, sizeof(lval *) * (r->n - 1));
+		r->n--;
+		return i;
+	}
 
-// define macros and helper functions for error checking in builtin functions
-#define LASSERT(args, cond, fmt, ...)             \
-	if (!(cond))                                  \
-	{                                             \
-		lval *err = lval_err(fmt, ##__VA_ARGS__); \
-		lval_del(args);                           \
-		return err;                               \
+	if (i == x->n)
+	{
+		i--;
 	}
+	lbnode_own(&x->kids[i]);
+	lbnode_own(&x->kids[i + 1]);
+	lbnode_merge(x, i);
+	return i;
+}
 
-#define LASSERT_TYPE(func, args, index, expect)                     \
-	LASSERT(args, args->cell[index]->type == expect,                \
-			"Function '%s' passed incorrect type for argument %i. " \
-			"Got %s, Expected %s.",                                 \
-			func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+// remove k from ordered map m, returns whether it was present
+int lbtree_remove(lval *m, lval *k)
+{
+	if (lbtree_get(m->root, k) == NULL)
+	{
+		return 0;
+	}
 
-#define LASSERT_NUM(func, args, num)                               \
-	LASSERT(args, args->count == num,                              \
-			"Function '%s' passed incorrect number of arguments. " \
-			"Got %i, Expected %i.",                                \
-			func, args->count, num)
+	lbnode *x = lbnode_own(&m->root);
+	lval *key = lval_copy(k);
 
-#define LASSERT_NOT_EMPTY(func, args, index)                                       \
-	LASSERT(args, args->cell[index]->count != 0 || args->cell[index]->str != NULL, \
-			"Function '%s' passed {} for argument %i.", func, index);
+	while (1)
+	{
+		int i = lbnode_search(x, key);
+		int found = i < x->n && lval_cmp(x->keys[i], key) == 0;
 
-#define LASSERT_TWOTYPES(func, args, index, type1, type2)                                      \
-	LASSERT(args, args->cell[index]->type == type1 || args->cell[index]->type == type2,        \
-			"Function '%s' passed incorrect type for argument %i. Got %s, exepected %s or %s", \
-			func, index, ltype_name(args->cell[index]->type), ltype_name(type1), ltype_name(type2))
+		if (found && x->leaf)
+		{
+			lval_del(x->keys[i]);
+			lval_del(x->vals[i]);
+			memmove(x->keys + i, x->keys + i + 1, sizeof(lval *) * (x->n - i - 1));
+			memmove(x->vals + i, x->vals + i + 1, sizeof(lval *) * (x->n - i - 1));
+			x->n--;
+			break;
+		}
 
-char *ltype_name(int t)
+		if (found)
+		{
+			int t = BTREE_MIN_DEGREE;
+			if (x->kids[i]->n >= t || x->kids[i + 1]->n >= t)
+			{
+				// replace with the predecessor (or successor) and delete that instead
+				int left = x->kids[i]->n >= t;
+				lbnode *s = x->kids[left ? i : i + 1];
+				while (!s->leaf)
+				{
+					s = s->kids[left ? s->n : 0];
+				}
+				int j = left ? s->n - 1 : 0;
+				lval_del(x->keys[i]);
+				lval_del(x->vals[i]);
+				x->keys[i] = lval_copy(s->keys[j]);
+				x->vals[i] = lval_copy(s->vals[j]);
+
+				lval_del(key);
+				key = lval_copy(s->keys[j]);
+				x = lbnode_own(&x->kids[left ? i : i + 1]);
+				continue;
+			}
+
+			lbnode_own(&x->kids[i]);
+			lbnode_own(&x->kids[i + 1]);
+			lbnode_merge(x, i);
+			x = x->kids[i];
+			continue;
+		}
+
+		x = x->kids[lbnode_fill(x, i)];
+	}
+
+	// shrink the tree when the root runs out of keys
+	if (m->root->n == 0 && !m->root->leaf)
+	{
+		lbnode *r = m->root;
+		m->root = r->kids[0];
+		free(r);
+	}
+
+	lval_del(key);
+	m->count--;
+	return 1;
+}
+
+// add {k v} pairs with lo <= k <= hi to out, in key order
+void lbtree_range(lbnode *n, lval *lo, lval *hi, lval *out)
 {
-	switch (t)
+	for (int i = 0; i <= n->n; i++)
+	{
+		int above_lo = i == n->n || lo == NULL || lval_cmp(n->keys[i], lo) >= 0;
+		if (!n->leaf && above_lo)
+		{
+			lbtree_range(n->kids[i], lo, hi, out);
+		}
+		if (i == n->n)
+		{
+			break;
+		}
+		if (hi && lval_cmp(n->keys[i], hi) > 0)
+		{
+			break;
+		}
+		if (above_lo)
+		{
+			lval *pair = lval_qexpr();
+			lval_add(pair, lval_copy(n->keys[i]));
+			lval_add(pair, lval_copy(n->vals[i]));
+			lval_add(out, pair);
+		}
+	}
+}
+
+void lheap_del(lheap *h)
+{
+	if (--h->rc > 0)
+	{
+		return;
+	}
+	for (int i = 0; i < h->count; i++)
+	{
+		lval_del(h->items[i]);
+	}
+	free(h->items);
+	free(h);
+}
+
+// make sure v holds the only reference to its heap before modifying it
+lheap *lheap_own(lval *v)
+{
+	lheap *h = v->heap;
+	if (h->rc == 1)
+	{
+		return h;
+	}
+
+	lheap *c = malloc(sizeof(lheap));
+	c->rc = 1;
+	c->count = h->count;
+	c->cap = h->count;
+	c->items = malloc(sizeof(lval *) * c->cap);
+	for (int i = 0; i < h->count; i++)
+	{
+		c->items[i] = lval_copy(h->items[i]);
+	}
+	h->rc--;
+	v->heap = c;
+	return c;
+}
+
+// push x onto the heap, taking ownership of it
+void lheap_push(lheap *h, lval *x)
+{
+	if (h->count == h->cap)
+	{
+		h->cap = h->cap ? h->cap * 2 : 16;
+		h->items = realloc(h->items, sizeof(lval *) * h->cap);
+	}
+
+	// sift up
+	int i = h->count++;
+	while (i > 0 && lval_cmp(x, h->items[(i - 1) / 2]) < 0)
+	{
+		h->items[i] = h->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->items[i] = x;
+}
+
+// remove and return the smallest item of a non-empty heap
+lval *lheap_pop(lheap *h)
+{
+	lval *top = h->items[0];
+	lval *x = h->items[--h->count];
+
+	// sift down
+	int i = 0;
+	while (2 * i + 1 < h->count)
+	{
+		int c = 2 * i + 1;
+		if (c + 1 < h->count && lval_cmp(h->items[c + 1], h->items[c]) < 0)
+		{
+			c++;
+		}
+		if (lval_cmp(h->items[c], x) >= 0)
+		{
+			break;
+		}
+		h->items[i] = h->items[c];
+		i = c;
+	}
+	if (h->count > 0)
+	{
+		h->items[i] = x;
+	}
+	return top;
+}
+
+static int lval_sort_cmp(const void *x, const void *y)
+{
+	return lval_cmp(*(lval **)x, *(lval **)y);
+}
+
+// entries of an ordered map as {k v} pairs, or of a priority queue, in order.
+// Hash maps and sets give theirs in lval_cmp order.
+lval *lval_entries(lval *v)
+{
+	lval *x = lval_qexpr();
+	if (v->type == LVAL_MAP || v->type == LVAL_SET)
+	{
+		for (int i = 0; i < v->map->cap; i++)
+		{
+			if (v->map->keys[i] == NULL)
+			{
+				continue;
+			}
+			lval *k = lval_copy(v->map->keys[i]);
+			lval_add(x, v->map->vals ? lval_add(lval_add(lval_qexpr(), k), lval_copy(v->map->vals[i])) : k);
+		}
+		qsort(x->cell, x->count, sizeof(lval *), lval_sort_cmp);
+	}
+	if (v->type == LVAL_OMAP)
+	{
+		lbtree_range(v->root, NULL, NULL, x);
+	}
+	if (v->type == LVAL_PQ)
+	{
+		for (int i = 0; i < v->heap->count; i++)
+		{
+			lval_add(x, lval_copy(v->heap->items[i]));
+		}
+		qsort(x->cell, x->count, sizeof(lval *), lval_sort_cmp);
+	}
+	if (v->type == LVAL_PVEC)
+	{
+		lpvec_items(v->pnode, x);
+	}
+	return x;
+}
+
+// number of items in a list, string or collection
+int lval_len(lval *v)
+{
+	switch (v->type)
 	{
-	case LVAL_FUN:
-		return "Function";
-	case LVAL_NUM:
-		return "Number";
-	case LVAL_BOOL:
-		return "Boolean";
-	case LVAL_ERR:
-		return "Error";
-	case LVAL_SYM:
-		return "Symbol";
 	case LVAL_STR:
-		return "String";
-	case LVAL_SEXPR:
-		return "S-Expression";
-	case LVAL_QEXPR:
-		return "Q-Expression";
-	default:
-		return "Unknown";
+		return v->slen;
+	case LVAL_MAP:
+	case LVAL_SET:
+		return v->map->count;
+	case LVAL_PQ:
+		return v->heap->count;
+	case LVAL_F64VEC:
+		return v->vec->count;
+	case LVAL_MAT:
+		return v->rows;
+	}
+	return v->count;
+}
+
+/* Persistent Vectors */
+
+// Updates copy the nodes on their path unless this vector is the only one
+// using them. Concatenation joins the right spine of one tree to the left
+// spine of the other and redistributes the children met on the way, so nodes
+// stay close to full and lookups stay O(log32 n).
+#define PVEC_EXTRAS 2 // extra children per level allowed over the optimum after a concat
+
+lpnode *lpnode_new(int leaf)
+{
+	lpnode *p = malloc(sizeof(lpnode));
+	p->rc = 1;
+	p->n = 0;
+	p->leaf = leaf;
+	p->relaxed = 0;
+	return p;
+}
+
+// drop one reference to a node, freeing its subtree on the last one
+void lpnode_del(lpnode *p)
+{
+	if (--p->rc > 0)
+	{
+		return;
+	}
+	for (int i = 0; i < p->n; i++)
+	{
+		if (p->leaf)
+		{
+			lval_del(p->items[i]);
+		}
+		else
+		{
+			lpnode_del(p->kids[i]);
+		}
+	}
+	free(p);
+}
+
+// make sure the node at *pp is not shared before modifying it
+static lpnode *lpnode_own(lpnode **pp)
+{
+	lpnode *p = *pp;
+	if (p->rc == 1)
+	{
+		return p;
+	}
+
+	lpnode *c = lpnode_new(p->leaf);
+	c->n = p->n;
+	c->relaxed = p->relaxed;
+	for (int i = 0; i < p->n; i++)
+	{
+		if (p->leaf)
+		{
+			c->items[i] = lval_copy(p->items[i]);
+		}
+		else
+		{
+			c->kids[i] = p->kids[i];
+			c->kids[i]->rc++;
+			c->sizes[i] = p->sizes[i];
+		}
+	}
+	p->rc--;
+	*pp = c;
+	return c;
+}
+
+// number of items below a node
+static int lpnode_size(lpnode *p)
+{
+	return p->leaf ? p->n : p->sizes[p->n - 1];
+}
+
+// recompute the size table of an internal node whose children hold up to
+// 1 << shift items, and whether it can be indexed by radix
+static void lpnode_fix(lpnode *p, int shift)
+{
+	int total = 0;
+	p->relaxed = 0;
+	for (int i = 0; i < p->n; i++)
+	{
+		int size = lpnode_size(p->kids[i]);
+		total += size;
+		p->sizes[i] = total;
+		if (i < p->n - 1 && size != 1 << shift)
+		{
+			p->relaxed = 1;
+		}
+	}
+}
+
+// child of an internal node holding item *i, with *i made relative to it
+static int lpnode_child(lpnode *p, int shift, int *i)
+{
+	int j = *i >> shift;
+	if (!p->relaxed)
+	{
+		*i -= j << shift;
+		return j;
+	}
+	// children hold at most 1 << shift items, so j is a lower bound
+	while (p->sizes[j] <= *i)
+	{
+		j++;
+	}
+	if (j > 0)
+	{
+		*i -= p->sizes[j - 1];
+	}
+	return j;
+}
+
+lval *lpvec_nth(lval *v, int i)
+{
+	lpnode *p = v->pnode;
+	for (int shift = v->pshift; !p->leaf; shift -= PVEC_BITS)
+	{
+		p = p->kids[lpnode_child(p, shift, &i)];
+	}
+	return p->items[i];
+}
+
+static void lpnode_set(lpnode **pp, int shift, int i, lval *x)
+{
+	lpnode *p = lpnode_own(pp);
+	if (p->leaf)
+	{
+		lval_del(p->items[i]);
+		p->items[i] = x;
+		return;
+	}
+	int j = lpnode_child(p, shift, &i);
+	lpnode_set(&p->kids[j], shift - PVEC_BITS, i, x);
+}
+
+// replace item i of v with x
+void lpvec_set(lval *v, int i, lval *x)
+{
+	lpnode_set(&v->pnode, v->pshift, i, x);
+}
+
+// a chain of single child nodes down to a leaf holding x
+static lpnode *lpnode_path(int shift, lval *x)
+{
+	lpnode *p = lpnode_new(shift == 0);
+	p->n = 1;
+	if (shift == 0)
+	{
+		p->items[0] = x;
+		return p;
+	}
+	p->kids[0] = lpnode_path(shift - PVEC_BITS, x);
+	p->sizes[0] = 1;
+	return p;
+}
+
+// append x below *pp, returns 0 when the subtree has no room left
+static int lpnode_push(lpnode **pp, int shift, lval *x)
+{
+	if ((*pp)->leaf)
+	{
+		if ((*pp)->n == PVEC_WIDTH)
+		{
+			return 0;
+		}
+		lpnode *p = lpnode_own(pp);
+		p->items[p->n++] = x;
+		return 1;
+	}
+
+	lpnode *p = lpnode_own(pp);
+	if (lpnode_push(&p->kids[p->n - 1], shift - PVEC_BITS, x))
+	{
+		p->sizes[p->n - 1]++;
+		return 1;
+	}
+	if (p->n == PVEC_WIDTH)
+	{
+		return 0;
+	}
+	p->kids[p->n++] = lpnode_path(shift - PVEC_BITS, x);
+	p->sizes[p->n - 1] = p->sizes[p->n - 2] + 1;
+	if (!p->relaxed && lpnode_size(p->kids[p->n - 2]) != 1 << shift)
+	{
+		// the previous last child was a relaxed subtree that ran out of slots
+		lpnode_fix(p, shift);
+	}
+	return 1;
+}
+
+void lpvec_push(lval *v, lval *x)
+{
+	if (!lpnode_push(&v->pnode, v->pshift, x))
+	{
+		// the tree is full, grow a new root
+		lpnode *r = lpnode_new(0);
+		r->n = 2;
+		r->kids[0] = v->pnode;
+		r->kids[1] = lpnode_path(v->pshift, x);
+		v->pshift += PVEC_BITS;
+		lpnode_fix(r, v->pshift);
+		v->pnode = r;
+	}
+	v->count++;
+}
+
+// Merge the children of l (all but its last), c and r (all but its first),
+// nodes at the given shift, into as few nodes as the plan from the RRB-tree
+// paper allows. Returns a node one level up holding one or two nodes at
+// shift. Consumes c but not l or r.
+static lpnode *lpnode_rebalance(lpnode *l, lpnode *c, lpnode *r, int shift)
+{
+	lpnode *all[3 * PVEC_WIDTH];
+	int plan[3 * PVEC_WIDTH];
+	int n = 0, total = 0;
+	for (int i = 0; l && i < l->n - 1; i++)
+	{
+		all[n++] = l->kids[i];
+	}
+	for (int i = 0; i < c->n; i++)
+	{
+		all[n++] = c->kids[i];
+	}
+	for (int i = 1; r && i < r->n; i++)
+	{
+		all[n++] = r->kids[i];
+	}
+	for (int i = 0; i < n; i++)
+	{
+		plan[i] = all[i]->n;
+		total += plan[i];
+	}
+
+	// merge underfull nodes into their right neighbours until the node count
+	// is within PVEC_EXTRAS of the optimum
+	int optimal = (total - 1) / PVEC_WIDTH + 1, len = n, i = 0;
+	while (len > optimal + PVEC_EXTRAS)
+	{
+		while (plan[i] > PVEC_WIDTH - PVEC_EXTRAS / 2)
+		{
+			i++;
+		}
+		int rest = plan[i];
+		do
+		{
+			int size = rest + plan[i + 1] < PVEC_WIDTH ? rest + plan[i + 1] : PVEC_WIDTH;
+			rest = rest + plan[i + 1] - size;
+			plan[i++] = size;
+		} while (rest > 0);
+		for (int j = i; j < len - 1; j++)
+		{
+			plan[j] = plan[j + 1];
+		}
+		len--;
+		i--;
+	}
+
+	// fill the planned nodes, reusing the ones that keep their contents
+	lpnode *out[3 * PVEC_WIDTH];
+	int src = 0, off = 0;
+	for (int k = 0; k < len; k++)
+	{
+		if (off == 0 && all[src]->n == plan[k])
+		{
+			out[k] = all[src++];
+			out[k]->rc++;
+			continue;
+		}
+		lpnode *q = lpnode_new(all[src]->leaf);
+		while (q->n < plan[k])
+		{
+			lpnode *from = all[src];
+			int take = plan[k] - q->n < from->n - off ? plan[k] - q->n : from->n - off;
+			for (int j = 0; j < take; j++, off++)
+			{
+				if (q->leaf)
+				{
+					q->items[q->n++] = lval_copy(from->items[off]);
+				}
+				else
+				{
+					q->kids[q->n++] = from->kids[off];
+					from->kids[off]->rc++;
+				}
+			}
+			if (off == from->n)
+			{
+				src++;
+				off = 0;
+			}
+		}
+		if (!q->leaf)
+		{
+			lpnode_fix(q, shift - PVEC_BITS);
+		}
+		out[k] = q;
+	}
+	lpnode_del(c);
+
+	lpnode *w = lpnode_new(0);
+	for (int k = 0; k < len; k += PVEC_WIDTH)
+	{
+		lpnode *m = lpnode_new(0);
+		while (m->n < PVEC_WIDTH && k + m->n < len)
+		{
+			m->kids[m->n] = out[k + m->n];
+			m->n++;
+		}
+		lpnode_fix(m, shift);
+		w->kids[w->n++] = m;
 	}
+	lpnode_fix(w, shift + PVEC_BITS);
+	return w;
+}
+
+// concatenate two trees, returning a node one level above the taller one
+static lpnode *lpnode_concat(lpnode *l, int lshift, lpnode *r, int rshift)
+{
+	if (lshift > rshift)
+	{
+		lpnode *c = lpnode_concat(l->kids[l->n - 1], lshift - PVEC_BITS, r, rshift);
+		return lpnode_rebalance(l, c, NULL, lshift);
+	}
+	if (lshift < rshift)
+	{
+		lpnode *c = lpnode_concat(l, lshift, r->kids[0], rshift - PVEC_BITS);
+		return lpnode_rebalance(NULL, c, r, rshift);
+	}
+	if (l->leaf)
+	{
+		lpnode *c = lpnode_new(0);
+		c->n = 2;
+		c->kids[0] = l;
+		c->kids[1] = r;
+		l->rc++;
+		r->rc++;
+		lpnode_fix(c, PVEC_BITS);
+		return c;
+	}
+	lpnode *c = lpnode_concat(l->kids[l->n - 1], lshift - PVEC_BITS, r->kids[0], rshift - PVEC_BITS);
+	return lpnode_rebalance(l, c, r, lshift);
+}
+
+// append the items of w to v
+void lpvec_concat(lval *v, lval *w)
+{
+	if (w->count == 0)
+	{
+		return;
+	}
+	if (v->count == 0)
+	{
+		lpnode_del(v->pnode);
+		v->pnode = w->pnode;
+		v->pnode->rc++;
+		v->pshift = w->pshift;
+		v->count = w->count;
+		return;
+	}
+
+	int shift = (v->pshift > w->pshift ? v->pshift : w->pshift) + PVEC_BITS;
+	lpnode *p = lpnode_concat(v->pnode, v->pshift, w->pnode, w->pshift);
+	if (shift == PVEC_BITS)
+	{
+		// two leaves, let the plan merge them
+		p = lpnode_rebalance(NULL, p, NULL, shift);
+		shift += PVEC_BITS;
+	}
+
+	// drop single child roots
+	while (!p->leaf && p->n == 1)
+	{
+		lpnode *kid = p->kids[0];
+		kid->rc++;
+		lpnode_del(p);
+		p = kid;
+		shift -= PVEC_BITS;
+	}
+
+	lpnode_del(v->pnode);
+	v->pnode = p;
+	v->pshift = shift;
+	v->count += w->count;
+}
+
+// add copies of the items below p to the list x, in order
+void lpvec_items(lpnode *p, lval *x)
+{
+	for (int i = 0; i < p->n; i++)
+	{
+		if (p->leaf)
+		{
+			lval_add(x, lval_copy(p->items[i]));
+		}
+		else
+		{
+			lpvec_items(p->kids[i], x);
+		}
+	}
+}
+
+/* Lazy Sequences */
+
+// A sequence value only describes how to produce its elements: a range, a
+// list, iterating a function, or map, filter or take over another sequence.
+// Consumers walk it with a cursor that computes one element at a time, so a
+// pipeline runs in constant memory however long the sequence is.
+
+lval *lval_seq(lseq *s)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_SEQ;
+	v->seq = s;
+	return v;
+}
+
+lseq *lseq_new(int kind)
+{
+	lseq *s = calloc(1, sizeof(lseq));
+	s->rc = 1;
+	s->kind = kind;
+	return s;
+}
+
+void lseq_del(lseq *s)
+{
+	if (--s->rc > 0)
+	{
+		return;
+	}
+	if (s->fn)
+	{
+		lval_del(s->fn);
+	}
+	if (s->val)
+	{
+		lval_del(s->val);
+	}
+	if (s->src)
+	{
+		lseq_del(s->src);
+	}
+	free(s);
+}
+
+// a cursor at the start of s
+lseq_it *lseq_iter(lseq *s)
+{
+	lseq_it *it = calloc(1, sizeof(lseq_it));
+	it->s = s;
+	if (s->src)
+	{
+		it->src = lseq_iter(s->src);
+	}
+	return it;
+}
+
+void lseq_it_del(lseq_it *it)
+{
+	if (it->state)
+	{
+		lval_del(it->state);
+	}
+	if (it->src)
+	{
+		lseq_it_del(it->src);
+	}
+	free(it);
+}
+
+// the next element, NULL at the end or an error from one of the functions
+lval *lseq_next(lenv *e, lseq_it *it)
+{
+	lseq *s = it->s;
+	lval *x;
+	switch (s->kind)
+	{
+	case LSEQ_RANGE:
+	{
+		double v = s->start + it->i * s->step;
+		if (s->step > 0 ? v >= s->end : v <= s->end)
+		{
+			return NULL;
+		}
+		it->i++;
+		return lval_num(v);
+	}
+
+	case LSEQ_LIST:
+		if (it->i == s->val->count)
+		{
+			return NULL;
+		}
+		return lval_copy(s->val->cell[it->i++]);
+
+	case LSEQ_ITERATE:
+		if (it->state == NULL)
+		{
+			it->state = lval_copy(s->val);
+		}
+		else
+		{
+			it->state = lval_call(e, s->fn, lval_add(lval_sexpr(), it->state));
+			if (it->state->type == LVAL_ERR)
+			{
+				x = it->state;
+				it->state = NULL;
+				return x;
+			}
+		}
+		return lval_copy(it->state);
+
+	case LSEQ_MAP:
+		x = lseq_next(e, it->src);
+		if (x != NULL && s->eval)
+		{
+			x = lval_eval(e, x);
+		}
+		if (x == NULL || x->type == LVAL_ERR)
+		{
+			return x;
+		}
+		return lval_call(e, s->fn, lval_add(lval_sexpr(), x));
+
+	case LSEQ_FILTER:
+		while ((x = lseq_next(e, it->src)) != NULL && x->type != LVAL_ERR)
+		{
+			// the item is kept as it is, only the predicate sees its value
+			lval *arg = s->eval ? lval_eval(e, lval_copy(x)) : lval_copy(x);
+			if (arg->type == LVAL_ERR)
+			{
+				lval_del(x);
+				return arg;
+			}
+			lval *keep = lval_call(e, s->fn, lval_add(lval_sexpr(), arg));
+			if (keep->type != LVAL_NUM && keep->type != LVAL_BOOL)
+			{
+				lval_del(x);
+				if (keep->type == LVAL_ERR)
+				{
+					return keep;
+				}
+				x = lval_err("Function '%s' predicate returned %s, Expected Number or Boolean.", s->name, ltype_name(keep->type));
+				lval_del(keep);
+				return x;
+			}
+			int pass = keep->num != 0;
+			lval_del(keep);
+			if (pass)
+			{
+				return x;
+			}
+			lval_del(x);
+		}
+		return x;
+
+	case LSEQ_TAKE:
+		if (it->i == s->n)
+		{
+			return NULL;
+		}
+		it->i++;
+		return lseq_next(e, it->src);
+	}
+	return NULL;
+}
+
+// a sequence over a list or sequence argument, consuming it
+static lseq *lseq_of(lval *v)
+{
+	lseq *s;
+	if (v->type == LVAL_SEQ)
+	{
+		s = v->seq;
+		s->rc++;
+		lval_del(v);
+		return s;
+	}
+	s = lseq_new(LSEQ_LIST);
+	s->val = v;
+	return s;
+}
+
+// print the elements of a sequence like a list, computing them as it goes
+void lval_print_seq(lenv *e, lval *v)
+{
+	lseq_it *it = lseq_iter(v->seq);
+	lval *x;
+	out_char('{');
+	for (int i = 0; (x = lseq_next(e, it)) != NULL; i++)
+	{
+		if (i != 0)
+		{
+			out_char(' ');
+		}
+		lval_print(x);
+		int stop = x->type == LVAL_ERR;
+		lval_del(x);
+		if (stop)
+		{
+			break;
+		}
+	}
+	out_char('}');
+	lseq_it_del(it);
+}
+
+/* Optimizer */
+
+// Lambda bodies are optimized once, when the lambda is created. Calls of pure
+// builtins on constants are folded, ifs with a constant condition are pruned
+// and fst, snd and not are expanded in place. Bodies are not rewritten: each
+// s-expression gets a hint (OPT_*) that lval_eval_sexpr follows instead of
+// evaluating it, so printed lambdas still show their source.
+//
+// Hints are only correct while the names they rely on keep their original
+// meaning. Every binding of one of these names goes through lenv_put, which
+// marks the name dirty in opt_dirty when the new value is anything else, and
+// hints relying on a dirty name are ignored from then on.
+//
+// --opt-level 0 turns the optimizer and fusion off, 1 folds constants and
+// prunes ifs, and 2 (the default) also expands the helpers.
+
+int opt_level = 2;
+unsigned opt_dirty = 0;
+
+// names the optimizer relies on. The stdlib helpers are matched by their
+// definition as formals and body.
+static struct
+{
+	char *name;
+	lbuiltin fn;
+	char *def;
+} opt_names[] = {
+	{"+", builtin_add, NULL}, {"-", builtin_sub, NULL}, {"*", builtin_mul, NULL}, {"/", builtin_div, NULL},
+	{"%", builtin_mod, NULL}, {"min", builtin_min, NULL}, {"max", builtin_max, NULL}, {"==", builtin_eq, NULL},
+	{"!=", builtin_ne, NULL}, {">", builtin_gt, NULL}, {"<", builtin_lt, NULL}, {">=", builtin_ge, NULL},
+	{"<=", builtin_le, NULL}, {"||", builtin_or, NULL}, {"&&", builtin_and, NULL}, {"!", builtin_not, NULL},
+	{"if", builtin_if, NULL}, {"fst", NULL, "{l} {eval (head l)}"}, {"snd", NULL, "{l} {eval (head (tail l))}"},
+	{"not", NULL, "{x} {- 1 x}"},
+};
+#define OPT_NAMES (int)(sizeof(opt_names) / sizeof(opt_names[0]))
+#define OPT_NAME_IF 16
+
+// index of sym in opt_names, -1 for other names
+int opt_name(char *sym)
+{
+	// most bound names are function arguments, reject them quickly: no name
+	// is longer than three characters, and few start the same way
+	if (sym[0] == '\0' || (sym[1] && sym[2] && sym[3]) || !strchr("+-*/%m=!<>|&ifsn", sym[0]))
+	{
+		return -1;
+	}
+	for (int i = 0; i < OPT_NAMES; i++)
+	{
+		if (opt_names[i].name[0] == sym[0] && strcmp(opt_names[i].name + 1, sym + 1) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// is v what the optimizer assumes opt_names[i] to be?
+static int opt_canonical(int i, lval *v)
+{
+	static lval *defs[OPT_NAMES];
+
+	if (v->type != LVAL_FUN)
+	{
+		return 0;
+	}
+	if (opt_names[i].fn)
+	{
+		return v->builtin == opt_names[i].fn;
+	}
+	if (defs[i] == NULL)
+	{
+		int pos = 0;
+		defs[i] = lval_read_expr(opt_names[i].def, &pos, '\0');
+	}
+	return v->builtin == NULL && v->env->count == 0 && lval_eq(v->formals, defs[i]->cell[0]) &&
+		   lval_eq(v->body, defs[i]->cell[1]);
+}
+
+// called for every binding made
+void opt_note(char *sym, lval *v)
+{
+	int i = opt_name(sym);
+	if (i != -1 && !(opt_dirty & (1u << i)) && !opt_canonical(i, v))
+	{
+		opt_dirty |= 1u << i;
+	}
+}
+
+// number or boolean that x always evaluates to
+static int opt_const(lval *x)
+{
+	return x->type == LVAL_NUM || (x->type == LVAL_SEXPR && (x->opt == OPT_NUM || x->opt == OPT_BOOL));
+}
+
+// guarded names the value of the constant x relies on
+static unsigned opt_const_deps(lval *x)
+{
+	return x->type == LVAL_SEXPR ? x->opt_deps : 0;
+}
+
+static lval *opt_value(lval *x)
+{
+	if (x->type == LVAL_NUM || x->opt == OPT_NUM)
+	{
+		return lval_num(x->num);
+	}
+	lval *b = lval_bool();
+	b->num = x->num;
+	return b;
+}
+
+// v is an s-expression, or a q-expression known to be evaluated as one
+static void opt_walk(lenv *e, lval *v, int code)
+{
+	if (v->type != LVAL_SEXPR && !(v->type == LVAL_QEXPR && code))
+	{
+		if (v->type == LVAL_QEXPR)
+		{
+			for (int k = 0; k < v->count; k++)
+			{
+				opt_walk(e, v->cell[k], 0);
+			}
+		}
+		return;
+	}
+
+	v->opt = OPT_NONE;
+	int i = -1;
+	if (v->count > 1 && v->cell[0]->type == LVAL_SYM)
+	{
+		i = opt_name(v->cell[0]->sym);
+	}
+	if (i != -1 && ((opt_dirty & (1u << i)) || lenv_peek(e, v->cell[0]->sym) == NULL))
+	{
+		i = -1;
+	}
+
+	// the branches of an if are code as well
+	for (int k = 0; k < v->count; k++)
+	{
+		opt_walk(e, v->cell[k], i == OPT_NAME_IF && k >= 2);
+	}
+	if (i == -1)
+	{
+		return;
+	}
+
+	unsigned deps = 1u << i;
+	if (i == OPT_NAME_IF)
+	{
+		if (v->count != 4 || !opt_const(v->cell[1]) || v->cell[2]->type != LVAL_QEXPR ||
+			v->cell[3]->type != LVAL_QEXPR)
+		{
+			return;
+		}
+		v->opt = v->cell[1]->num ? OPT_THEN : OPT_ELSE;
+		deps |= opt_const_deps(v->cell[1]);
+	}
+	else if (!opt_names[i].fn)
+	{
+		if (opt_level < 2 || v->count != 2)
+		{
+			return;
+		}
+		v->opt = opt_names[i].name[0] == 'f' ? OPT_FST : opt_names[i].name[0] == 's' ? OPT_SND : OPT_NOT;
+	}
+	else
+	{
+		lval *a = lval_sexpr();
+		for (int k = 1; k < v->count; k++)
+		{
+			if (!opt_const(v->cell[k]))
+			{
+				lval_del(a);
+				return;
+			}
+			lval_add(a, opt_value(v->cell[k]));
+			deps |= opt_const_deps(v->cell[k]);
+		}
+
+		// errors are left for run time
+		lval *r = opt_names[i].fn(e, a);
+		if (r->type == LVAL_NUM || r->type == LVAL_BOOL)
+		{
+			v->opt = r->type == LVAL_NUM ? OPT_NUM : OPT_BOOL;
+			v->num = r->num;
+		}
+		lval_del(r);
+	}
+	v->opt_deps = deps;
+}
+
+// leave hints on the body of a lambda being defined in e
+void lval_optimize(lenv *e, lval *v)
+{
+	if (opt_level > 0)
+	{
+		opt_walk(e, v, 1);
+	}
+}
+
+// evaluate v by its hint, leaving v as it is
+lval *lval_eval_opt(lenv *e, lval *v)
+{
+	switch (v->opt)
+	{
+	case OPT_NUM:
+	case OPT_BOOL:
+		return opt_value(v);
+
+	case OPT_THEN:
+	case OPT_ELSE:
+		return lval_eval_sexpr(e, v->cell[v->opt == OPT_THEN ? 2 : 3]);
+
+	case OPT_ADD:
+	case OPT_SUB:
+	case OPT_MUL:
+	case OPT_DIV:
+	case OPT_MOD:
+	case OPT_EQ:
+	case OPT_NE:
+	case OPT_GT:
+	case OPT_LT:
+	case OPT_GE:
+	case OPT_LE:
+		return lval_eval_typed(e, v);
+
+	case OPT_NOT:
+	{
+		lval *x = lval_eval_ref(e, v->cell[1]);
+		if (x->type == LVAL_ERR)
+		{
+			return x;
+		}
+		return builtin_sub(e, lval_add(lval_add(lval_sexpr(), lval_num(1)), x));
+	}
+
+	default:
+	{
+		int snd = v->opt == OPT_SND;
+		lval *x = lval_eval_ref(e, v->cell[1]);
+		if (x->type != LVAL_ERR && snd)
+		{
+			x = builtin_tail(e, lval_add(lval_sexpr(), x));
+		}
+		if (x->type != LVAL_ERR)
+		{
+			x = builtin_head(e, lval_add(lval_sexpr(), x));
+		}
+		if (x->type == LVAL_ERR)
+		{
+			return x;
+		}
+		return builtin_eval(e, lval_add(lval_sexpr(), x));
+	}
+	}
+}
+
+/* Type Inference */
+
+// With --infer, a lambda given a name by def is typed in the style of
+// Hindley-Milner: its formals start as type variables, builtins and earlier
+// definitions contribute their signatures, instantiated afresh at every use,
+// and the constraints met in the body are unified. The signature of a
+// definition that types is kept on its body and, for the files named on the
+// command line, reported on stderr as "name : type".
+//
+// Arithmetic and comparisons whose operands are proven to be numbers get
+// typed hints (OPT_ADD to OPT_LE), run by lval_eval_typed on unboxed doubles
+// without the argument list, the checks and the operator dispatch of
+// builtin_op. Nested typed hints pass their numbers on directly. Scope is
+// dynamic, so a caller can still bind a formal to anything: values read from
+// formals, globals and calls are checked once as they are read, and the
+// builtin is called as usual when one is not a number. The explicit stack
+// evaluator and the JIT ignore the hints.
+
+bool infer_enabled = false;
+bool infer_report = false; // set once the stdlib is loaded
+
+#define INFER_MAX_ARGS 8 // operands of a typed hint
+#define INFER_SIG_SIZE 256
+#define OPT_NAME_EQ 7
+
+// Types of one definition are kept in one array and referred to by index.
+// Variables point to what they were unified with through ref, functions
+// take one argument and return res.
+enum { TY_VAR, TY_NUM, TY_BOOL, TY_STR, TY_LIST, TY_FUN };
+typedef struct
+{
+	int kind;
+	int ref; // -1 while unbound
+	int arg;
+	int res;
+} ltype;
+
+static ltype *ty_pool = NULL;
+static int ty_count = 0;
+static int ty_cap = 0;
+static char *ty_names[] = {NULL, "Number", "Boolean", "String", "List"};
+
+static int ty_new(int kind, int arg, int res)
+{
+	if (ty_count == ty_cap)
+	{
+		ty_cap = ty_cap ? ty_cap * 2 : 256;
+		ty_pool = realloc(ty_pool, sizeof(ltype) * ty_cap);
+	}
+	ty_pool[ty_count] = (ltype){kind, -1, arg, res};
+	return ty_count++;
+}
+
+static int ty_find(int t)
+{
+	while (ty_pool[t].kind == TY_VAR && ty_pool[t].ref != -1)
+	{
+		t = ty_pool[t].ref;
+	}
+	return t;
+}
+
+// does the variable v occur in t?
+static int ty_occurs(int v, int t)
+{
+	t = ty_find(t);
+	if (t == v)
+	{
+		return 1;
+	}
+	return ty_pool[t].kind == TY_FUN && (ty_occurs(v, ty_pool[t].arg) || ty_occurs(v, ty_pool[t].res));
+}
+
+static int ty_unify(int x, int y)
+{
+	x = ty_find(x);
+	y = ty_find(y);
+	if (x == y)
+	{
+		return 1;
+	}
+	if (ty_pool[y].kind == TY_VAR)
+	{
+		int t = x;
+		x = y;
+		y = t;
+	}
+	if (ty_pool[x].kind == TY_VAR)
+	{
+		if (ty_occurs(x, y))
+		{
+			return 0;
+		}
+		ty_pool[x].ref = y;
+		return 1;
+	}
+	if (ty_pool[x].kind != ty_pool[y].kind)
+	{
+		return 0;
+	}
+	return ty_pool[x].kind != TY_FUN ||
+		   (ty_unify(ty_pool[x].arg, ty_pool[y].arg) && ty_unify(ty_pool[x].res, ty_pool[y].res));
+}
+
+// read a type written like ty_print writes it, with fresh types for the
+// variables a to z kept in vars
+static int ty_parse(char **s, int *vars)
+{
+	int t;
+	if (**s == '(')
+	{
+		(*s)++;
+		t = ty_parse(s, vars);
+		(*s)++;
+	}
+	else if (**s >= 'a' && **s <= 'z')
+	{
+		int c = *(*s)++ - 'a';
+		if (vars[c] == -1)
+		{
+			vars[c] = ty_new(TY_VAR, 0, 0);
+		}
+		t = vars[c];
+	}
+	else
+	{
+		int kind = TY_NUM;
+		while (strncmp(*s, ty_names[kind], strlen(ty_names[kind])) != 0)
+		{
+			kind++;
+		}
+		*s += strlen(ty_names[kind]);
+		t = ty_new(kind, 0, 0);
+	}
+
+	if (strncmp(*s, " -> ", 4) == 0)
+	{
+		*s += 4;
+		int res = ty_parse(s, vars);
+		t = ty_new(TY_FUN, t, res);
+	}
+	return t;
+}
+
+// a fresh instance of the signature sig
+static int ty_instance(char *sig)
+{
+	int vars[26];
+	for (int i = 0; i < 26; i++)
+	{
+		vars[i] = -1;
+	}
+	return ty_parse(&sig, vars);
+}
+
+static int ty_put(char *out, size_t *len, char *s)
+{
+	size_t n = strlen(s);
+	if (*len + n >= INFER_SIG_SIZE)
+	{
+		return 0;
+	}
+	memcpy(out + *len, s, n + 1);
+	*len += n;
+	return 1;
+}
+
+// write t to out, naming the variables a, b, ... in the order they are met.
+// Returns 0 when it does not fit.
+static int ty_print(int t, char *out, size_t *len, int *vars, int *nvars)
+{
+	t = ty_find(t);
+	ltype *ty = &ty_pool[t];
+	if (ty->kind == TY_FUN)
+	{
+		int paren = ty_pool[ty_find(ty->arg)].kind == TY_FUN;
+		return (!paren || ty_put(out, len, "(")) && ty_print(ty->arg, out, len, vars, nvars) &&
+			   (!paren || ty_put(out, len, ")")) && ty_put(out, len, " -> ") &&
+			   ty_print(ty->res, out, len, vars, nvars);
+	}
+	if (ty->kind == TY_VAR)
+	{
+		int k = 0;
+		while (k < *nvars && vars[k] != t)
+		{
+			k++;
+		}
+		if (k == 26)
+		{
+			return 0;
+		}
+		if (k == *nvars)
+		{
+			vars[(*nvars)++] = t;
+		}
+		char name[2] = {'a' + k, '\0'};
+		return ty_put(out, len, name);
+	}
+	return ty_put(out, len, ty_names[ty->kind]);
+}
+
+// signatures of the builtins inference knows about. Variadic ones take one
+// or more arguments of their first type.
+static struct
+{
+	lbuiltin fn;
+	char *sig;
+	int variadic;
+} infer_builtins[] = {
+	{builtin_add, "Number -> Number", 1},
+	{builtin_sub, "Number -> Number", 1},
+	{builtin_mul, "Number -> Number", 1},
+	{builtin_div, "Number -> Number", 1},
+	{builtin_mod, "Number -> Number", 1},
+	{builtin_min, "Number -> Number", 1},
+	{builtin_max, "Number -> Number", 1},
+	{builtin_gt, "Number -> Number -> Boolean", 0},
+	{builtin_lt, "Number -> Number -> Boolean", 0},
+	{builtin_ge, "Number -> Number -> Boolean", 0},
+	{builtin_le, "Number -> Number -> Boolean", 0},
+	{builtin_eq, "a -> a -> Boolean", 0},
+	{builtin_ne, "a -> a -> Boolean", 0},
+	{builtin_or, "a -> b -> Boolean", 0},
+	{builtin_and, "a -> b -> Boolean", 0},
+	{builtin_not, "a -> Boolean", 0},
+	{builtin_list, "a -> List", 1},
+	{builtin_head, "a -> a", 0},
+	{builtin_tail, "a -> a", 0},
+	{builtin_join, "a -> a -> a", 0},
+	{builtin_cons, "Number -> List -> List", 0},
+	{builtin_len, "a -> Number", 0},
+	{builtin_substr, "String -> Number -> Number -> String", 0},
+	{builtin_nth_char, "String -> Number -> String", 0},
+	{builtin_find, "String -> String -> Number", 0},
+	{builtin_replace, "String -> String -> String -> String", 0},
+	{builtin_trim, "String -> String", 0},
+	{builtin_starts_with, "String -> String -> Boolean", 0},
+	{builtin_to_number, "String -> Number", 0},
+	{builtin_str_upper, "String -> String", 0},
+	{builtin_str_lower, "String -> String", 0},
+	{builtin_error, "String -> a", 0},
+};
+#define INFER_BUILTINS (int)(sizeof(infer_builtins) / sizeof(infer_builtins[0]))
+
+// the definition being typed
+typedef struct
+{
+	lval *formals;
+	int *args; // type of each formal
+	char *self; // name the lambda is defined as
+	int self_type;
+	struct
+	{
+		lval *v;
+		int opt;
+		int type; // of the first operand
+	} *hints; // expressions to hint once the body has typed
+	int nhints;
+} infer_state;
+
+// value of sym when the body is run, NULL for formals, the lambda itself and
+// unbound names
+static lval *infer_global(infer_state *s, lenv *e, char *sym)
+{
+	for (int k = 0; k < s->formals->count; k++)
+	{
+		if (strcmp(s->formals->cell[k]->sym, sym) == 0)
+		{
+			return NULL;
+		}
+	}
+	return strcmp(sym, s->self) == 0 ? NULL : lenv_peek(e, sym);
+}
+
+// index in infer_builtins of the builtin sym stands for, -1 for other names
+static int infer_builtin(infer_state *s, lenv *e, char *sym)
+{
+	lval *g = infer_global(s, e, sym);
+	for (int i = 0; g && g->type == LVAL_FUN && g->builtin && i < INFER_BUILTINS; i++)
+	{
+		if (infer_builtins[i].fn == g->builtin)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// type of sym read in the body, -1 when it can not be typed
+static int infer_sym(infer_state *s, lenv *e, char *sym)
+{
+	// a repeated formal is bound to its last argument
+	for (int k = s->formals->count - 1; k >= 0; k--)
+	{
+		if (strcmp(s->formals->cell[k]->sym, sym) == 0)
+		{
+			return s->args[k];
+		}
+	}
+	if (strcmp(sym, s->self) == 0)
+	{
+		return s->self_type;
+	}
+
+	int i = infer_builtin(s, e, sym);
+	if (i != -1)
+	{
+		// variadic builtins are passed on as functions of two arguments
+		int t = ty_instance(infer_builtins[i].sig);
+		if (infer_builtins[i].variadic)
+		{
+			t = ty_new(TY_FUN, ty_pool[t].arg, t);
+		}
+		return t;
+	}
+
+	lval *g = lenv_peek(e, sym);
+	switch (g ? g->type : LVAL_ERR)
+	{
+	case LVAL_FUN:
+		return !g->builtin && g->body->code && g->body->code->sig && g->env->count == 0 ? ty_instance(g->body->code->sig) : -1;
+	case LVAL_NUM:
+		return ty_new(TY_NUM, 0, 0);
+	case LVAL_BOOL:
+		return ty_new(TY_BOOL, 0, 0);
+	case LVAL_STR:
+		return ty_new(TY_STR, 0, 0);
+	case LVAL_QEXPR:
+		return ty_new(TY_LIST, 0, 0);
+	default:
+		return -1;
+	}
+}
+
+static int infer_code(infer_state *s, lenv *e, lval *v);
+
+// type of a value in the body
+static int infer_expr(infer_state *s, lenv *e, lval *x)
+{
+	switch (x->type)
+	{
+	case LVAL_NUM:
+		return ty_new(TY_NUM, 0, 0);
+	case LVAL_STR:
+		return ty_new(TY_STR, 0, 0);
+	case LVAL_QEXPR:
+		return ty_new(TY_LIST, 0, 0);
+	case LVAL_SYM:
+		return infer_sym(s, e, x->sym);
+	case LVAL_SEXPR:
+		return infer_code(s, e, x);
+	default:
+		return -1;
+	}
+}
+
+// typed hint standing for the call of opt_names[i], OPT_NONE for other names
+static int typed_opt(int i)
+{
+	if (i >= 0 && i <= OPT_MOD - OPT_ADD)
+	{
+		return OPT_ADD + i;
+	}
+	if (i >= OPT_NAME_EQ && i <= OPT_NAME_EQ + OPT_LE - OPT_EQ)
+	{
+		return OPT_EQ + i - OPT_NAME_EQ;
+	}
+	return OPT_NONE;
+}
+
+// remember v as a candidate for a typed hint if it calls an arithmetic or
+// comparison builtin by its own name
+static void infer_hint(infer_state *s, lval *v, int type)
+{
+	int i = opt_name(v->cell[0]->sym);
+	if (typed_opt(i) == OPT_NONE || (opt_dirty & (1u << i)) || v->count - 1 > INFER_MAX_ARGS || v->opt != OPT_NONE)
+	{
+		return;
+	}
+	s->hints = realloc(s->hints, sizeof(*s->hints) * (s->nhints + 1));
+	s->hints[s->nhints].v = v;
+	s->hints[s->nhints].opt = typed_opt(i);
+	s->hints[s->nhints].type = type;
+	s->nhints++;
+}
+
+// type of the code v, an s-expression or a q-expression evaluated as one
+static int infer_code(infer_state *s, lenv *e, lval *v)
+{
+	if (v->count == 0)
+	{
+		return -1;
+	}
+	if (v->count == 1)
+	{
+		return infer_expr(s, e, v->cell[0]);
+	}
+
+	lval *h = v->cell[0];
+	int n = v->count - 1;
+	int b = h->type == LVAL_SYM ? infer_builtin(s, e, h->sym) : -1;
+	lval *g = h->type == LVAL_SYM ? infer_global(s, e, h->sym) : NULL;
+
+	// both branches of an if have the type of its result
+	if (g && g->type == LVAL_FUN && g->builtin == builtin_if)
+	{
+		if (n != 3 || v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR ||
+			infer_expr(s, e, v->cell[1]) == -1)
+		{
+			return -1;
+		}
+		int t = infer_code(s, e, v->cell[2]);
+		int u = t == -1 ? -1 : infer_code(s, e, v->cell[3]);
+		return u != -1 && ty_unify(t, u) ? t : -1;
+	}
+
+	if (b != -1 && infer_builtins[b].variadic)
+	{
+		int t = ty_instance(infer_builtins[b].sig);
+		int first = -1;
+		for (int k = 1; k < v->count; k++)
+		{
+			int x = infer_expr(s, e, v->cell[k]);
+			int param = x == -1 ? -1 : ty_instance(infer_builtins[b].sig);
+			if (x == -1 || !ty_unify(x, ty_pool[param].arg))
+			{
+				return -1;
+			}
+			first = first == -1 ? x : first;
+		}
+		infer_hint(s, v, first);
+		return ty_pool[t].res;
+	}
+
+	int f = infer_expr(s, e, h);
+	if (f == -1)
+	{
+		return -1;
+	}
+
+	// builtins must be given all their arguments
+	if (b != -1)
+	{
+		int arity = 0;
+		for (int t = f; ty_pool[t].kind == TY_FUN; t = ty_pool[t].res)
+		{
+			arity++;
+		}
+		if (arity != n)
+		{
+			return -1;
+		}
+	}
+
+	int first = -1;
+	for (int k = 1; k < v->count; k++)
+	{
+		int x = infer_expr(s, e, v->cell[k]);
+		if (x == -1)
+		{
+			return -1;
+		}
+		int r = ty_new(TY_VAR, 0, 0);
+		int call = ty_new(TY_FUN, x, r);
+		if (!ty_unify(f, call))
+		{
+			return -1;
+		}
+		f = r;
+		first = first == -1 ? x : first;
+	}
+	if (b != -1)
+	{
+		infer_hint(s, v, first);
+	}
+	return f;
+}
+
+// type the lambda f defined as name in e. When it types, its signature is
+// kept on its body and its arithmetic is given typed hints.
+void lval_infer(lenv *e, char *name, lval *f)
+{
+	if (f->type != LVAL_FUN || f->builtin || (f->body->code && f->body->code->sig) || f->env->count || f->formals->count == 0)
+	{
+		return;
+	}
+	for (int k = 0; k < f->formals->count; k++)
+	{
+		if (strcmp(f->formals->cell[k]->sym, "&") == 0)
+		{
+			return;
+		}
+	}
+
+	ty_count = 0;
+	infer_state s = {f->formals, malloc(sizeof(int) * f->formals->count), name, -1, NULL, 0};
+	int res = ty_new(TY_VAR, 0, 0);
+	s.self_type = res;
+	for (int k = f->formals->count - 1; k >= 0; k--)
+	{
+		s.args[k] = ty_new(TY_VAR, 0, 0);
+		s.self_type = ty_new(TY_FUN, s.args[k], s.self_type);
+	}
+
+	int t = infer_code(&s, e, f->body);
+	char sig[INFER_SIG_SIZE];
+	size_t len = 0;
+	int vars[26], nvars = 0;
+	if (t != -1 && ty_unify(res, t) && ty_print(s.self_type, sig, &len, vars, &nvars))
+	{
+		lval_code(f->body)->sig = strdup(sig);
+		if (infer_report)
+		{
+			out_flush();
+			fprintf(stderr, "%s : %s\n", name, sig);
+		}
+
+		// the hints are left off while tracing or counting, like the JIT
+		for (int i = 0; i < s.nhints && !trace_file && perf_fd == -1; i++)
+		{
+			lval *v = s.hints[i].v;
+			if (s.hints[i].opt >= OPT_EQ && ty_pool[ty_find(s.hints[i].type)].kind != TY_NUM)
+			{
+				continue;
+			}
+			v->opt = s.hints[i].opt;
+			v->opt_deps = 1u << opt_name(v->cell[0]->sym);
+		}
+	}
+	free(s.args);
+	free(s.hints);
+}
+
+// name of the builtin a typed hint stands for, an index in opt_names
+static int typed_name(int opt)
+{
+	return opt < OPT_EQ ? opt - OPT_ADD : OPT_NAME_EQ + opt - OPT_EQ;
+}
+
+// call the builtin of the typed hint v as lval_eval_rec would, with the
+// numbers of the operands before k, x for operand k and the operands after
+// it evaluated now
+static lval *typed_fallback(lenv *e, lval *v, double *xs, int k, lval *x)
+{
+	lval *a = lval_sexpr();
+	for (int j = 0; j < k; j++)
+	{
+		lval_add(a, lval_num(xs[j]));
+	}
+	lval_add(a, x);
+	for (int j = k + 2; j < v->count; j++)
+	{
+		lval_add(a, lval_eval_ref(e, v->cell[j]));
+	}
+	for (int j = 0; j < a->count; j++)
+	{
+		if (a->cell[j]->type == LVAL_ERR)
+		{
+			return lval_take(a, j);
+		}
+	}
+	return opt_names[typed_name(v->opt)].fn(e, a);
+}
+
+static int typed_num(lenv *e, lval *v, double *n, lval **r);
+
+// evaluate the operand x of a typed hint. Returns 1 with its number in *n,
+// or 0 with the value it had instead in *r.
+static int typed_arg(lenv *e, lval *x, double *n, lval **r)
+{
+	if (x->type == LVAL_NUM)
+	{
+		*n = x->num;
+		return 1;
+	}
+	if (x->type == LVAL_SYM)
+	{
+		lval *y = lenv_peek(e, x->sym);
+		if (y && y->type == LVAL_NUM)
+		{
+			*n = y->num;
+			return 1;
+		}
+	}
+
+	if (x->type == LVAL_SEXPR && x->opt == OPT_NUM && !(x->opt_deps & opt_dirty))
+	{
+		*n = x->num;
+		return 1;
+	}
+	if (x->type == LVAL_SEXPR && x->opt >= OPT_ADD && x->opt < OPT_EQ && !(x->opt_deps & opt_dirty))
+	{
+		if (typed_num(e, x, n, r))
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		*r = lval_eval_ref(e, x);
+	}
+
+	if ((*r)->type != LVAL_NUM)
+	{
+		return 0;
+	}
+	*n = (*r)->num;
+	lval_del(*r);
+	return 1;
+}
+
+// the number computed by the typed hint of v, 1 or 0 for comparisons.
+// Returns 0 with the result in *r instead when an operand is not a number or
+// on an error.
+static int typed_num(lenv *e, lval *v, double *n, lval **r)
+{
+	// infer_code only hints calls with operands, so xs[0] is always set
+	double xs[INFER_MAX_ARGS];
+	int count = v->count - 1;
+	int k = 0;
+	do
+	{
+		if (!typed_arg(e, v->cell[k + 1], &xs[k], r))
+		{
+			*r = typed_fallback(e, v, xs, k, *r);
+			return 0;
+		}
+	} while (++k < count);
+
+	// typed hints follow the order of the operators
+	int op = v->opt - OPT_ADD;
+	if (op >= OP_EQ)
+	{
+		*n = op_test(op, xs[0], xs[1]);
+		return 1;
+	}
+
+	double x = count == 1 && op == OP_SUB ? -xs[0] : xs[0];
+	for (k = 1; k < count; k++)
+	{
+		if (op == OP_DIV && xs[k] == 0)
+		{
+			*r = lval_err("Division By Zero!");
+			return 0;
+		}
+		x = op_arith(op, x, xs[k]);
+	}
+	*n = x;
+	return 1;
+}
+
+// evaluate v by its typed hint, leaving v as it is
+lval *lval_eval_typed(lenv *e, lval *v)
+{
+	double n;
+	lval *r;
+	if (!typed_num(e, v, &n, &r))
+	{
+		return r;
+	}
+	if (v->opt < OPT_EQ)
+	{
+		return lval_num(n);
+	}
+	r = lval_bool();
+	r->num = n;
+	return r;
+}
+
+/* Fusion */
+
+// map, filter, foldl and sum over the result of a map or filter would build
+// a full list for every stage. lval_fuse marks such chains once, when a top
+// level form is read or a lambda is defined, and lval_eval_fused runs a marked
+// chain as one lazy pipeline over its source instead.
+//
+// The pipeline calls the stage functions element by element, where the
+// unfused calls run each stage over the whole list before the next, so it is
+// only taken when nothing can tell the two apart: every function in the chain
+// must be pure (see fuse_pure), and so must the source. Otherwise, or when the
+// pipeline fails, the stages are called one after another on the arguments
+// already evaluated, which gives the error the unfused calls would give.
+
+// (map f x) or (filter f x), written as an s-expression
+static int fuse_stage(lval *x)
+{
+	return x->type == LVAL_SEXPR && x->count == 3 && x->cell[0]->type == LVAL_SYM &&
+		   (strcmp(x->cell[0]->sym, "map") == 0 || strcmp(x->cell[0]->sym, "filter") == 0);
+}
+
+// a map, filter, foldl or sum whose list argument is a stage
+static int fuse_chain(lval *v)
+{
+	if (v->count < 2 || v->cell[0]->type != LVAL_SYM || !fuse_stage(v->cell[v->count - 1]))
+	{
+		return 0;
+	}
+	char *f = v->cell[0]->sym;
+	return ((strcmp(f, "map") == 0 || strcmp(f, "filter") == 0) && v->count == 3) ||
+		   (strcmp(f, "foldl") == 0 && v->count == 4) || (strcmp(f, "sum") == 0 && v->count == 2);
+}
+
+// the builtin a chain function name must still refer to
+static lbuiltin fuse_builtin(char *name)
+{
+	switch (name[0])
+	{
+	case 'm':
+		return builtin_map;
+	case 'f':
+		return name[1] == 'i' ? builtin_filter : builtin_foldl;
+	default:
+		return builtin_sum;
+	}
+}
+
+// builtin bound to sym in e, or NULL when it is unbound or a lambda
+static lbuiltin lenv_builtin(lenv *e, char *sym)
+{
+	lval *v = lenv_peek(e, sym);
+	return v && v->type == LVAL_FUN ? v->builtin : NULL;
+}
+
+// are v and all the stages below it still the builtins?
+static int fuse_guard(lenv *e, lval *v)
+{
+	for (lval *x = v;; x = x->cell[x->count - 1])
+	{
+		if (lenv_builtin(e, x->cell[0]->sym) != fuse_builtin(x->cell[0]->sym))
+		{
+			return 0;
+		}
+		if (!fuse_stage(x->cell[x->count - 1]))
+		{
+			return 1;
+		}
+	}
+}
+
+void lval_fuse(lval *v)
+{
+	if (opt_level == 0 || (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR))
+	{
+		return;
+	}
+	// q-expressions are marked too as if and lambdas evaluate them as code
+	v->fused = fuse_chain(v);
+	for (int i = 0; i < v->count; i++)
+	{
+		lval_fuse(v->cell[i]);
+	}
+}
+
+// is name one of the formals of the lambda f?
+static int fuse_formal(lval *f, char *name)
+{
+	for (int i = 0; i < f->formals->count; i++)
+	{
+		if (strcmp(f->formals->cell[i]->sym, name) == 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// is the list v, evaluated as code in the body of f, free of effects? It may
+// only call the builtins of opt_names, and if only with literal branches, as
+// the code the JIT compiles.
+static int fuse_pure_code(lenv *e, lval *f, lval *v)
+{
+	int i = -1;
+	if (v->count > 1)
+	{
+		lval *h = v->cell[0];
+		if (h->type != LVAL_SYM || fuse_formal(f, h->sym))
+		{
+			return 0;
+		}
+		i = opt_name(h->sym);
+		lval *g = lenv_peek(e, h->sym);
+		if (i == -1 || !opt_names[i].fn || !g || !opt_canonical(i, g))
+		{
+			return 0;
+		}
+		if (i == OPT_NAME_IF && (v->count != 4 || v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR))
+		{
+			return 0;
+		}
+	}
+	// a single item is a value, not a call
+	for (int k = v->count > 1; k < v->count; k++)
+	{
+		lval *x = v->cell[k];
+		if ((x->type == LVAL_SEXPR || (i == OPT_NAME_IF && k >= 2)) && !fuse_pure_code(e, f, x))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// can calling f in e have an effect, other than giving its result or an error?
+static int fuse_pure(lenv *e, lval *f)
+{
+	if (f->type != LVAL_FUN)
+	{
+		return 0;
+	}
+	if (f->builtin)
+	{
+		for (int i = 0; i < OPT_NAMES; i++)
+		{
+			if (f->builtin == opt_names[i].fn && i != OPT_NAME_IF)
+			{
+				return 1;
+			}
+		}
+		return 0;
+	}
+	return f->env->count == 0 && fuse_pure_code(e, f, f->body);
+}
+
+// map and filter evaluate the items they are given, which must not run code
+static int fuse_pure_items(lval *l)
+{
+	for (int i = 0; i < l->count; i++)
+	{
+		if (l->cell[i]->type == LVAL_SEXPR)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int fuse_pure_seq(lenv *e, lseq *s)
+{
+	switch (s->kind)
+	{
+	case LSEQ_RANGE:
+		return 1;
+	case LSEQ_LIST:
+		return fuse_pure_items(s->val);
+	case LSEQ_ITERATE:
+		return s->val->type != LVAL_SEXPR && fuse_pure(e, s->fn);
+	case LSEQ_TAKE:
+		return fuse_pure_seq(e, s->src);
+	default:
+		return fuse_pure(e, s->fn) && fuse_pure_seq(e, s->src);
+	}
+}
+
+// evaluate the stage functions of the chain below x, outermost first, and
+// then its source into a. This is the order the unfused calls evaluate them.
+static void fuse_args(lenv *e, lval *x, lval *a)
+{
+	lval_add(a, lval_eval_ref(e, x->cell[1]));
+	if (fuse_stage(x->cell[2]))
+	{
+		fuse_args(e, x->cell[2], a);
+	}
+	else
+	{
+		lval_add(a, lval_eval_ref(e, x->cell[2]));
+	}
+}
+
+// can the chain run as a pipeline on the arguments a, of which the first pre
+// belong to the outer call?
+static int fuse_pure_args(lenv *e, lval *a, int pre)
+{
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type == LVAL_ERR)
+		{
+			return 0;
+		}
+	}
+	// foldl's function, its initial value is just passed on
+	if (pre && !fuse_pure(e, a->cell[0]))
+	{
+		return 0;
+	}
+	for (int i = pre; i < a->count - 1; i++)
+	{
+		if (!fuse_pure(e, a->cell[i]))
+		{
+			return 0;
+		}
+	}
+	lval *src = a->cell[a->count - 1];
+	return src->type == LVAL_QEXPR ? fuse_pure_items(src) : src->type == LVAL_SEQ && fuse_pure_seq(e, src->seq);
+}
+
+// a lazy sequence for the stage x, whose function comes first in fs and the
+// source last. It shares the values with fs.
+static lseq *fuse_seq(lval *x, lval **fs)
+{
+	int map = x->cell[0]->sym[0] == 'm';
+	lseq *s = lseq_new(map ? LSEQ_MAP : LSEQ_FILTER);
+	s->fn = lval_share(fs[0]);
+	s->name = map ? "map" : "filter";
+	s->eval = 1;
+	s->src = fuse_stage(x->cell[2]) ? fuse_seq(x->cell[2], fs + 1) : lseq_of(lval_share(fs[1]));
+	return s;
+}
+
+// call map and filter for the stage x and those below it on the values a,
+// taking them, as the unfused chain does
+static lval *fuse_calls(lenv *e, lval *x, lval *a)
+{
+	lval *args = lval_sexpr();
+	lval_add(args, lval_pop(a, 0));
+	lval_add(args, fuse_stage(x->cell[2]) ? fuse_calls(e, x->cell[2], a) : lval_pop(a, 0));
+	for (int i = 0; i < args->count; i++)
+	{
+		if (args->cell[i]->type == LVAL_ERR)
+		{
+			return lval_take(args, i);
+		}
+	}
+	return x->cell[0]->sym[0] == 'm' ? builtin_map(e, args) : builtin_filter(e, args);
+}
+
+// evaluate a marked chain without intermediate lists where that is safe.
+// Returns NULL, having evaluated nothing, when the chain was changed or one
+// of its names was redefined, so the caller can evaluate v as usual.
+lval *lval_eval_fused(lenv *e, lval *v)
+{
+	if (!fuse_chain(v) || !fuse_guard(e, v))
+	{
+		return NULL;
+	}
+
+	// foldl's function and initial value come first
+	lval *top = fuse_stage(v) ? v : v->cell[v->count - 1];
+	int pre = top == v ? 0 : v->count - 2;
+	lval *a = lval_sexpr();
+	for (int i = 1; i <= pre; i++)
+	{
+		lval_add(a, lval_eval_ref(e, v->cell[i]));
+	}
+	fuse_args(e, top, a);
+
+	lval *r = NULL;
+	if (fuse_pure_args(e, a, pre))
+	{
+		lval *s = lval_seq(fuse_seq(top, a->cell + pre));
+		if (top == v)
+		{
+			r = builtin_seq_to_list(e, lval_add(lval_sexpr(), s));
+		}
+		else
+		{
+			// the initial value is copied as builtins may reuse their arguments
+			lval *b = lval_sexpr();
+			for (int i = 0; i < pre; i++)
+			{
+				lval_add(b, i == 0 ? lval_share(a->cell[i]) : lval_copy(a->cell[i]));
+			}
+			lval_add(b, s);
+			r = v->cell[0]->sym[0] == 'f' ? builtin_foldl(e, b) : builtin_sum(e, b);
+		}
+		if (r->type != LVAL_ERR)
+		{
+			lval_del(a);
+			return r;
+		}
+		lval_del(r);
+	}
+
+	if (top == v)
+	{
+		r = fuse_calls(e, v, a);
+		lval_del(a);
+		return r;
+	}
+	lval *b = lval_sexpr();
+	for (int i = 0; i < pre; i++)
+	{
+		lval_add(b, lval_pop(a, 0));
+	}
+	lval_add(b, fuse_calls(e, top, a));
+	lval_del(a);
+	for (int i = 0; i < b->count; i++)
+	{
+		if (b->cell[i]->type == LVAL_ERR)
+		{
+			return lval_take(b, i);
+		}
+	}
+	return v->cell[0]->sym[0] == 'f' ? builtin_foldl(e, b) : builtin_sum(e, b);
+}
+
+/* Numeric Vectors */
+
+// Elementwise kernels are plain loops the compiler vectorizes. Reductions are
+// written with AVX2 (picked at runtime) or NEON intrinsics since the compiler
+// may not reassociate floating point sums on its own; they fall back to scalar
+// loops elsewhere.
+
+void lvec_del(lvec *v)
+{
+	if (--v->rc > 0)
+	{
+		return;
+	}
+	free(v->data);
+	free(v);
+}
+
+// make sure v holds the only reference to its data before modifying it
+lvec *lvec_own(lval *v)
+{
+	lvec *x = v->vec;
+	if (x->rc == 1)
+	{
+		return x;
+	}
+
+	lvec *c = malloc(sizeof(lvec));
+	c->rc = 1;
+	c->count = x->count;
+	c->data = malloc(sizeof(double) * (x->count ? x->count : 1));
+	memcpy(c->data, x->data, sizeof(double) * x->count);
+	x->rc--;
+	v->vec = c;
+	return c;
+}
+
+// out = x op y, where a NULL array operand stands for its scalar
+void vec_arith(char op, double *out, const double *x, double xs, const double *y, double ys, int n)
+{
+	switch (op)
+	{
+	case '+':
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = (x ? x[i] : xs) + (y ? y[i] : ys);
+		}
+		break;
+	case '-':
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = (x ? x[i] : xs) - (y ? y[i] : ys);
+		}
+		break;
+	case '*':
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = (x ? x[i] : xs) * (y ? y[i] : ys);
+		}
+		break;
+	case '/':
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = (x ? x[i] : xs) / (y ? y[i] : ys);
+		}
+		break;
+	case '%':
+		for (int i = 0; i < n; i++)
+		{
+			out[i] = fmod(x ? x[i] : xs, y ? y[i] : ys);
+		}
+		break;
+	}
+}
+
+// out = 1 where x op y holds, 0 elsewhere
+void vec_compare(char *op, double *out, const double *x, double xs, const double *y, double ys, int n)
+{
+	int gt = op[0] == '>', eq = op[1] == '=';
+	for (int i = 0; i < n; i++)
+	{
+		double a = x ? x[i] : xs;
+		double b = y ? y[i] : ys;
+		out[i] = gt ? (eq ? a >= b : a > b) : (eq ? a <= b : a < b);
+	}
+}
+
+#ifdef SIMD_AVX2
+static int has_avx2(void)
+{
+	static int cached = -1;
+	if (cached == -1)
+	{
+		__builtin_cpu_init();
+		cached = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	}
+	return cached;
+}
+
+__attribute__((target("avx2,fma"))) static double hsum256(__m256d v)
+{
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma"))) static double vec_sum_avx2(const double *x, int n)
+{
+	__m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		a = _mm256_add_pd(a, _mm256_loadu_pd(x + i));
+		b = _mm256_add_pd(b, _mm256_loadu_pd(x + i + 4));
+	}
+	double r = hsum256(_mm256_add_pd(a, b));
+	for (; i < n; i++)
+	{
+		r += x[i];
+	}
+	return r;
+}
+
+__attribute__((target("avx2,fma"))) static double vec_dot_avx2(const double *x, const double *y, int n)
+{
+	__m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		a = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), a);
+		b = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), b);
+	}
+	double r = hsum256(_mm256_add_pd(a, b));
+	for (; i < n; i++)
+	{
+		r += x[i] * y[i];
+	}
+	return r;
+}
+
+__attribute__((target("avx2,fma"))) static double vec_minmax_avx2(const double *x, int n, int is_max)
+{
+	__m256d m = _mm256_set1_pd(x[0]);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d v = _mm256_loadu_pd(x + i);
+		m = is_max ? _mm256_max_pd(m, v) : _mm256_min_pd(m, v);
+	}
+	double t[4];
+	_mm256_storeu_pd(t, m);
+	double r = t[0];
+	for (int j = 1; j < 4; j++)
+	{
+		r = is_max ? (t[j] > r ? t[j] : r) : (t[j] < r ? t[j] : r);
+	}
+	for (; i < n; i++)
+	{
+		r = is_max ? (x[i] > r ? x[i] : r) : (x[i] < r ? x[i] : r);
+	}
+	return r;
+}
+#endif
+
+#ifdef SIMD_NEON
+static double vec_sum_neon(const double *x, int n)
+{
+	float64x2_t a = vdupq_n_f64(0), b = vdupq_n_f64(0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		a = vaddq_f64(a, vld1q_f64(x + i));
+		b = vaddq_f64(b, vld1q_f64(x + i + 2));
+	}
+	double r = vaddvq_f64(vaddq_f64(a, b));
+	for (; i < n; i++)
+	{
+		r += x[i];
+	}
+	return r;
+}
+
+static double vec_dot_neon(const double *x, const double *y, int n)
+{
+	float64x2_t a = vdupq_n_f64(0), b = vdupq_n_f64(0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		a = vfmaq_f64(a, vld1q_f64(x + i), vld1q_f64(y + i));
+		b = vfmaq_f64(b, vld1q_f64(x + i + 2), vld1q_f64(y + i + 2));
+	}
+	double r = vaddvq_f64(vaddq_f64(a, b));
+	for (; i < n; i++)
+	{
+		r += x[i] * y[i];
+	}
+	return r;
+}
+
+static double vec_minmax_neon(const double *x, int n, int is_max)
+{
+	float64x2_t m = vdupq_n_f64(x[0]);
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		float64x2_t v = vld1q_f64(x + i);
+		m = is_max ? vmaxq_f64(m, v) : vminq_f64(m, v);
+	}
+	double r = is_max ? vmaxvq_f64(m) : vminvq_f64(m);
+	for (; i < n; i++)
+	{
+		r = is_max ? (x[i] > r ? x[i] : r) : (x[i] < r ? x[i] : r);
+	}
+	return r;
+}
+#endif
+
+double vec_sum(const double *x, int n)
+{
+#ifdef SIMD_AVX2
+	if (has_avx2())
+	{
+		return vec_sum_avx2(x, n);
+	}
+#endif
+#ifdef SIMD_NEON
+	return vec_sum_neon(x, n);
+#endif
+	double r = 0;
+	for (int i = 0; i < n; i++)
+	{
+		r += x[i];
+	}
+	return r;
+}
+
+double vec_dot(const double *x, const double *y, int n)
+{
+#ifdef SIMD_AVX2
+	if (has_avx2())
+	{
+		return vec_dot_avx2(x, y, n);
+	}
+#endif
+#ifdef SIMD_NEON
+	return vec_dot_neon(x, y, n);
+#endif
+	double r = 0;
+	for (int i = 0; i < n; i++)
+	{
+		r += x[i] * y[i];
+	}
+	return r;
+}
+
+// smallest element of a non-empty array
+double vec_min(const double *x, int n)
+{
+#ifdef SIMD_AVX2
+	if (has_avx2())
+	{
+		return vec_minmax_avx2(x, n, 0);
+	}
+#endif
+#ifdef SIMD_NEON
+	return vec_minmax_neon(x, n, 0);
+#endif
+	double r = x[0];
+	for (int i = 1; i < n; i++)
+	{
+		r = x[i] < r ? x[i] : r;
+	}
+	return r;
+}
+
+// largest element of a non-empty array
+double vec_max(const double *x, int n)
+{
+#ifdef SIMD_AVX2
+	if (has_avx2())
+	{
+		return vec_minmax_avx2(x, n, 1);
+	}
+#endif
+#ifdef SIMD_NEON
+	return vec_minmax_neon(x, n, 1);
+#endif
+	double r = x[0];
+	for (int i = 1; i < n; i++)
+	{
+		r = x[i] > r ? x[i] : r;
+	}
+	return r;
+}
+
+/* Matrices */
+
+// Matrices are row-major arrays of doubles in the same storage as vectors.
+// The multiply splits the rows of the result between threads and walks the
+// operands in tiles small enough to stay in cache.
+#define MAT_TILE 64
+#define MAT_PARALLEL_MIN (1 << 18) // multiply-adds before threads are used
+
+// whether a rows x cols matrix is non-empty and its element count fits the
+// int count of its vector
+int mat_shape_ok(int rows, int cols)
+{
+	return rows > 0 && cols > 0 && (size_t)rows * (size_t)cols <= INT_MAX;
+}
+
+// cache blocked out = transpose of the rows x cols matrix x
+void mat_transpose(double *out, const double *x, int rows, int cols)
+{
+	for (int i0 = 0; i0 < rows; i0 += MAT_TILE)
+	{
+		for (int j0 = 0; j0 < cols; j0 += MAT_TILE)
+		{
+			int i1 = i0 + MAT_TILE < rows ? i0 + MAT_TILE : rows;
+			int j1 = j0 + MAT_TILE < cols ? j0 + MAT_TILE : cols;
+			for (int i = i0; i < i1; i++)
+			{
+				for (int j = j0; j < j1; j++)
+				{
+					out[j * rows + i] = x[i * cols + j];
+				}
+			}
+		}
+	}
+}
+
+typedef struct
+{
+	double *out;
+	const double *x;
+	const double *y;
+	int k;
+	int m;
+	int row_begin;
+	int row_end;
+} mat_job;
+
+// rows [row_begin, row_end) of out = x (n x k) * y (k x m)
+static void *mat_mul_rows(void *arg)
+{
+	mat_job *j = arg;
+	int k = j->k, m = j->m;
+
+	for (int i = j->row_begin; i < j->row_end; i++)
+	{
+		memset(j->out + (size_t)i * m, 0, sizeof(double) * m);
+	}
+
+	for (int i0 = j->row_begin; i0 < j->row_end; i0 += MAT_TILE)
+	{
+		int i1 = i0 + MAT_TILE < j->row_end ? i0 + MAT_TILE : j->row_end;
+		for (int p0 = 0; p0 < k; p0 += MAT_TILE)
+		{
+			int p1 = p0 + MAT_TILE < k ? p0 + MAT_TILE : k;
+			for (int c0 = 0; c0 < m; c0 += MAT_TILE)
+			{
+				int c1 = c0 + MAT_TILE < m ? c0 + MAT_TILE : m;
+				for (int i = i0; i < i1; i++)
+				{
+					double *row = j->out + (size_t)i * m;
+					for (int p = p0; p < p1; p++)
+					{
+						double xv = j->x[(size_t)i * k + p];
+						const double *yrow = j->y + (size_t)p * m;
+						// innermost loop is unit stride so it vectorizes
+						for (int c = c0; c < c1; c++)
+						{
+							row[c] += xv * yrow[c];
+						}
+					}
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+// out (n x m) = x (n x k) * y (k x m)
+void mat_mul(double *out, const double *x, const double *y, int n, int k, int m)
+{
+	int threads = 1;
+	if ((long long)n * k * m >= MAT_PARALLEL_MIN)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores < 1 ? 1 : cores > 8 ? 8 : cores;
+		threads = threads > n ? n : threads;
+	}
+
+	mat_job jobs[8];
+	pthread_t tids[8];
+	int spawned[8] = {0};
+	for (int t = 0; t < threads; t++)
+	{
+		jobs[t] = (mat_job){out, x, y, k, m, (int)((long long)n * t / threads), (int)((long long)n * (t + 1) / threads)};
+	}
+	for (int t = 1; t < threads; t++)
+	{
+		spawned[t] = pthread_create(&tids[t], NULL, mat_mul_rows, &jobs[t]) == 0;
+		if (!spawned[t])
+		{
+			mat_mul_rows(&jobs[t]);
+		}
+	}
+	mat_mul_rows(&jobs[0]);
+	for (int t = 1; t < threads; t++)
+	{
+		if (spawned[t])
+		{
+			pthread_join(tids[t], NULL);
+		}
+	}
+}
+
+/* Strings */
+
+// Substring search compares the first and last byte of the needle against a
+// whole register of haystack positions at once and only runs memcmp on the
+// positions where both match. Single bytes go to memchr, which libc already
+// vectorizes.
+#define STR_NOT_FOUND ((size_t)-1)
+
+static size_t str_find_scalar(const char *s, size_t n, const char *p, size_t m)
+{
+	size_t i = 0;
+	while (i + m <= n)
+	{
+		const char *c = memchr(s + i, p[0], n - m + 1 - i);
+		if (c == NULL)
+		{
+			break;
+		}
+		i = c - s;
+		if (memcmp(c + 1, p + 1, m - 1) == 0)
+		{
+			return i;
+		}
+		i++;
+	}
+	return STR_NOT_FOUND;
+}
+
+#ifdef SIMD_AVX2
+__attribute__((target("avx2"))) static size_t str_find_avx2(const char *s, size_t n, const char *p, size_t m)
+{
+	__m256i first = _mm256_set1_epi8(p[0]);
+	__m256i last = _mm256_set1_epi8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 32 <= n; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + m - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+			{
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	size_t r = str_find_scalar(s + i, n - i, p, m);
+	return r == STR_NOT_FOUND ? r : i + r;
+}
+
+// SSE2 is part of x86-64, so this needs no runtime check
+static size_t str_find_sse2(const char *s, size_t n, const char *p, size_t m)
+{
+	__m128i first = _mm_set1_epi8(p[0]);
+	__m128i last = _mm_set1_epi8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+			{
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	size_t r = str_find_scalar(s + i, n - i, p, m);
+	return r == STR_NOT_FOUND ? r : i + r;
+}
+#endif
+
+#ifdef SIMD_NEON
+static size_t str_find_neon(const char *s, size_t n, const char *p, size_t m)
+{
+	uint8x16_t first = vdupq_n_u8(p[0]);
+	uint8x16_t last = vdupq_n_u8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 16 <= n; i += 16)
+	{
+		uint8x16_t a = vceqq_u8(vld1q_u8((const uint8_t *)s + i), first);
+		uint8x16_t b = vceqq_u8(vld1q_u8((const uint8_t *)s + i + m - 1), last);
+		// narrow to 4 bits per byte since NEON has no movemask
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(a, b)), 4)), 0);
+		while (mask)
+		{
+			int bit = __builtin_ctzll(mask) / 4;
+			if (memcmp(s + i + bit + 1, p + 1, m - 2) == 0)
+			{
+				return i + bit;
+			}
+			mask &= ~(0xfull << (bit * 4));
+		}
+	}
+	size_t r = str_find_scalar(s + i, n - i, p, m);
+	return r == STR_NOT_FOUND ? r : i + r;
+}
+#endif
+
+// index of the first occurrence of p[0..m) in s[0..n), or STR_NOT_FOUND
+size_t str_find(const char *s, size_t n, const char *p, size_t m)
+{
+	if (m == 0)
+	{
+		return 0;
+	}
+	if (m > n)
+	{
+		return STR_NOT_FOUND;
+	}
+	if (m == 1)
+	{
+		const char *c = memchr(s, p[0], n);
+		return c ? (size_t)(c - s) : STR_NOT_FOUND;
+	}
+#ifdef SIMD_AVX2
+	if (has_avx2())
+	{
+		return str_find_avx2(s, n, p, m);
+	}
+	return str_find_sse2(s, n, p, m);
+#endif
+#ifdef SIMD_NEON
+	return str_find_neon(s, n, p, m);
+#endif
+	return str_find_scalar(s, n, p, m);
+}
+
+// ASCII case mapping, branch free so the compiler vectorizes it
+void str_case(char *out, const char *s, size_t n, int upper)
+{
+	unsigned char lo = upper ? 'a' : 'A';
+	for (size_t i = 0; i < n; i++)
+	{
+		unsigned char c = s[i];
+		out[i] = c ^ (((unsigned char)(c - lo) < 26) << 5);
+	}
+}
+
+// Reading LISP Values from terminal
+
+lval *lval_read_str(char *s, int *i)
+{
+
+	char *lval_str_unescapable = "abfnrtv\\\'\"";
+	// char *lval_str_escapable = "\a\b\f\n\r\t\v\\\'\"";
+
+	size_t len = 0, cap = 16;
+	char *part = malloc(cap);
+
+	/* More forward one step past initial " character */
+	(*i)++;
+	while (s[*i] != '"')
+	{
+
+		char c = s[*i];
+
+		/* If end of input then there is an unterminated string literal */
+		if (c == '\0')
+		{
+			free(part);
+			return lval_err("Unexpected end of input");
+		}
+
+		/* If backslash then unescape character after it */
+		if (c == '\\')
+		{
+			(*i)++;
+			/* Check next character is escapable */
+			if (strchr(lval_str_unescapable, s[*i]))
+			{
+				c = lval_str_unescape(s[*i]);
+			}
+			else
+			{
+				free(part);
+				return lval_err("Invalid escape sequence %c", s[*i]);
+			}
+		}
+
+		if (len == cap)
+		{
+			cap *= 2;
+			part = realloc(part, cap);
+		}
+		part[len++] = c;
+		(*i)++;
+	}
+	/* Move forward past final " character */
+	(*i)++;
+
+	lval *x = lval_str_literal(part, len);
+
+	free(part);
+	return x;
+}
+
+lval *lval_read_sym(char *s, int *i)
+{
+
+	char *part = calloc(1, 1);
+
+	/* While valid identifier characters */
+	while (strchr(
+			   "abcdefghijklmnopqrstuvwxyz"
+			   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			   "0123456789_.+-*\\%/=<>!&",
+			   s[*i]) &&
+		   s[*i] != '\0')
+	{
+
+		part = realloc(part, strlen(part) + 2);
+		part[strlen(part) + 1] = '\0';
+		part[strlen(part) + 0] = s[*i];
+		(*i)++;
+	}
+
+	int is_num = strchr("-.0123456789", part[0]) != NULL;
+	for (int j = 1; j < strlen(part); j++)
+	{
+		if (strchr(".0123456789", part[j]) == NULL)
+		{
+			is_num = 0;
+			break;
+		}
+	}
+	if (strlen(part) == 1 && part[0] == '-')
+	{
+		is_num = 0;
+	}
+
+	lval *x = NULL;
+	if (is_num)
+	{
+		errno = 0;
+		double v = strtod(part, NULL);
+		x = (errno != ERANGE) ? lval_num(v) : lval_err("Invalid Number %s", part);
+	}
+	else
+	{
+		x = lval_sym(part);
+	}
+
+	free(part);
+	return x;
+}
+
+lval *lval_read_expr(char *s, int *i, char end)
+{
+	/* Either create new qexpr or sexpr */
+	lval *x = (end == '}') ? lval_qexpr() : lval_sexpr();
+
+	/* While not at end character keep reading lvals */
+	while (s[*i] != end)
+	{
+		lval *y = lval_read(s, i);
+		/* If an error then return this and stop */
+		if (y->type == LVAL_ERR)
+		{
+			lval_del(x);
+			return y;
+		}
+		else
+		{
+			lval_add(x, y);
+		}
+	}
+
+	/* Move past end character */
+	(*i)++;
+	return x;
+}
+
+lval *lval_read(char *s, int *i)
+{
+	/* Skip all trailing whitespace and comments */
+	while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0')
+	{
+		if (s[*i] == ';')
+		{
+			while (s[*i] != '\n' && s[*i] != '\0')
+			{
+				(*i)++;
+			}
+		}
+		(*i)++;
+	}
+
+	lval *x = NULL;
+
+	/* If we reach end of input then we're missing something */
+	if (s[*i] == '\0')
+	{
+		return lval_err("Unexpected end of input");
+	}
+
+	/* If next character is ( then read S-Expr */
+	else if (s[*i] == '(')
+	{
+		(*i)++;
+		x = lval_read_expr(s, i, ')');
+	}
+
+	/* If next character is { then read Q-Expr */
+	else if (s[*i] == '{')
+	{
+		(*i)++;
+		x = lval_read_expr(s, i, '}');
+	}
+
+	/* If next character is ` or , then read the quoted expression after it */
+	else if (s[*i] == '`' || s[*i] == ',')
+	{
+		char *quote = s[*i] == '`' ? "quasiquote" : s[*i + 1] == '@' ? "unquote-splicing" : "unquote";
+		*i += s[*i] == ',' && s[*i + 1] == '@' ? 2 : 1;
+		lval *y = lval_read(s, i);
+		if (y->type == LVAL_ERR)
+		{
+			return y;
+		}
+		x = lval_add(lval_add(lval_sexpr(), lval_sym(quote)), y);
+	}
+
+	/* If next character is part of a symbol then read symbol */
+	else if (strchr(
+				 "abcdefghijklmnopqrstuvwxyz"
+				 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				 "0123456789_+-*\\%/=<>!&",
+				 s[*i]))
+	{
+		x = lval_read_sym(s, i);
+	}
+
+	/* If next character is " then read string */
+	else if (strchr("\"", s[*i]))
+	{
+		x = lval_read_str(s, i);
+	}
+
+	/* Encountered some unexpected character */
+	else
+	{
+		x = lval_err("Unexpected character %c", s[*i]);
+	}
+
+	/* Skip all trailing whitespace and comments */
+	while (strchr(" \t\v\r\n;", s[*i]) && s[*i] != '\0')
+	{
+		if (s[*i] == ';')
+		{
+			while (s[*i] != '\n' && s[*i] != '\0')
+			{
+				(*i)++;
+			}
+		}
+		(*i)++;
+	}
+
+	return x;
+}
+
+/* Explicit Stack Evaluator */
+
+// With --cek, s-expressions are evaluated by a loop over a stack of frames on
+// the heap instead of by C recursion, so how deeply a program can recurse is
+// limited by --max-depth and memory only. Builtins that call functions
+// themselves, like foldl and sort, start a nested loop on the same stack,
+// and calls are made recursively while tracing or counting.
+
+bool eval_cek = false;
+long eval_max_depth = 0; // 0 for no limit, or CEK_MAX_DEPTH with --cek
+char *eval_stack_base = NULL;
+size_t eval_stack_size = 0;
+static long eval_depth = 0;
+
+#define CEK_MAX_DEPTH 10000000
+
+// the C stack starts at base, leave an eighth of it to builtins and printing
+void eval_stack_init(char *base)
+{
+	size_t stack_size = 1 << 20;
+#ifndef _WIN32
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_STACK, &rl) == 0)
+	{
+		stack_size = rl.rlim_cur == RLIM_INFINITY ? (size_t)1 << 30 : rl.rlim_cur;
+	}
+#endif
+	eval_stack_base = base;
+	eval_stack_size = stack_size / 8 * 7;
+}
+
+// is the C stack used up to the limit?
+bool eval_stack_low(void)
+{
+	char here;
+	return eval_stack_base && (size_t)(eval_stack_base - &here) > eval_stack_size;
+}
+
+static lframe *cek_stack = NULL;
+static long cek_len = 0;
+static long cek_cap = 0;
+
+// push a frame, NULL when the stack is full
+static lframe *cek_push(int kind, lval *v, lenv *e, lval *a)
+{
+	if (cek_len >= (eval_max_depth ? eval_max_depth : CEK_MAX_DEPTH))
+	{
+		return NULL;
+	}
+	if (cek_len == cek_cap)
+	{
+		cek_cap = cek_cap ? cek_cap * 2 : 256;
+		cek_stack = realloc(cek_stack, sizeof(lframe) * cek_cap);
+	}
+	lframe *k = &cek_stack[cek_len++];
+	k->kind = kind;
+	k->name = -1;
+	k->v = v;
+	k->e = e;
+	k->a = a;
+	k->env = NULL;
+	return k;
+}
+
+static lval *cek_overflow(void)
+{
+	return lval_err("Maximum evaluation depth of %li exceeded.", eval_max_depth ? eval_max_depth : CEK_MAX_DEPTH);
+}
+
+// evaluate the expression x in e: s-expressions are left to the loop in *c,
+// anything else is evaluated right away
+static lval *cek_node(lenv *e, lval *x, lval **c)
+{
+	if (x->type == LVAL_SEXPR)
+	{
+		*c = x;
+		return NULL;
+	}
+	*c = NULL;
+	return lval_eval_ref(e, x);
+}
+
+// call with the evaluated s-expression a. Returns the result, or NULL with
+// the code to continue with in *c and *ce.
+static lval *cek_apply(lenv *e, lval *a, int name, lval **c, lenv **ce)
+{
+	*c = NULL;
+
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type == LVAL_ERR)
+		{
+			return lval_take(a, i);
+		}
+	}
+	if (a->count == 1)
+	{
+		return lval_take(a, 0);
+	}
+
+	lval *f = lval_pop(a, 0);
+	if (f->type != LVAL_FUN)
+	{
+		lval *err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
+		lval_del(a);
+		lval_del(f);
+		return err;
+	}
+
+	if (name != -1)
+	{
+		lval *r = lval_call_named(e, f, a, name);
+		lval_del(f);
+		return r;
+	}
+
+	// if and eval on q-expressions continue with the code, a is kept until it has run
+	lval *code = NULL;
+	if (f->builtin == builtin_if && a->count == 3 && (a->cell[0]->type == LVAL_NUM || a->cell[0]->type == LVAL_BOOL) &&
+		a->cell[1]->type == LVAL_QEXPR && a->cell[2]->type == LVAL_QEXPR)
+	{
+		code = a->cell[a->cell[0]->num ? 1 : 2];
+	}
+	if (f->builtin == builtin_eval && a->count == 1 && a->cell[0]->type == LVAL_QEXPR)
+	{
+		lval *err = lval_expand(e, a->cell[0]);
+		if (err)
+		{
+			lval_del(f);
+			lval_del(a);
+			return err;
+		}
+		code = a->cell[0];
+	}
+	if (f->builtin == builtin_select || f->builtin == builtin_case_of || f->builtin == builtin_let)
+	{
+		lenv *env;
+		lval *r = lval_form(e, f->builtin, a->cell, a->count, 1, &code, &env);
+		lval_del(f);
+		if (r)
+		{
+			lval_del(a);
+			return r;
+		}
+		// a, holding the code, and a new scope live until the code has run
+		lframe *k = cek_push(K_CALL, NULL, NULL, a);
+		if (!k)
+		{
+			lval_del(a);
+			if (env != e)
+			{
+				lenv_del(env);
+			}
+			return cek_overflow();
+		}
+		k->kind = env != e ? K_CALL : K_FREE;
+		k->env = env;
+		*c = code;
+		*ce = env;
+		return NULL;
+	}
+	if (code)
+	{
+		lval_del(f);
+		if (!cek_push(K_FREE, NULL, NULL, a))
+		{
+			lval_del(a);
+			return cek_overflow();
+		}
+		*c = code;
+		*ce = e;
+		return NULL;
+	}
+
+	if (f->builtin)
+	{
+		lval *r = f->builtin(e, a);
+		lval_del(f);
+		return r;
+	}
+
+	lval *r = jit_call(e, f, a);
+	if (r)
+	{
+		lval_del(f);
+		return r;
+	}
+
+	lenv *env;
+	r = lval_bind(e, f, a, &env);
+	if (r)
+	{
+		lval_del(f);
+		return r;
+	}
+	lframe *k = cek_push(K_CALL, NULL, NULL, f);
+	if (!k)
+	{
+		lenv_del(env);
+		lval_del(f);
+		return cek_overflow();
+	}
+	k->env = env;
+	*c = f->body;
+	*ce = env;
+	return NULL;
+}
+
+// evaluate v as an s-expression without modifying it, like lval_eval_rec
+lval *lval_eval_cek(lenv *e, lval *v)
+{
+	long base = cek_len;
+	lval *x = NULL; // value returned to the frame on top
+	lval *c = v;	// or the s-expression to evaluate next
+	lenv *ce = e;
+
+	while (1)
+	{
+		if (c)
+		{
+			if (c->opt && c->opt < OPT_ADD && !(c->opt_deps & opt_dirty))
+			{
+				if (c->opt == OPT_NUM || c->opt == OPT_BOOL)
+				{
+					x = opt_value(c);
+					c = NULL;
+				}
+				else if (c->opt == OPT_THEN || c->opt == OPT_ELSE)
+				{
+					c = c->cell[c->opt == OPT_THEN ? 2 : 3];
+				}
+				else if (cek_push(K_HINT, c, ce, NULL))
+				{
+					x = cek_node(ce, c->cell[1], &c);
+				}
+				else
+				{
+					x = cek_overflow();
+					c = NULL;
+				}
+				continue;
+			}
+
+			if (c->fused && (x = lval_eval_fused(ce, c)) != NULL)
+			{
+				c = NULL;
+				continue;
+			}
+
+			if (c->count == 0)
+			{
+				x = lval_sexpr();
+				c = NULL;
+				continue;
+			}
+
+			lval *a = lval_sexpr();
+			a->cell = malloc(sizeof(lval *) * c->count);
+			lframe *k = cek_push(K_ARGS, c, ce, a);
+			if (!k)
+			{
+				lval_del(a);
+				x = cek_overflow();
+				c = NULL;
+				continue;
+			}
+			if ((trace_file || perf_fd != -1) && c->cell[0]->type == LVAL_SYM)
+			{
+				k->name = lname_id(c->cell[0]->sym);
+			}
+			x = cek_node(ce, c->cell[0], &c);
+			continue;
+		}
+
+		if (cek_len == base)
+		{
+			return x;
+		}
+
+		lframe *k = &cek_stack[cek_len - 1];
+		switch (k->kind)
+		{
+		case K_ARGS:
+		{
+			lval *a = k->a;
+			a->cell[a->count++] = x;
+			lval *f = a->cell[0];
+			ce = k->e;
+
+			// if and eval with literal q-expressions run them where they are
+			if (a->count == 1 && k->name == -1 && f->type == LVAL_FUN)
+			{
+				if (f->builtin == builtin_if && k->v->count == 4 && k->v->cell[2]->type == LVAL_QEXPR &&
+					k->v->cell[3]->type == LVAL_QEXPR)
+				{
+					k->kind = K_IF;
+					x = cek_node(ce, k->v->cell[1], &c);
+					break;
+				}
+				if (f->builtin == builtin_eval && k->v->count == 2 && k->v->cell[1]->type == LVAL_QEXPR)
+				{
+					c = k->v->cell[1];
+					lval_del(a);
+					cek_len--;
+					break;
+				}
+				if (f->builtin && lval_form_literal(f->builtin, k->v->cell + 1, k->v->count - 1))
+				{
+					lenv *env;
+					lval *v = k->v;
+					lbuiltin form = f->builtin;
+					lval_del(a);
+					cek_len--;
+					x = lval_form(ce, form, v->cell + 1, v->count - 1, 0, &c, &env);
+					if (c && env != ce)
+					{
+						// a let keeps its scope until its code has run
+						lframe *s = cek_push(K_CALL, NULL, NULL, NULL);
+						if (!s)
+						{
+							lenv_del(env);
+							c = NULL;
+							x = cek_overflow();
+							break;
+						}
+						s->env = env;
+						ce = env;
+					}
+					break;
+				}
+			}
+
+			if (a->count < k->v->count)
+			{
+				x = cek_node(ce, k->v->cell[a->count], &c);
+				break;
+			}
+
+			int name = k->name;
+			cek_len--;
+			x = cek_apply(ce, a, name, &c, &ce);
+			break;
+		}
+
+		case K_IF:
+			ce = k->e;
+			if (x->type == LVAL_NUM || x->type == LVAL_BOOL)
+			{
+				c = k->v->cell[x->num ? 2 : 3];
+				lval_del(x);
+				lval_del(k->a);
+				cek_len--;
+				break;
+			}
+			// let the builtin report the error
+			k->a->cell[k->a->count++] = x;
+			k->kind = K_ARGS;
+			x = cek_node(ce, k->v->cell[2], &c);
+			break;
+
+		case K_CALL:
+			lenv_del(k->env);
+			if (k->a)
+			{
+				lval_del(k->a);
+			}
+			cek_len--;
+			break;
+
+		case K_FREE:
+			lval_del(k->a);
+			cek_len--;
+			break;
+
+		case K_HINT:
+		{
+			int opt = k->v->opt;
+			ce = k->e;
+			cek_len--;
+			if (x->type == LVAL_ERR)
+			{
+				break;
+			}
+			if (opt == OPT_NOT)
+			{
+				x = builtin_sub(ce, lval_add(lval_add(lval_sexpr(), lval_num(1)), x));
+				break;
+			}
+			if (opt == OPT_SND)
+			{
+				x = builtin_tail(ce, lval_add(lval_sexpr(), x));
+			}
+			if (x->type != LVAL_ERR)
+			{
+				x = builtin_head(ce, lval_add(lval_sexpr(), x));
+			}
+			if (x->type == LVAL_ERR || x->type != LVAL_QEXPR)
+			{
+				x = x->type == LVAL_ERR ? x : builtin_eval(ce, lval_add(lval_sexpr(), x));
+				break;
+			}
+			// evaluate the head, deleting it afterwards
+			if (!cek_push(K_FREE, NULL, NULL, x))
+			{
+				lval_del(x);
+				x = cek_overflow();
+				break;
+			}
+			c = x;
+			x = NULL;
+			break;
+		}
+		}
+	}
+}
+
+/* JIT */
+
+// Lambdas whose body only does arithmetic and comparisons on their number
+// arguments, with ifs and calls of themselves, are compiled to x86-64 code
+// once they have been called JIT_HOT times. Compiled code is only entered
+// while the names it relies on keep the meaning they had when it was
+// compiled (see opt_dirty) and all arguments are numbers. Where the
+// interpreter would give an error, like a division by zero, or recursion
+// goes too deep for the C stack, the code bails out and the call is
+// evaluated again by the interpreter. This is safe as compiled bodies have
+// no side effects.
+
+bool jit_enabled = true;
+
+#define JIT_HOT 100
+#define JIT_MAX_ARGS 8
+#define JIT_MAX_BAILS 8
+#define JIT_MAX_DEPTH 100000
+
+enum { JIT_COLD, JIT_READY, JIT_FAILED };
+
+#if defined(__x86_64__) && defined(__linux__)
+
+typedef int (*jit_fn)(double *);
+
+// depth of native calls and its limit, read by the compiled code
+static long jit_depth;
+static long jit_limit;
+
+typedef struct
+{
+	unsigned char *b;
+	int len, cap;
+	int ok;
+	lenv *e;
+	lval *f;		// the lambda being compiled
+	char *self;		// name it calls itself by
+	int self_type;	// type assumed for its result
+	unsigned deps;
+	int stack, max_stack; // bytes pushed in the frame
+	int *bails;			  // offsets of jumps to the bail out code
+	int nbails;
+} jit_asm;
+
+static void jit_emit(jit_asm *s, const char *bytes, int n)
+{
+	if (s->len + n > s->cap)
+	{
+		s->cap = s->cap * 2 + n;
+		s->b = realloc(s->b, s->cap);
+	}
+	memcpy(s->b + s->len, bytes, n);
+	s->len += n;
+}
+
+#define JIT_EMIT(s, ...) jit_emit(s, (const char[]){__VA_ARGS__}, sizeof((const char[]){__VA_ARGS__}))
+
+static void jit_emit32(jit_asm *s, int x)
+{
+	jit_emit(s, (const char *)&x, 4);
+}
+
+// mov rax, imm64
+static void jit_mov_rax(jit_asm *s, const void *p)
+{
+	JIT_EMIT(s, 0x48, 0xB8);
+	jit_emit(s, p, 8);
+}
+
+// load the double x into xmm1
+static void jit_const_xmm1(jit_asm *s, double x)
+{
+	jit_mov_rax(s, &x);
+	JIT_EMIT(s, 0x66, 0x48, 0x0F, 0x6E, 0xC8); // movq xmm1, rax
+}
+
+// conditional jump (0x84 je, 0x85 jne, 0x8A jp, 0x8F jg) or jmp for 0,
+// returning the offset of its target to patch
+static int jit_jump(jit_asm *s, int cc)
+{
+	if (cc)
+	{
+		JIT_EMIT(s, 0x0F, cc);
+	}
+	else
+	{
+		JIT_EMIT(s, 0xE9);
+	}
+	jit_emit32(s, 0);
+	return s->len - 4;
+}
+
+static void jit_patch(jit_asm *s, int at)
+{
+	int rel = s->len - (at + 4);
+	memcpy(s->b + at, &rel, 4);
+}
+
+static void jit_bail_if(jit_asm *s, int cc)
+{
+	s->bails = realloc(s->bails, sizeof(int) * (s->nbails + 1));
+	s->bails[s->nbails++] = jit_jump(s, cc);
+}
+
+static void jit_push(jit_asm *s)
+{
+	JIT_EMIT(s, 0x48, 0x83, 0xEC, 0x08, 0xF2, 0x0F, 0x11, 0x04, 0x24); // sub rsp, 8; movsd [rsp], xmm0
+	s->stack += 8;
+	if (s->stack > s->max_stack)
+	{
+		s->max_stack = s->stack;
+	}
+}
+
+// the pushed value into xmm0 and xmm0 into xmm1
+static void jit_pop_under(jit_asm *s)
+{
+	JIT_EMIT(s, 0x66, 0x0F, 0x28, 0xC8);			   // movapd xmm1, xmm0
+	JIT_EMIT(s, 0xF2, 0x0F, 0x10, 0x04, 0x24);		   // movsd xmm0, [rsp]
+	JIT_EMIT(s, 0x48, 0x83, 0xC4, 0x08);			   // add rsp, 8
+	s->stack -= 8;
+}
+
+// xmm0 = 1.0 where its bits are set, 0.0 elsewhere
+static void jit_bool(jit_asm *s)
+{
+	jit_const_xmm1(s, 1.0);
+	JIT_EMIT(s, 0x66, 0x0F, 0x54, 0xC1); // andpd xmm0, xmm1
+}
+
+enum { JT_NUM = LVAL_NUM, JT_BOOL = LVAL_BOOL };
+
+static int jit_expr(jit_asm *s, lval *x);
+
+// index of the formal sym, -1 for other names
+static int jit_formal(jit_asm *s, char *sym)
+{
+	for (int i = 0; i < s->f->formals->count; i++)
+	{
+		if (strcmp(s->f->formals->cell[i]->sym, sym) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// the code v evaluated as an s-expression, into xmm0. Returns its type, or
+// -1 when it can not be compiled.
+static int jit_code(jit_asm *s, lval *v)
+{
+	if (v->fused || v->count == 0)
+	{
+		return -1;
+	}
+	if (v->opt && v->opt < OPT_ADD && !(v->opt_deps & opt_dirty))
+	{
+		s->deps |= v->opt_deps;
+		switch (v->opt)
+		{
+		case OPT_NUM:
+		case OPT_BOOL:
+			jit_mov_rax(s, &v->num);
+			JIT_EMIT(s, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+			return v->opt == OPT_NUM ? JT_NUM : JT_BOOL;
+		case OPT_THEN:
+			return jit_code(s, v->cell[2]);
+		case OPT_ELSE:
+			return jit_code(s, v->cell[3]);
+		default:
+			return -1;
+		}
+	}
+	if (v->count == 1)
+	{
+		return jit_expr(s, v->cell[0]);
+	}
+
+	lval *h = v->cell[0];
+	int n = v->count - 1;
+	if (h->type != LVAL_SYM || jit_formal(s, h->sym) != -1)
+	{
+		return -1;
+	}
+
+	// a call of the lambda itself
+	lval *g = lenv_peek(s->e, h->sym);
+	if (g && g->type == LVAL_FUN && !g->builtin && g->body == s->f->body && g->formals == s->f->formals &&
+		g->env->count == 0 && n == s->f->formals->count && (s->self == NULL || strcmp(s->self, h->sym) == 0))
+	{
+		s->self = h->sym;
+		for (int i = n; i >= 1; i--)
+		{
+			if (jit_expr(s, v->cell[i]) != JT_NUM)
+			{
+				return -1;
+			}
+			jit_push(s);
+		}
+		JIT_EMIT(s, 0x48, 0x89, 0xE7); // mov rdi, rsp
+		JIT_EMIT(s, 0xE8);			   // call the start of the code
+		jit_emit32(s, -(s->len + 4));
+		JIT_EMIT(s, 0x85, 0xC0); // test eax, eax
+		jit_bail_if(s, 0x85);
+		JIT_EMIT(s, 0xF2, 0x0F, 0x10, 0x04, 0x24); // movsd xmm0, [rsp]
+		JIT_EMIT(s, 0x48, 0x81, 0xC4);			   // add rsp, 8n
+		jit_emit32(s, 8 * n);
+		s->stack -= 8 * n;
+		return s->self_type;
+	}
+
+	int i = opt_name(h->sym);
+	if (i == -1 || !opt_names[i].fn || (opt_dirty & (1u << i)) || !g || !opt_canonical(i, g))
+	{
+		return -1;
+	}
+	s->deps |= 1u << i;
+	char *op = opt_names[i].name;
+
+	if (i == OPT_NAME_IF)
+	{
+		if (n != 3 || v->cell[2]->type != LVAL_QEXPR || v->cell[3]->type != LVAL_QEXPR || jit_expr(s, v->cell[1]) == -1)
+		{
+			return -1;
+		}
+		JIT_EMIT(s, 0x66, 0x0F, 0x57, 0xD2); // xorpd xmm2, xmm2
+		JIT_EMIT(s, 0x66, 0x0F, 0x2E, 0xC2); // ucomisd xmm0, xmm2
+		int nan = jit_jump(s, 0x8A);
+		int other = jit_jump(s, 0x84);
+		jit_patch(s, nan);
+		int then = jit_code(s, v->cell[2]);
+		int end = jit_jump(s, 0);
+		jit_patch(s, other);
+		int otherwise = jit_code(s, v->cell[3]);
+		jit_patch(s, end);
+		return then == otherwise ? then : -1;
+	}
+
+	if (strchr("+-*/", op[0]) && op[1] == '\0')
+	{
+		if (jit_expr(s, v->cell[1]) != JT_NUM)
+		{
+			return -1;
+		}
+		if (op[0] == '-' && n == 1)
+		{
+			jit_const_xmm1(s, -0.0);
+			JIT_EMIT(s, 0x66, 0x0F, 0x57, 0xC1); // xorpd xmm0, xmm1
+			return JT_NUM;
+		}
+		for (int k = 2; k <= n; k++)
+		{
+			jit_push(s);
+			if (jit_expr(s, v->cell[k]) != JT_NUM)
+			{
+				return -1;
+			}
+			jit_pop_under(s);
+			if (op[0] == '/')
+			{
+				JIT_EMIT(s, 0x66, 0x0F, 0x57, 0xD2); // xorpd xmm2, xmm2
+				JIT_EMIT(s, 0x66, 0x0F, 0x2E, 0xCA); // ucomisd xmm1, xmm2
+				int nan = jit_jump(s, 0x8A);
+				jit_bail_if(s, 0x84);
+				jit_patch(s, nan);
+			}
+			char code = op[0] == '+' ? 0x58 : op[0] == '-' ? 0x5C : op[0] == '*' ? 0x59 : 0x5E;
+			JIT_EMIT(s, 0xF2, 0x0F, code, 0xC1); // addsd, subsd, mulsd or divsd xmm0, xmm1
+		}
+		return JT_NUM;
+	}
+
+	if (op[0] == '!' && op[1] == '\0')
+	{
+		if (n != 1 || jit_expr(s, v->cell[1]) == -1)
+		{
+			return -1;
+		}
+		JIT_EMIT(s, 0x66, 0x0F, 0x57, 0xC9);	   // xorpd xmm1, xmm1
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xC1, 0x00); // cmpeqsd xmm0, xmm1
+		jit_bool(s);
+		return JT_BOOL;
+	}
+
+	// the comparisons and logic take two numbers or booleans
+	int ta, tb;
+	if (n != 2 || (ta = jit_expr(s, v->cell[1])) == -1)
+	{
+		return -1;
+	}
+	jit_push(s);
+	if ((tb = jit_expr(s, v->cell[2])) == -1)
+	{
+		return -1;
+	}
+	jit_pop_under(s);
+	if (strcmp(op, "||") == 0 || strcmp(op, "&&") == 0)
+	{
+		JIT_EMIT(s, 0x66, 0x0F, 0x57, 0xD2);	   // xorpd xmm2, xmm2
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xC2, 0x04); // cmpneqsd xmm0, xmm2
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xCA, 0x04); // cmpneqsd xmm1, xmm2
+		JIT_EMIT(s, 0x66, 0x0F, op[0] == '|' ? 0x56 : 0x54, 0xC1); // orpd or andpd xmm0, xmm1
+	}
+	else if (op[0] == '=' || op[0] == '!')
+	{
+		// values of different types are never equal
+		if (ta != tb)
+		{
+			return -1;
+		}
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xC1, op[0] == '=' ? 0x00 : 0x04); // cmpeqsd or cmpneqsd xmm0, xmm1
+	}
+	else if (op[0] == '<')
+	{
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xC1, op[1] ? 0x02 : 0x01); // cmplesd or cmpltsd xmm0, xmm1
+	}
+	else if (op[0] == '>')
+	{
+		JIT_EMIT(s, 0xF2, 0x0F, 0xC2, 0xC8, op[1] ? 0x02 : 0x01); // cmplesd or cmpltsd xmm1, xmm0
+		JIT_EMIT(s, 0x66, 0x0F, 0x28, 0xC1);					  // movapd xmm0, xmm1
+	}
+	else
+	{
+		return -1;
+	}
+	jit_bool(s);
+	return JT_BOOL;
+}
+
+// a value in the code, into xmm0
+static int jit_expr(jit_asm *s, lval *x)
+{
+	switch (x->type)
+	{
+	case LVAL_NUM:
+		jit_mov_rax(s, &x->num);
+		JIT_EMIT(s, 0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+		return JT_NUM;
+	case LVAL_SYM:
+	{
+		int i = jit_formal(s, x->sym);
+		if (i == -1)
+		{
+			return -1;
+		}
+		JIT_EMIT(s, 0xF2, 0x0F, 0x10, 0x83); // movsd xmm0, [rbx + 8i]
+		jit_emit32(s, 8 * i);
+		return JT_NUM;
+	}
+	case LVAL_SEXPR:
+		return jit_code(s, x);
+	default:
+		return -1;
+	}
+}
+
+// compile the lambda f called in e, assuming its result has type self_type
+static int jit_compile(ljit *j, lenv *e, lval *f, int self_type)
+{
+	jit_asm s = {0};
+	s.e = e;
+	s.f = f;
+	s.self_type = self_type;
+
+	JIT_EMIT(&s, 0x55, 0x48, 0x89, 0xE5, 0x53, 0x48, 0x89, 0xFB); // push rbp; mov rbp, rsp; push rbx; mov rbx, rdi
+	jit_mov_rax(&s, &(long *){&jit_depth});
+	JIT_EMIT(&s, 0x48, 0xFF, 0x00, 0x48, 0x8B, 0x08); // inc qword [rax]; mov rcx, [rax]
+	jit_mov_rax(&s, &(long *){&jit_limit});
+	JIT_EMIT(&s, 0x48, 0x3B, 0x08); // cmp rcx, [rax]
+	jit_bail_if(&s, 0x8F);
+
+	int type = jit_code(&s, f->body);
+
+	JIT_EMIT(&s, 0xF2, 0x0F, 0x11, 0x03); // movsd [rbx], xmm0
+	jit_mov_rax(&s, &(long *){&jit_depth});
+	JIT_EMIT(&s, 0x48, 0xFF, 0x08, 0x31, 0xC0); // dec qword [rax]; xor eax, eax
+	int done = jit_jump(&s, 0);
+	for (int i = 0; i < s.nbails; i++)
+	{
+		jit_patch(&s, s.bails[i]);
+	}
+	JIT_EMIT(&s, 0xB8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+	jit_patch(&s, done);
+	JIT_EMIT(&s, 0x48, 0x8D, 0x65, 0xF8, 0x5B, 0x5D, 0xC3); // lea rsp, [rbp - 8]; pop rbx; pop rbp; ret
+
+	if (type == self_type)
+	{
+		size_t size = (s.len + 4095) & ~(size_t)4095;
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			memcpy(p, s.b, s.len);
+			if (mprotect(p, size, PROT_READ | PROT_EXEC) == 0)
+			{
+				j->code = p;
+				j->size = size;
+				j->type = type;
+				j->deps = s.deps;
+				j->frame = 32 + s.max_stack;
+				j->self = s.self ? strdup(s.self) : NULL;
+			}
+			else
+			{
+				munmap(p, size);
+			}
+		}
+	}
+	free(s.b);
+	free(s.bails);
+	return j->code ? 1 : type;
+}
+
+// compile f, checking its formals first
+static void jit_try(ljit *j, lenv *e, lval *f)
+{
+	j->state = JIT_FAILED;
+	lval *formals = f->formals;
+	if (formals->count == 0 || formals->count > JIT_MAX_ARGS)
+	{
+		return;
+	}
+	for (int i = 0; i < formals->count; i++)
+	{
+		if (strcmp(formals->cell[i]->sym, "&") == 0)
+		{
+			return;
+		}
+		for (int k = 0; k < i; k++)
+		{
+			if (strcmp(formals->cell[i]->sym, formals->cell[k]->sym) == 0)
+			{
+				return;
+			}
+		}
+	}
+	// a result of the other type means it was assumed wrongly for self calls
+	if (jit_compile(j, e, f, JT_NUM) == JT_BOOL)
+	{
+		jit_compile(j, e, f, JT_BOOL);
+	}
+	if (j->code)
+	{
+		j->formals = f->formals;
+		j->state = JIT_READY;
+	}
+}
+
+void jit_free(ljit *j)
+{
+	if (j->code)
+	{
+		munmap(j->code, j->size);
+	}
+	free(j->self);
+	free(j);
+}
+
+// call the lambda f on a with compiled code, NULL when it is left to the
+// interpreter
+lval *jit_call(lenv *e, lval *f, lval *a)
+{
+	if (!jit_enabled || trace_file || perf_fd != -1)
+	{
+		return NULL;
+	}
+	lcode *c = lval_code(f->body);
+	ljit *j = c->jit;
+	if (j == NULL)
+	{
+		j = c->jit = calloc(1, sizeof(ljit));
+	}
+	if (j->state == JIT_COLD)
+	{
+		if (++j->calls < JIT_HOT)
+		{
+			return NULL;
+		}
+		jit_try(j, e, f);
+	}
+	if (j->state != JIT_READY || f->formals != j->formals || f->env->count || a->count != f->formals->count ||
+		(j->deps & opt_dirty))
+	{
+		return NULL;
+	}
+	if (j->self)
+	{
+		lval *g = lenv_peek(e, j->self);
+		if (!g || g->type != LVAL_FUN || g->body != f->body || g->formals != f->formals)
+		{
+			return NULL;
+		}
+	}
+
+	double args[JIT_MAX_ARGS];
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type != LVAL_NUM)
+		{
+			return NULL;
+		}
+		args[i] = a->cell[i]->num;
+	}
+
+	// stay within the C stack and the evaluation depth
+	char here;
+	jit_limit = JIT_MAX_DEPTH;
+	if (eval_stack_base)
+	{
+		size_t used = eval_stack_base - &here;
+		long room = used < eval_stack_size ? (eval_stack_size - used) / j->frame : 0;
+		jit_limit = room < jit_limit ? room : jit_limit;
+	}
+	if (eval_max_depth && eval_max_depth < jit_limit)
+	{
+		jit_limit = eval_max_depth;
+	}
+	jit_depth = 0;
+
+	if (((jit_fn)j->code)(args))
+	{
+		if (++j->bails == JIT_MAX_BAILS)
+		{
+			j->state = JIT_FAILED;
+		}
+		return NULL;
+	}
+	lval_del(a);
+	lval *r = lval_num(args[0]);
+	r->type = j->type;
+	return r;
+}
+
+#else
+
+void jit_free(ljit *j)
+{
+	free(j);
+}
+
+lval *jit_call(lenv *e, lval *f, lval *a)
+{
+	return NULL;
+}
+
+#endif
+
+// Evaluating expressions in LISP values
+
+// evaluate v as an s-expression without modifying it. v may also be a
+// q-expression such as a lambda body or the branch of an if, so code runs
+// where it is stored.
+lval *lval_eval_sexpr(lenv *e, lval *v)
+{
+	// stop well before the C stack runs out
+	if (eval_stack_low())
+	{
+		return lval_err("Evaluation nested too deeply for the C stack. Run with --cek to evaluate on the heap.");
+	}
+
+	if (eval_cek)
+	{
+		return lval_eval_cek(e, v);
+	}
+
+	if (eval_max_depth && eval_depth >= eval_max_depth)
+	{
+		return lval_err("Maximum evaluation depth of %li exceeded.", eval_max_depth);
+	}
+	eval_depth++;
+	lval *r = lval_eval_rec(e, v);
+	eval_depth--;
+	return r;
+}
+
+// the recursive evaluator, evaluated arguments are collected in a new list
+lval *lval_eval_rec(lenv *e, lval *v)
+{
+
+	if (v->opt && !(v->opt_deps & opt_dirty))
+	{
+		return lval_eval_opt(e, v);
+	}
+
+	if (v->fused)
+	{
+		lval *r = lval_eval_fused(e, v);
+		if (r != NULL)
+		{
+			return r;
+		}
+	}
+
+	// empty expression
+	if (v->count == 0)
+	{
+		return lval_sexpr();
+	}
+
+	// remember the name the function is called by, for tracing and counters
+	int name = -1;
+	if ((trace_file || perf_fd != -1) && v->cell[0]->type == LVAL_SYM)
+	{
+		name = lname_id(v->cell[0]->sym);
+	}
+
+	lval *a = lval_sexpr();
+	a->cell = malloc(sizeof(lval *) * v->count);
+	a->cell[a->count++] = lval_eval_ref(e, v->cell[0]);
+	lval *f = a->cell[0];
+
+	// if and eval run a literal q-expression in place instead of a copy of it
+	if (name == -1 && f->type == LVAL_FUN && f->builtin == builtin_if && v->count == 4 &&
+		v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR)
+	{
+		lval *c = lval_eval_ref(e, v->cell[1]);
+		if (c->type == LVAL_NUM || c->type == LVAL_BOOL)
+		{
+			lval *branch = v->cell[c->num ? 2 : 3];
+			lval_del(c);
+			lval_del(a);
+			return lval_eval_sexpr(e, branch);
+		}
+		a->cell[a->count++] = c;
+	}
+	if (name == -1 && f->type == LVAL_FUN && f->builtin == builtin_eval && v->count == 2 &&
+		v->cell[1]->type == LVAL_QEXPR)
+	{
+		lval_del(a);
+		return lval_eval_sexpr(e, v->cell[1]);
+	}
+	if (name == -1 && f->type == LVAL_FUN && f->builtin && lval_form_literal(f->builtin, v->cell + 1, v->count - 1))
+	{
+		lval *code;
+		lenv *env;
+		lval *r = lval_form(e, f->builtin, v->cell + 1, v->count - 1, 0, &code, &env);
+		lval_del(a);
+		if (r == NULL)
+		{
+			r = lval_eval_sexpr(env, code);
+			if (env != e)
+			{
+				lenv_del(env);
+			}
+		}
+		return r;
+	}
+
+	// evaluate children of s-expression
+	for (int i = a->count; i < v->count; i++)
+	{
+		a->cell[a->count++] = lval_eval_ref(e, v->cell[i]);
+	}
+
+	// check if any children evaluates to an error
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type == LVAL_ERR)
+		{
+			return lval_take(a, i);
+		}
+	}
+
+	// single expression
+	if (a->count == 1)
+	{
+		return lval_take(a, 0);
+	}
+
+	// ensure first element is function
+	f = lval_pop(a, 0);
+	if (f->type != LVAL_FUN)
+	{
+		lval *err = lval_err("S-Expression starts with incorrect type. Got %s, Expected %s.", ltype_name(f->type), ltype_name(LVAL_FUN));
+		lval_del(a);
+		lval_del(f);
+		return err;
+	}
+
+	if (name != -1)
+	{
+		lval *result = lval_call_named(e, f, a, name);
+		lval_del(f);
+		return result;
+	}
+
+	lval *result = lval_call(e, f, a);
+	lval_del(f);
+	return result;
+}
+
+// evaluate v, leaving it as it is
+lval *lval_eval_ref(lenv *e, lval *v)
+{
+	if (v->type == LVAL_SYM)
+	{
+		return lenv_get(e, v);
+	}
+
+	if (v->type == LVAL_SEXPR)
+	{
+		return lval_eval_sexpr(e, v);
+	}
+	return lval_copy(v);
+}
+
+// evaluate v, taking it
+lval *lval_eval(lenv *e, lval *v)
+{
+	if (v->type == LVAL_SYM)
+	{
+		lval *x = lenv_get(e, v);
+		lval_del(v);
+		return x;
+	}
+
+	if (v->type == LVAL_SEXPR)
+	{
+		lval *x = lval_eval_sexpr(e, v);
+		lval_del(v);
+		return x;
+	}
+	return v;
+}
+
+/* Output */
+
+// Everything the interpreter prints is collected in one large buffer and
+// written out when it fills up, before the REPL prompt, on flush and at exit.
+// --unbuffered writes it out after every print instead.
+#define OUT_BUF_SIZE (1 << 16)
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len = 0;
+bool out_unbuffered = false;
+
+void out_flush(void)
+{
+	fwrite(out_buf, 1, out_len, stdout);
+	out_len = 0;
+	fflush(stdout);
+}
+
+void out_write(const char *s, size_t n)
+{
+	if (out_len + n > OUT_BUF_SIZE)
+	{
+		out_flush();
+		if (n > OUT_BUF_SIZE)
+		{
+			fwrite(s, 1, n, stdout);
+			return;
+		}
+	}
+	memcpy(out_buf + out_len, s, n);
+	out_len += n;
+}
+
+void out_char(char c)
+{
+	if (out_len == OUT_BUF_SIZE)
+	{
+		out_flush();
+	}
+	out_buf[out_len++] = c;
+}
+
+void out_str(const char *s)
+{
+	out_write(s, strlen(s));
+}
+
+// write x exactly as printf("%.2f") would. Values are rounded to hundredths
+// in integer arithmetic, using fma to recover the rounding error of x * 100
+// so ties and near-ties round the same way as printf.
+void out_num(double x)
+{
+	double ax = fabs(x);
+	if (!(ax < 4e13))
+	{
+		// large, infinite and nan values are rare enough for printf
+		char tmp[512];
+		out_write(tmp, snprintf(tmp, sizeof(tmp), "%.2f", x));
+		return;
+	}
+
+	double p = ax * 100, err = fma(ax, 100, -p), f = floor(p), d = p - f;
+	long long r = (long long)f;
+	if (d > 0.5 || (d == 0.5 && (err > 0 || (err == 0 && (r & 1)))))
+	{
+		r++;
+	}
+
+	char tmp[24];
+	int i = sizeof(tmp);
+	tmp[--i] = '0' + r % 10;
+	tmp[--i] = '0' + r / 10 % 10;
+	tmp[--i] = '.';
+	r /= 100;
+	do
+	{
+		tmp[--i] = '0' + r % 10;
+		r /= 10;
+	} while (r);
+	if (signbit(x))
+	{
+		tmp[--i] = '-';
+	}
+	out_write(tmp + i, sizeof(tmp) - i);
+}
+
+// Printing LISP values to terminal
+void lval_expr_print(lval *v, char open, char close)
+{
+	if (v->count == 0)
+	{
+		out_str("ok");
+	}
+	else
+	{
+		out_char(open);
+		for (int i = 0; i < v->count; i++)
+		{
+
+			// print lval within cell
+			lval_print(v->cell[i]);
+
+			// don't print trailing space
+			if (i != (v->count - 1))
+			{
+				out_char(' ');
+			}
+		}
+		out_char(close);
+	}
+}
+
+void lval_print_str(lval *v)
+{
+	char *lval_str_escapable = "\a\b\f\n\r\t\v\\\'\"";
+	out_char('"');
+	/* Write runs of plain characters at once and escape the rest */
+	char *str = lval_sdata(v);
+	size_t run = 0;
+	for (size_t i = 0; i < v->slen; i++)
+	{
+		if (str[i] && strchr(lval_str_escapable, str[i]))
+		{
+			out_write(str + run, i - run);
+			out_str(lval_str_escape(str[i]));
+			run = i + 1;
+		}
+	}
+	out_write(str + run, v->slen - run);
+	out_char('"');
+}
+
+void lval_map_print(lval *v)
+{
+	int first = 1;
+	out_str("#{");
+	for (int i = 0; i < v->map->cap; i++)
+	{
+		if (v->map->keys[i] == NULL)
+		{
+			continue;
+		}
+		if (!first)
+		{
+			out_str(v->map->vals ? ", " : " ");
+		}
+		first = 0;
+		lval_print(v->map->keys[i]);
+		if (v->map->vals)
+		{
+			out_char(' ');
+			lval_print(v->map->vals[i]);
+		}
+	}
+	out_char('}');
+}
+
+// print an ordered map, priority queue or persistent vector in order
+void lval_ordered_print(lval *v)
+{
+	lval *xs = lval_entries(v);
+	out_str(v->type == LVAL_OMAP ? "#omap{" : v->type == LVAL_PQ ? "#pq{" : "#pvec[");
+	for (int i = 0; i < xs->count; i++)
+	{
+		if (i != 0)
+		{
+			out_str(v->type == LVAL_OMAP ? ", " : " ");
+		}
+		if (v->type == LVAL_OMAP)
+		{
+			lval_print(xs->cell[i]->cell[0]);
+			out_char(' ');
+			lval_print(xs->cell[i]->cell[1]);
+		}
+		else
+		{
+			lval_print(xs->cell[i]);
+		}
+	}
+	out_char(v->type == LVAL_PVEC ? ']' : '}');
+	lval_del(xs);
+}
+
+void lval_vec_print(lval *v)
+{
+	out_str("#f64[");
+	for (int i = 0; i < v->vec->count; i++)
+	{
+		if (i != 0)
+		{
+			out_char(' ');
+		}
+		out_num(v->vec->data[i]);
+	}
+	out_char(']');
+}
+
+void lval_mat_print(lval *v)
+{
+	out_str("#mat[");
+	for (int i = 0; i < v->rows; i++)
+	{
+		out_str(i ? " [" : "[");
+		for (int j = 0; j < v->cols; j++)
+		{
+			if (j != 0)
+			{
+				out_char(' ');
+			}
+			out_num(v->vec->data[i * v->cols + j]);
+		}
+		out_char(']');
+	}
+	out_char(']');
+}
+
+void lval_print(lval *v)
+{
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		out_num(v->num);
+		break;
+	case LVAL_BOOL:
+		out_str(v->num ? "true" : "false");
+		break;
+	case LVAL_ERR:
+		out_str("Error: ");
+		out_str(v->err);
+		break;
+	case LVAL_SYM:
+		out_str(v->sym);
+		break;
+	case LVAL_STR:
+		lval_print_str(v);
+		break;
+	case LVAL_SEXPR:
+		lval_expr_print(v, '(', ')');
+		break;
+	case LVAL_QEXPR:
+		lval_expr_print(v, '{', '}');
+		break;
+	case LVAL_MAP:
+	case LVAL_SET:
+		lval_map_print(v);
+		break;
+	case LVAL_OMAP:
+	case LVAL_PQ:
+	case LVAL_PVEC:
+		lval_ordered_print(v);
+		break;
+	case LVAL_F64VEC:
+		lval_vec_print(v);
+		break;
+	case LVAL_SEQ:
+		// printing the elements needs an environment, see lval_print_seq
+		out_str("<seq>");
+		break;
+	case LVAL_MAT:
+		lval_mat_print(v);
+		break;
+	case LVAL_FUN:
+		if (v->builtin)
+		{
+			out_str("<builtin>");
+		}
+		else
+		{
+			out_str("(\\ ");
+			lval_print(v->formals);
+			out_char(' ');
+			lval_print(v->body);
+			out_char(')');
+		}
+		break;
+	}
+}
+
+void lval_println(lval *v)
+{
+	lval_print(v);
+	out_char('\n');
+	if (out_unbuffered)
+	{
+		out_flush();
+	}
+}
+
+// call f on the arguments a. f is not modified: arguments are bound in a new
+// environment, which becomes part of the result when only some are given.
+lval *lval_call(lenv *e, lval *f, lval *a)
+{
+
+	if (f->builtin)
+	{
+		return f->builtin(e, a);
+	}
+
+	lval *r = jit_call(e, f, a);
+	if (r)
+	{
+		return r;
+	}
+
+	lenv *env;
+	r = lval_bind(e, f, a, &env);
+	if (r == NULL)
+	{
+		r = f->body->code && f->body->code->aot ? f->body->code->aot(env) : lval_eval_sexpr(env, f->body);
+		lenv_del(env);
+	}
+	return r;
+}
+
+// bind the arguments a of the lambda f. Returns NULL and sets *env to the
+// environment to evaluate the body in when all formals are bound, otherwise
+// the result of the call: an error or a function of the remaining formals.
+lval *lval_bind(lenv *e, lval *f, lval *a, lenv **env_out)
+{
+	lval *formals = f->formals;
+	int given = a->count;
+	int total = formals->count;
+	int bound = 0;
+
+	// start from the arguments of earlier partial applications
+	lenv *env = lenv_copy(f->env);
+
+	while (a->count)
+	{
+
+		if (bound == total)
+		{
+			lval_del(a);
+			lenv_del(env);
+			return lval_err("Function passed too many arguments. Got %i, Expected %i.", given, total);
+		}
+
+		lval *sym = formals->cell[bound++];
+
+		if (strcmp(sym->sym, "&") == 0)
+		{
+			if (total - bound != 1)
+			{
+				lval_del(a);
+				lenv_del(env);
+				return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+			}
+
+			lenv_bind(env, formals->cell[bound++]->sym, builtin_list(e, a));
+			a = NULL;
+			break;
+		}
+
+		lenv_bind(env, sym->sym, lval_pop(a, 0));
+	}
+
+	if (a)
+	{
+		lval_del(a);
+	}
+
+	if (bound < total && strcmp(formals->cell[bound]->sym, "&") == 0)
+	{
+
+		// Check to ensure that & is not passed invalidly.
+		if (total - bound != 2)
+		{
+			lenv_del(env);
+			return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+		}
+
+		// bind the symbol after & to an empty list
+		lenv_bind(env, formals->cell[bound + 1]->sym, lval_qexpr());
+		bound += 2;
+	}
+
+	if (bound == total)
+	{
+		env->par = e;
+		*env_out = env;
+		return NULL;
+	}
+
+	// a function of the remaining formals
+	lval *g = lval_lambda(lval_qexpr(), lval_share(f->body));
+	lenv_del(g->env);
+	g->env = env;
+	for (; bound < total; bound++)
+	{
+		lval_add(g->formals, lval_copy(formals->cell[bound]));
+	}
+	return g;
+}
+
+// call a function that was looked up by name, recording it in the trace
+// (lambdas only) and in the performance counters
+lval *lval_call_named(lenv *e, lval *f, lval *a, int name)
+{
+	int traced = trace_file && !f->builtin;
+	long long before[PERF_COUNTERS];
+
+	if (traced)
+	{
+		trace_event(name, 'l', 'B');
+	}
+	if (perf_fd != -1)
+	{
+		perf_read(before);
+	}
+
+	lval *result = lval_call(e, f, a);
+
+	if (perf_fd != -1)
+	{
+		perf_account(name, before);
+	}
+	if (traced)
+	{
+		trace_event(name, 'l', 'E');
+	}
+	return result;
+}
+
+/* LISP Environment and Associated Functions */
+
+// Scope is dynamic, so a name is looked up through the environments of all
+// callers before the global one. To keep deep recursion linear, bindings
+// outside the global environment are counted by hash of their name, and a
+// name no other environment binds is looked up in the global one directly.
+#define LENV_LOCAL_SLOTS 4096
+static int lenv_locals[LENV_LOCAL_SLOTS];
+lenv *lenv_global = NULL;
+
+static int *lenv_local_count(char *sym)
+{
+	return &lenv_locals[hash_mem(2166136261u, sym, strlen(sym)) & (LENV_LOCAL_SLOTS - 1)];
+}
+
+// where to start looking sym up from e
+static lenv *lenv_from(lenv *e, char *sym)
+{
+	return lenv_global && *lenv_local_count(sym) == 0 ? lenv_global : e;
+}
+
+// initalize new env
+lenv *lenv_new(void)
+{
+	lenv *v = malloc(sizeof(lenv));
+	v->par = NULL;
+	v->count = 0;
+	v->syms = NULL;
+	v->vals = NULL;
+	return v;
+}
+
+// delete env and cleanup memory
+void lenv_del(lenv *v)
+{
+	for (int i = 0; i < v->count; i++)
+	{
+		if (v != lenv_global)
+		{
+			(*lenv_local_count(v->syms[i]))--;
+		}
+		free(v->syms[i]);
+		lval_del(v->vals[i]);
+	}
+
+	free(v->syms);
+	free(v->vals);
+	free(v);
+}
+
+// get value of variable k (lval* k) from environment (lenv* e)
+// also recursively check in parent environment for variable.
+lval *lenv_get(lenv *e, lval *k)
+{
+	lval *v = lenv_peek(e, k->sym);
+	if (v == NULL)
+	{
+		return lval_err("Unbound Symbol '%s'", k->sym);
+	}
+	return lval_copy(v);
+}
+
+// value of sym in e or its parents without copying it, NULL when unbound
+lval *lenv_peek(lenv *e, char *sym)
+{
+	for (e = lenv_from(e, sym); e; e = e->par)
+	{
+		for (int i = 0; i < e->count; i++)
+		{
+			if (strcmp(e->syms[i], sym) == 0)
+			{
+				return e->vals[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+// Put a variable and its value in the environment
+// Puts in the local enviroment (notice no check for parent env)
+void lenv_put(lenv *e, lval *k, lval *v)
+{
+	lenv_bind(e, k->sym, lval_copy(v));
+}
+
+// like lenv_put, but takes v instead of copying it
+void lenv_bind(lenv *e, char *sym, lval *v)
+{
+	opt_note(sym, v);
+
+	// check if variable already exists in env
+	for (int i = 0; i < e->count; i++)
+	{
+		if (strcmp(e->syms[i], sym) == 0)
+		{
+			lval_del(e->vals[i]); // delete current value
+			e->vals[i] = v;
+			return;
+		}
+	}
+
+	// if variable does not exist, allocate space and add new variable to env
+	e->count++;
+	e->vals = realloc(e->vals, sizeof(lval *) * e->count);
+	e->syms = realloc(e->syms, sizeof(lval *) * e->count);
+
+	e->vals[e->count - 1] = v;
+	e->syms[e->count - 1] = malloc(strlen(sym) + 1);
+	strcpy(e->syms[e->count - 1], sym);
+	if (e != lenv_global)
+	{
+		(*lenv_local_count(sym))++;
+	}
+}
+
+// define a varialbe in a global environment
+void lenv_def(lenv *e, lval *k, lval *v)
+{
+	while (e->par)
+	{
+		e = e->par;
+	}
+	lenv_put(e, k, v);
+}
+
+// copy environment to a new LIST environment
+// does not delete previous environmnet
+lenv *lenv_copy(lenv *e)
+{
+	lenv *n = malloc(sizeof(lenv));
+	n->par = e->par;
+	n->count = e->count;
+	n->syms = NULL;
+	n->vals = NULL;
+	if (n->count == 0)
+	{
+		return n;
+	}
+	n->syms = malloc(sizeof(char *) * n->count);
+	n->vals = malloc(sizeof(char *) * n->count);
+	for (int i = 0; i < n->count; i++)
+	{
+		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+		strcpy(n->syms[i], e->syms[i]);
+		(*lenv_local_count(n->syms[i]))++;
+		n->vals[i] = lval_copy(e->vals[i]);
+	}
+
+	return n;
+}
+
+/* Builtin Functions*/
+
+// define macros and helper functions for error checking in builtin functions
+#define LASSERT(args, cond, fmt, ...)             \
+	if (!(cond))                                  \
+	{                                             \
+		lval *err = lval_err(fmt, ##__VA_ARGS__); \
+		lval_del(args);                           \
+		return err;                               \
+	}
+
+#define LASSERT_TYPE(func, args, index, expect)                     \
+	LASSERT(args, args->cell[index]->type == expect,                \
+			"Function '%s' passed incorrect type for argument %i. " \
+			"Got %s, Expected %s.",                                 \
+			func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num)                               \
+	LASSERT(args, args->count == num,                              \
+			"Function '%s' passed incorrect number of arguments. " \
+			"Got %i, Expected %i.",                                \
+			func, args->count, num)
+
+#define LASSERT_NOT_EMPTY(func, args, index)            \
+	LASSERT(args, lval_len(args->cell[index]) != 0,     \
+			"Function '%s' passed {} for argument %i.", func, index);
+
+// a number argument used as an index or a count, which must convert to int
+#define LASSERT_INT(func, args, index)                                                                 \
+	LASSERT(args, args->cell[index]->num == floor(args->cell[index]->num) &&                           \
+					  fabs(args->cell[index]->num) <= INT_MAX,                                         \
+			"Function '%s' passed %g for argument %i. Expected a whole number between %i and %i.", \
+			func, args->cell[index]->num, index, -INT_MAX, INT_MAX)
+
+#define LASSERT_TWOTYPES(func, args, index, type1, type2)                                      \
+	LASSERT(args, args->cell[index]->type == type1 || args->cell[index]->type == type2,        \
+			"Function '%s' passed incorrect type for argument %i. Got %s, exepected %s or %s", \
+			func, index, ltype_name(args->cell[index]->type), ltype_name(type1), ltype_name(type2))
+
+char *ltype_name(int t)
+{
+	switch (t)
+	{
+	case LVAL_FUN:
+		return "Function";
+	case LVAL_NUM:
+		return "Number";
+	case LVAL_BOOL:
+		return "Boolean";
+	case LVAL_ERR:
+		return "Error";
+	case LVAL_SYM:
+		return "Symbol";
+	case LVAL_STR:
+		return "String";
+	case LVAL_SEXPR:
+		return "S-Expression";
+	case LVAL_QEXPR:
+		return "Q-Expression";
+	case LVAL_MAP:
+		return "Map";
+	case LVAL_SET:
+		return "Set";
+	case LVAL_OMAP:
+		return "Ordered Map";
+	case LVAL_PQ:
+		return "Priority Queue";
+	case LVAL_F64VEC:
+		return "F64 Vector";
+	case LVAL_MAT:
+		return "Matrix";
+	case LVAL_PVEC:
+		return "Persistent Vector";
+	case LVAL_SEQ:
+		return "Lazy Sequence";
+	default:
+		return "Unknown";
+	}
+}
+
+static int is_array(lval *v)
+{
+	return v->type == LVAL_F64VEC || v->type == LVAL_MAT;
+}
+
+// error for array operands that cannot be combined elementwise, else NULL
+static lval *array_shape_err(char *op, lval *x, lval *y)
+{
+	if (!is_array(x) || !is_array(y))
+	{
+		return NULL;
+	}
+	if (x->type != y->type)
+	{
+		return lval_err("Function '%s' cannot combine %s and %s.", op, ltype_name(x->type), ltype_name(y->type));
+	}
+	if (x->type == LVAL_MAT && (x->rows != y->rows || x->cols != y->cols))
+	{
+		return lval_err("Function '%s' passed matrices of different shapes. Got %ix%i and %ix%i.", op, x->rows, x->cols, y->rows, y->cols);
+	}
+	if (x->vec->count != y->vec->count)
+	{
+		return lval_err("Function '%s' passed vectors of different lengths. Got %i and %i.", op, x->vec->count, y->vec->count);
+	}
+	return NULL;
+}
+
+// an array of the same type and shape as v, contents uninitialized
+static lval *array_like(lval *v)
+{
+	return v->type == LVAL_MAT ? lval_mat(v->rows, v->cols) : lval_f64vec(v->vec->count);
+}
+
+// arithmetic where at least one argument is a vector or matrix, elementwise
+// with scalars broadcast. Division follows IEEE rules instead of raising an error.
+lval *builtin_vec_op(lval *a, char *op)
+{
+	lval *x = lval_pop(a, 0);
+
+	if (a->count == 0 && op[0] == '-')
+	{
+		lval *zero = lval_num(0);
+		lval_add(a, x);
+		x = zero;
+	}
+
+	while (a->count > 0)
+	{
+		lval *y = lval_pop(a, 0);
+
+		if (x->type == LVAL_NUM && y->type == LVAL_NUM)
+		{
+			vec_arith(op[0], &x->num, NULL, x->num, NULL, y->num, 1);
+			lval_del(y);
+			continue;
+		}
+
+		lval *err = array_shape_err(op, x, y);
+		if (err)
+		{
+			lval_del(x);
+			lval_del(y);
+			lval_del(a);
+			return err;
+		}
+
+		// write into whichever vector operand is not shared, or a new one
+		lval *out;
+		if (is_array(x) && x->vec->rc == 1)
+		{
+			out = x;
+		}
+		else if (is_array(y) && y->vec->rc == 1)
+		{
+			out = y;
+		}
+		else
+		{
+			out = array_like(is_array(x) ? x : y);
+		}
+
+		vec_arith(op[0], out->vec->data,
+				  is_array(x) ? x->vec->data : NULL, x->num,
+				  is_array(y) ? y->vec->data : NULL, y->num,
+				  out->vec->count);
+
+		if (out != x)
+		{
+			lval_del(x);
+		}
+		if (out != y)
+		{
+			lval_del(y);
+		}
+		x = out;
+	}
+
+	lval_del(a);
+	return x;
+}
+
+// ordering comparison of arrays and scalars, returning an array of 1s and 0s
+lval *builtin_vec_ord(lval *a, char *op)
+{
+	LASSERT_NUM(op, a, 2);
+	for (int i = 0; i < 2; i++)
+	{
+		LASSERT(a, a->cell[i]->type == LVAL_NUM || is_array(a->cell[i]),
+				"Function '%s' passed incorrect type for argument %i. Got %s, Expected Number, F64 Vector or Matrix.", op, i, ltype_name(a->cell[i]->type));
+	}
+
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+	lval *err = array_shape_err(op, x, y);
+	if (err)
+	{
+		lval_del(a);
+		return err;
+	}
+
+	lval *out = array_like(is_array(x) ? x : y);
+	vec_compare(op, out->vec->data,
+				is_array(x) ? x->vec->data : NULL, x->num,
+				is_array(y) ? y->vec->data : NULL, y->num,
+				out->vec->count);
+	lval_del(a);
+	return out;
+}
+
+// names of the OP_* operators, for errors and the array kernels
+static char *op_names[] = {"+", "-", "*", "/", "%", "==", "!=", ">", "<", ">=", "<=", "||", "&&", "!"};
+
+// x op y for the arithmetic operators
+double op_arith(int op, double x, double y)
+{
+	switch (op)
+	{
+	case OP_ADD:
+		return x + y;
+	case OP_SUB:
+		return x - y;
+	case OP_MUL:
+		return x * y;
+	case OP_DIV:
+		return x / y;
+	default:
+		return fmod(x, y);
+	}
+}
+
+// x op y for the comparison and logic operators
+bool op_test(int op, double x, double y)
+{
+	switch (op)
+	{
+	case OP_EQ:
+		return x == y;
+	case OP_NE:
+		return x != y;
+	case OP_GT:
+		return x > y;
+	case OP_LT:
+		return x < y;
+	case OP_GE:
+		return x >= y;
+	case OP_LE:
+		return x <= y;
+	case OP_OR:
+		return x || y;
+	default:
+		return x && y;
+	}
+}
+
+lval *builtin_op(lenv *e, lval *a, int op)
+{
+	// two numbers, computed in place of the first
+	if (a->count == 2 && a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM)
+	{
+		lval *x = a->cell[0];
+		double y = a->cell[1]->num;
+		if (op == OP_DIV && y == 0)
+		{
+			lval_del(a);
+			return lval_err("Division By Zero!");
+		}
+		x->num = op_arith(op, x->num, y);
+		lval_del(a->cell[1]);
+		a->count = 0;
+		lval_del(a);
+		return x;
+	}
+
+	LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", op_names[op]);
+
+	// Vectors and matrices are handled elementwise
+	for (int i = 0; i < a->count; i++)
+	{
+		if (is_array(a->cell[i]))
+		{
+			for (int j = 0; j < a->count; j++)
+			{
+				LASSERT(a, a->cell[j]->type == LVAL_NUM || is_array(a->cell[j]),
+						"Function '%s' passed incorrect type for argument %i. Got %s, Expected Number, F64 Vector or Matrix.", op_names[op], j, ltype_name(a->cell[j]->type));
+			}
+			return builtin_vec_op(a, op_names[op]);
+		}
+	}
+
+	// Ensure all arguments are numbers
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type != LVAL_NUM)
+		{
+			char *type = ltype_name(a->cell[i]->type);
+			lval_del(a);
+			return lval_err("Function '%s' passed incorrect type for argument %i. Got %s, Expected Number.", op_names[op], i, type);
+		}
+	}
+
+	double x = a->cell[0]->num;
+
+	// If no arguments and sub then perform unary negation
+	if (op == OP_SUB && a->count == 1)
+	{
+		x = -x;
+	}
+
+	for (int i = 1; i < a->count; i++)
+	{
+		if (op == OP_DIV && a->cell[i]->num == 0)
+		{
+			lval_del(a);
+			return lval_err("Division By Zero!");
+		}
+		x = op_arith(op, x, a->cell[i]->num);
+	}
+
+	lval *r = lval_take(a, 0);
+	r->num = x;
+	return r;
+}
+
+lval *builtin_add(lenv *e, lval *a)
+{
+	return builtin_op(e, a, OP_ADD);
+}
+
+lval *builtin_sub(lenv *e, lval *a)
+{
+	return builtin_op(e, a, OP_SUB);
+}
+
+lval *builtin_mul(lenv *e, lval *a)
+{
+	return builtin_op(e, a, OP_MUL);
+}
+
+lval *builtin_div(lenv *e, lval *a)
+{
+	return builtin_op(e, a, OP_DIV);
+}
+
+lval *builtin_mod(lenv *e, lval *a)
+{
+	return builtin_op(e, a, OP_MOD);
+}
+
+lval *builtin_ord(lenv *e, lval *a, int op)
+{
+	bool r;
+
+	if (op == OP_NOT)
+	{
+		LASSERT_NUM(op_names[op], a, 1);
+		LASSERT_TWOTYPES(op_names[op], a, 0, LVAL_NUM, LVAL_BOOL);
+		r = !(a->cell[0]->num);
+	}
+	else
+	{
+		LASSERT_NUM(op_names[op], a, 2);
+
+		if ((is_array(a->cell[0]) || is_array(a->cell[1])) && op >= OP_GT && op <= OP_LE)
+		{
+			return builtin_vec_ord(a, op_names[op]);
+		}
+
+		// could be num or bool. both args need not be of the same type
+		LASSERT_TWOTYPES(op_names[op], a, 0, LVAL_NUM, LVAL_BOOL);
+		LASSERT_TWOTYPES(op_names[op], a, 1, LVAL_NUM, LVAL_BOOL);
+
+		r = op_test(op, a->cell[0]->num, a->cell[1]->num);
+	}
+
+	lval_del(a);
+	lval *b = lval_bool();
+	b->num = r;
+	return b;
+}
+
+lval *builtin_gt(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_GT);
+}
+
+lval *builtin_lt(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_LT);
+}
+
+lval *builtin_ge(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_GE);
+}
+
+lval *builtin_le(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_LE);
+}
+
+lval *builtin_or(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_OR);
+}
+
+lval *builtin_and(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_AND);
+}
+
+lval *builtin_not(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, OP_NOT);
+}
+
+lval *builtin_cmp(lenv *e, lval *a, int op)
+{
+	LASSERT_NUM(op_names[op], a, 2);
+	bool r = lval_eq(a->cell[0], a->cell[1]);
+	if (op == OP_NE)
+	{
+		r = !r;
+	}
+	lval_del(a);
+	lval *b = lval_bool();
+	b->num = r;
+	return b;
+}
+
+lval *builtin_eq(lenv *e, lval *a)
+{
+	return builtin_cmp(e, a, OP_EQ);
+}
+
+lval *builtin_ne(lenv *e, lval *a)
+{
+	return builtin_cmp(e, a, OP_NE);
+}
+
+lval *builtin_head(lenv *e, lval *a)
+{
+	// a should contain a valid q expr
+	// q expr should not be empty
+	// head should only receive 1 argument
+	LASSERT_NUM("head", a, 1);
+	LASSERT_TWOTYPES("head", a, 0, LVAL_QEXPR, LVAL_STR);
+	LASSERT_NOT_EMPTY("head", a, 0);
+
+	lval *v = lval_take(a, 0); // takes the first arg
+	if (v->type == LVAL_QEXPR)
+	{
+		while (v->count > 1)
+		{
+			// lval* x = lval_pop(v,1);
+			// lval_print(x);
+			// printf("\n");
+			lval_del(lval_pop(v, 1));
+		}
+	}
+
+	// strings keep sharing their buffer
+	if (v->type == LVAL_STR)
+	{
+		v->slen = 1;
+	}
+
+	return v;
+}
+
+lval *builtin_tail(lenv *e, lval *a)
+{
+	LASSERT_NUM("tail", a, 1);
+	LASSERT_TWOTYPES("tail", a, 0, LVAL_QEXPR, LVAL_STR);
+	LASSERT_NOT_EMPTY("tail", a, 0);
+
+	lval *v = lval_take(a, 0);
+
+	if (v->type == LVAL_QEXPR)
+	{
+		lval_del(lval_pop(v, 0));
+	}
+
+	if (v->type == LVAL_STR)
+	{
+		lval_str_slice(v, 1, v->slen - 1);
+	}
+
+	return v;
+}
+
+// characters [start end) of a string, sharing its buffer
+lval *builtin_substr(lenv *e, lval *a)
+{
+	LASSERT_NUM("substr", a, 3);
+	LASSERT_TYPE("substr", a, 0, LVAL_STR);
+	LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+	LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+	LASSERT_INT("substr", a, 1);
+	LASSERT_INT("substr", a, 2);
+
+	long start = a->cell[1]->num, end = a->cell[2]->num;
+	long len = a->cell[0]->slen;
+	LASSERT(a, 0 <= start && start <= end && end <= len,
+			"Function 'substr' passed an invalid range [%li %li) for a string of length %li.", start, end, len);
+
+	lval *v = lval_take(a, 0);
+	lval_str_slice(v, start, end - start);
+	return v;
+}
+
+lval *builtin_nth_char(lenv *e, lval *a)
+{
+	LASSERT_NUM("nth-char", a, 2);
+	LASSERT_TYPE("nth-char", a, 0, LVAL_STR);
+	LASSERT_TYPE("nth-char", a, 1, LVAL_NUM);
+	LASSERT_INT("nth-char", a, 1);
+
+	long i = a->cell[1]->num, len = a->cell[0]->slen;
+	LASSERT(a, 0 <= i && i < len,
+			"Function 'nth-char' passed index %li for a string of length %li.", i, len);
+
+	lval *v = lval_take(a, 0);
+	lval_str_slice(v, i, 1);
+	return v;
+}
+
+// index of the first occurrence of a substring, or -1
+lval *builtin_find(lenv *e, lval *a)
+{
+	LASSERT_NUM("find", a, 2);
+	LASSERT_TYPE("find", a, 0, LVAL_STR);
+	LASSERT_TYPE("find", a, 1, LVAL_STR);
+
+	lval *s = a->cell[0], *p = a->cell[1];
+	size_t i = str_find(lval_sdata(s), s->slen, lval_sdata(p), p->slen);
+	lval_del(a);
+	return lval_num(i == STR_NOT_FOUND ? -1 : (double)i);
+}
+
+// split a string on every occurrence of a separator, or into characters when
+// the separator is empty. The pieces are slices of the original. Given a
+// number and a list, split the list in two at that index instead.
+lval *builtin_split(lenv *e, lval *a)
+{
+	LASSERT_NUM("split", a, 2);
+	if (a->cell[0]->type == LVAL_NUM)
+	{
+		LASSERT_TYPE("split", a, 1, LVAL_QEXPR);
+		LASSERT_INT("split", a, 0);
+		int k = a->cell[0]->num, count = a->cell[1]->count;
+		LASSERT(a, 0 <= k && k <= count,
+				"Function 'split' passed index %i for a list of length %i.", k, count);
+
+		lval *l = lval_pop(a, 1), *front = lval_qexpr();
+		while (k--)
+		{
+			lval_add(front, lval_pop(l, 0));
+		}
+		lval_add(a, front);
+		lval_add(a, l);
+		lval_del(lval_pop(a, 0));
+		a->type = LVAL_QEXPR;
+		return a;
+	}
+	LASSERT_TYPE("split", a, 0, LVAL_STR);
+	LASSERT_TYPE("split", a, 1, LVAL_STR);
+
+	lval *s = a->cell[0], *p = a->cell[1];
+	char *d = lval_sdata(s), *sep = lval_sdata(p);
+	size_t n = s->slen, m = p->slen;
+
+	lval *x = lval_qexpr();
+	size_t i = 0;
+	while (m == 0 ? i < n : 1)
+	{
+		size_t j = m == 0 ? 1 : str_find(d + i, n - i, sep, m);
+		size_t len = j == STR_NOT_FOUND ? n - i : j;
+		lval *piece = lval_copy(s);
+		lval_str_slice(piece, i, len);
+		lval_add(x, piece);
+		if (j == STR_NOT_FOUND)
+		{
+			break;
+		}
+		i += len + m;
+	}
+
+	lval_del(a);
+	return x;
+}
+
+// replace every occurrence of a substring
+lval *builtin_replace(lenv *e, lval *a)
+{
+	LASSERT_NUM("replace", a, 3);
+	for (int i = 0; i < 3; i++)
+	{
+		LASSERT_TYPE("replace", a, i, LVAL_STR);
+	}
+	LASSERT(a, a->cell[1]->slen != 0, "Function 'replace' passed an empty string to replace.");
+
+	lval *s = a->cell[0], *p = a->cell[1], *r = a->cell[2];
+	char *d = lval_sdata(s);
+	size_t n = s->slen, i = 0;
+
+	lval *x = lval_str_n("", 0);
+	for (;;)
+	{
+		size_t j = str_find(d + i, n - i, lval_sdata(p), p->slen);
+		if (j == STR_NOT_FOUND)
+		{
+			break;
+		}
+		lval_str_append(x, d + i, j);
+		lval_str_append(x, lval_sdata(r), r->slen);
+		i += j + p->slen;
+	}
+	lval_str_append(x, d + i, n - i);
+
+	lval_del(a);
+	return x;
+}
+
+// strip leading and trailing whitespace
+lval *builtin_trim(lenv *e, lval *a)
+{
+	LASSERT_NUM("trim", a, 1);
+	LASSERT_TYPE("trim", a, 0, LVAL_STR);
+
+	lval *v = lval_take(a, 0);
+	char *d = lval_sdata(v);
+	size_t i = 0, n = v->slen;
+	while (i < n && strchr(" \t\n\r\f\v", d[i]) && d[i])
+	{
+		i++;
+	}
+	while (n > i && strchr(" \t\n\r\f\v", d[n - 1]) && d[n - 1])
+	{
+		n--;
+	}
+	lval_str_slice(v, i, n - i);
+	return v;
+}
+
+lval *builtin_starts_with(lenv *e, lval *a)
+{
+	LASSERT_NUM("starts-with", a, 2);
+	LASSERT_TYPE("starts-with", a, 0, LVAL_STR);
+	LASSERT_TYPE("starts-with", a, 1, LVAL_STR);
+
+	lval *s = a->cell[0], *p = a->cell[1];
+	lval *b = lval_bool();
+	b->num = p->slen <= s->slen && memcmp(lval_sdata(s), lval_sdata(p), p->slen) == 0;
+	lval_del(a);
+	return b;
+}
+
+lval *builtin_to_number(lenv *e, lval *a)
+{
+	LASSERT_NUM("to-number", a, 1);
+	LASSERT_TYPE("to-number", a, 0, LVAL_STR);
+
+	char *s = lval_cstr(a->cell[0]), *end;
+	errno = 0;
+	double x = strtod(s, &end);
+	LASSERT(a, end != s && *end == '\0' && errno != ERANGE,
+			"Function 'to-number' passed \"%s\", which is not a number.", s);
+
+	lval_del(a);
+	return lval_num(x);
+}
+
+lval *builtin_case(lval *a, char *func, int upper)
+{
+	LASSERT_NUM(func, a, 1);
+	LASSERT_TYPE(func, a, 0, LVAL_STR);
+
+	lval *s = a->cell[0];
+	lval *x = lval_str_n("", 0);
+	char *d = lval_str_reserve(x, s->slen);
+	str_case(d, lval_sdata(s), s->slen, upper);
+	lval_str_setlen(x, s->slen);
+
+	lval_del(a);
+	return x;
+}
+
+lval *builtin_str_upper(lenv *e, lval *a)
+{
+	return builtin_case(a, "str-upper", 1);
+}
+
+lval *builtin_str_lower(lenv *e, lval *a)
+{
+	return builtin_case(a, "str-lower", 0);
+}
+
+lval *builtin_list(lenv *e, lval *a)
+{
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+lval *builtin_eval(lenv *e, lval *a)
+{
+	LASSERT_NUM("eval", a, 1);
+	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+	lval *x = lval_expand(e, a->cell[0]);
+	if (x)
+	{
+		lval_del(a);
+		return x;
+	}
+
+	// evaluate the qexpr as an sexpr
+	x = lval_eval_sexpr(e, a->cell[0]);
+	lval_del(a);
+	return x;
+}
+
+lval *builtin_join(lenv *e, lval *a)
+{
+
+	bool not_all_qexpr = false;
+	bool not_all_strs = false;
+
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type != LVAL_QEXPR)
+		{
+			not_all_qexpr = true;
+		}
+		// LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type. Got %s, Expected %s.", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+	}
+
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type != LVAL_STR)
+		{
+			not_all_strs = true;
+		}
+	}
+
+	// either all should be qexprs or all should be strs
+	if (not_all_qexpr ^ not_all_strs)
+	{
+		lval *x;
+
+		if (not_all_strs)
+		{
+			x = lval_pop(a, 0);
+
+			while (a->count)
+			{
+				x = lval_join(x, lval_pop(a, 0));
+			}
+
+			lval_del(a);
+		}
+
+		if (not_all_qexpr)
+		{
+			// append everything to the first string in one pass
+			size_t total_size = 0;
+			for (int i = 0; i < a->count; i++)
+			{
+				total_size += a->cell[i]->slen;
+			}
+
+			x = lval_pop(a, 0);
+			lval_str_reserve(x, total_size);
+			for (int i = 0; i < a->count; i++)
+			{
+				lval_str_append(x, lval_sdata(a->cell[i]), a->cell[i]->slen);
+			}
+
+			lval_del(a);
+		}
+
+		return x;
+	}
+	else
+	{
+
+		if (not_all_qexpr)
+		{
+			for (int i = 0; i < a->count; i++)
+			{
+				LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type for argument %i. Got %s, Expected %s.", i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+			}
+		}
+
+		if (not_all_strs)
+		{
+			for (int i = 0; i < a->count; i++)
+			{
+				LASSERT(a, a->cell[i]->type == LVAL_STR, "Function 'join' passed incorrect type for argument %i. Got %s, Expected %s.", i, ltype_name(a->cell[i]->type), ltype_name(LVAL_STR));
+			}
+		}
+
+		return lval_err("Incorrect types to join. Only Q-expressions or strings can be joined.");
+	}
+}
+
+lval *builtin_len(lenv *e, lval *a)
+{
+	LASSERT_NUM("len", a, 1);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_QEXPR || t == LVAL_STR || t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP || t == LVAL_PQ || t == LVAL_PVEC || is_array(a->cell[0]),
+			"Function 'len' passed incorrect type for argument 0. Got %s, Expected Q-Expression, String or a collection.", ltype_name(t));
+
+	double len = lval_len(a->cell[0]);
+	lval_del(a);
+	return lval_num(len);
+}
+
+lval *builtin_cons(lenv *e, lval *a)
+{
+	LASSERT_NUM("cons", a, 2);
+	LASSERT_TYPE("cons", a, 0, LVAL_NUM);
+	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+
+	lval *v = lval_qexpr();
+	lval_add(v, a->cell[0]);
+	v = lval_join(v, a->cell[1]);
+	return v;
+}
+
+lval *builtin_var(lenv *e, lval *a, int kind)
+{
+	char *func = kind == VAR_DEF ? "def" : "=";
+	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+	lval *syms = a->cell[0];
+	for (int i = 0; i < syms->count; i++)
+	{
+		LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot define non-symbol. Got %s, Expected %s.", func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+
+	LASSERT(a, (syms->count == a->count - 1), "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.", func, syms->count, a->count - 1);
+
+	for (int i = 0; i < syms->count; i++)
+	{
+		/* If 'def' define in globally. If 'put' define in locally */
+		if (kind == VAR_DEF)
+		{
+			if (infer_enabled)
+			{
+				lval_infer(e, syms->cell[i]->sym, a->cell[i + 1]);
+			}
+			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+		}
+
+		else
+		{
+			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+		}
+	}
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a)
+{
+	// LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type. Got %s, Expected %s", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+	// // first argument is symbol list
+	// lval* syms = a->cell[0];
+
+	// for(int i = 0; i < syms->count; i++){
+	//   LASSERT(a, syms->cell[i]->type == LVAL_SYM, "Function 'def' can not define non-symbol. Got %s", ltype_name(syms->cell[i]->type));
+	// }
+
+	// LASSERT(a, syms->count == a->count - 1, "Function 'def' can not define incorrect number of values to symbols. Got %i symbols and %i values", syms->count, a->count-1);
+
+	// // assign values to symbols
+	// for(int i = 0; i < syms->count; i++){
+	//   lenv_put(e, syms->cell[i], a->cell[i+1]);
+	// }
+
+	// lval_del(a);
+	// return lval_sexpr();
+
+	return builtin_var(e, a, VAR_DEF);
+}
+
+lval *builtin_put(lenv *e, lval *a)
+{
+	return builtin_var(e, a, VAR_PUT);
+}
+
+lval *builtin_lambda(lenv *e, lval *a)
+{
+	LASSERT_NUM("\\", a, 2);
+	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+	// first q expression should only contain symbols
+	for (int i = 0; i < a->cell[0]->count; i++)
+	{
+		LASSERT(a, (a->cell[0]->cell[i]->type) == LVAL_SYM, "Cannot define non-symbol. Got %s, Expected %s.", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM))
+	}
+
+	lval *formals = lval_pop(a, 0);
+	lval *body = lval_pop(a, 0);
+	lval_del(a);
+
+	lval *err = lval_expand(e, body);
+	if (err)
+	{
+		lval_del(formals);
+		lval_del(body);
+		return err;
+	}
+	lval_fuse(body);
+	lval_optimize(e, body);
+	return lval_lambda(formals, body);
+}
+
+lval *builtin_if(lenv *e, lval *a)
+{
+	LASSERT_NUM("if", a, 3);
+	LASSERT_TWOTYPES("if", a, 0, LVAL_NUM, LVAL_BOOL);
+	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+	// the chosen branch is evaluated as an sexpr
+	lval *x = lval_eval_sexpr(e, a->cell[a->cell[0]->num ? 1 : 2]);
+	lval_del(a);
+	return x;
+}
+
+/* Special Forms */
+
+// select, case, let and while take q-expressions of code. When these are
+// written out in the call, lval_eval_sexpr passes them to lval_form as they
+// are instead of evaluating and copying them, like the branches of an if.
+// Called any other way, e.g. through unpack, they get evaluated arguments.
+
+// does the call of f with the unevaluated arguments cs have the form of a
+// special form?
+int lval_form_literal(lbuiltin f, lval **cs, int n)
+{
+	int from;
+	if (f == builtin_select)
+	{
+		from = 0;
+	}
+	else if (f == builtin_case_of)
+	{
+		from = 1;
+	}
+	else if ((f == builtin_let && n == 1) || (f == builtin_while && n == 2))
+	{
+		from = 0;
+	}
+	else
+	{
+		return 0;
+	}
+	for (int i = from; i < n; i++)
+	{
+		if (cs[i]->type != LVAL_QEXPR)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// the value of x, or NULL with x in *code when it is an s-expression left to
+// the caller
+static lval *form_tail(lenv *e, lval *x, lval **code)
+{
+	if (x->type == LVAL_SEXPR)
+	{
+		*code = x;
+		return NULL;
+	}
+	return lval_eval_ref(e, x);
+}
+
+// check the clause cs[i] of the form func
+static lval *form_clause(char *func, lval **cs, int i)
+{
+	if (cs[i]->type != LVAL_QEXPR)
+	{
+		return lval_err("Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", func, i, ltype_name(cs[i]->type), ltype_name(LVAL_QEXPR));
+	}
+	if (cs[i]->count < 2)
+	{
+		return lval_err("Function '%s' passed a clause of %i items for argument %i, Expected 2.", func, cs[i]->count, i);
+	}
+	return NULL;
+}
+
+// run the form f with the arguments cs, which have been evaluated or not. The
+// result is returned, or NULL with an expression of cs left in *code, to be
+// evaluated as an s-expression in *env. *env is a new environment when it
+// is not e.
+lval *lval_form(lenv *e, lbuiltin f, lval **cs, int n, int evaluated, lval **code, lenv **env)
+{
+	*code = NULL;
+	*env = e;
+
+	if (f == builtin_let)
+	{
+		if (n != 1 || cs[0]->type != LVAL_QEXPR)
+		{
+			return lval_err("Function 'let' expects a single Q-Expression of code.");
+		}
+		*env = lenv_new();
+		(*env)->par = e;
+		*code = cs[0];
+		return NULL;
+	}
+
+	if (f == builtin_while)
+	{
+		if (n != 2 || cs[0]->type != LVAL_QEXPR || cs[1]->type != LVAL_QEXPR)
+		{
+			return lval_err("Function 'while' expects a condition and a body, both Q-Expressions.");
+		}
+		lval *r = lval_qexpr();
+		while (1)
+		{
+			lval *t = lval_eval_sexpr(e, cs[0]);
+			if (t->type != LVAL_NUM && t->type != LVAL_BOOL)
+			{
+				lval_del(r);
+				if (t->type == LVAL_ERR)
+				{
+					return t;
+				}
+				lval *err = lval_err("Function 'while' passed a condition of type %s, Expected Number or Boolean.", ltype_name(t->type));
+				lval_del(t);
+				return err;
+			}
+			int more = t->num != 0;
+			lval_del(t);
+			if (!more)
+			{
+				return r;
+			}
+			lval_del(r);
+			r = lval_eval_sexpr(e, cs[1]);
+			if (r->type == LVAL_ERR)
+			{
+				return r;
+			}
+		}
+	}
+
+	// select and case
+	char *func = f == builtin_select ? "select" : "case";
+	int from = f == builtin_select ? 0 : 1;
+	lval *key = NULL;
+	if (from)
+	{
+		if (n == 0)
+		{
+			return lval_err("Function 'case' passed no value to match.");
+		}
+		key = evaluated ? cs[0] : lval_eval_ref(e, cs[0]);
+		if (key->type == LVAL_ERR)
+		{
+			return key;
+		}
+	}
+
+	lval *r = NULL;
+	for (int i = from; i < n && r == NULL; i++)
+	{
+		if ((r = form_clause(func, cs, i)) != NULL)
+		{
+			break;
+		}
+		lval *t = lval_eval_ref(e, cs[i]->cell[0]);
+		int hit;
+		if (t->type == LVAL_ERR)
+		{
+			r = t;
+			break;
+		}
+		if (key)
+		{
+			hit = lval_eq(key, t);
+		}
+		else if (t->type == LVAL_NUM || t->type == LVAL_BOOL)
+		{
+			hit = t->num != 0;
+		}
+		else
+		{
+			r = lval_err("Function 'select' passed a condition of type %s in argument %i, Expected Number or Boolean.", ltype_name(t->type), i);
+			lval_del(t);
+			break;
+		}
+		lval_del(t);
+		if (hit)
+		{
+			r = form_tail(e, cs[i]->cell[1], code);
+			break;
+		}
+	}
+	if (key && !evaluated)
+	{
+		lval_del(key);
+	}
+	if (r == NULL && *code == NULL)
+	{
+		r = lval_err(from ? "No Case Found" : "No Selection Found");
+	}
+	return r;
+}
+
+// a special form called with evaluated arguments
+static lval *builtin_form(lenv *e, lval *a, lbuiltin f)
+{
+	lval *code;
+	lenv *env;
+	lval *r = lval_form(e, f, a->cell, a->count, 1, &code, &env);
+	if (r == NULL)
+	{
+		r = lval_eval_sexpr(env, code);
+		if (env != e)
+		{
+			lenv_del(env);
+		}
+	}
+	lval_del(a);
+	return r;
+}
+
+// evaluate the clauses {condition expression} in order, returning the
+// expression of the first true condition
+lval *builtin_select(lenv *e, lval *a)
+{
+	return builtin_form(e, a, builtin_select);
+}
+
+// the expression of the first clause {value expression} whose value equals
+// the first argument
+lval *builtin_case_of(lenv *e, lval *a)
+{
+	return builtin_form(e, a, builtin_case_of);
+}
+
+// evaluate code in a new scope
+lval *builtin_let(lenv *e, lval *a)
+{
+	return builtin_form(e, a, builtin_let);
+}
+
+// evaluate the body while the condition is true, returning its last value
+lval *builtin_while(lenv *e, lval *a)
+{
+	return builtin_form(e, a, builtin_while);
+}
+
+// the arguments have been evaluated in order, return the last
+lval *builtin_do(lenv *e, lval *a)
+{
+	if (a->count == 0)
+	{
+		lval_del(a);
+		return lval_qexpr();
+	}
+	return lval_take(a, a->count - 1);
+}
+
+/* Macros */
+
+// A macro is a lambda called on the code of its arguments when a form is
+// loaded or a lambda is defined, and the code it returns takes the place of
+// the call. Expanded code is marked with macro_epoch so that copies of it,
+// like the bodies of inner lambdas, are not walked again until another macro
+// is defined.
+
+#define MACRO_MAX_EXPANSIONS 1000
+
+static lenv *macros = NULL;
+static unsigned macro_epoch = 0;
+
+static lval *macro_get(char *sym)
+{
+	for (int i = 0; macros && i < macros->count; i++)
+	{
+		if (strcmp(macros->syms[i], sym) == 0)
+		{
+			return macros->vals[i];
+		}
+	}
+	return NULL;
+}
+
+// replace the list v by the code r in place
+static void macro_replace(lval *v, lval *r)
+{
+	if (r->type != LVAL_SEXPR && r->type != LVAL_QEXPR)
+	{
+		r = lval_add(lval_sexpr(), r);
+	}
+	for (int i = 0; i < v->count; i++)
+	{
+		lval_del(v->cell[i]);
+	}
+	free(v->cell);
+	v->count = r->count;
+	v->cell = r->cell;
+	v->opt = OPT_NONE;
+	v->fused = 0;
+	r->count = 0;
+	r->cell = NULL;
+	lval_del(r);
+}
+
+static lval *macro_walk(lenv *e, lval *v)
+{
+	if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->expanded == macro_epoch)
+	{
+		return NULL;
+	}
+
+	lval *m;
+	for (int n = 0; v->count && v->cell[0]->type == LVAL_SYM && (m = macro_get(v->cell[0]->sym)); n++)
+	{
+		if (n == MACRO_MAX_EXPANSIONS)
+		{
+			return lval_err("Expansion of macro '%s' does not terminate.", v->cell[0]->sym);
+		}
+		lval *a = lval_sexpr();
+		for (int i = 1; i < v->count; i++)
+		{
+			lval_add(a, lval_copy(v->cell[i]));
+		}
+		lval *r = lval_call(e, m, a);
+		if (r->type == LVAL_ERR)
+		{
+			return r;
+		}
+		if (r->type == LVAL_FUN)
+		{
+			lval_del(r);
+			return lval_err("Macro '%s' passed too few arguments.", v->cell[0]->sym);
+		}
+		macro_replace(v, r);
+	}
+
+	// templates and macro definitions are expanded when they are used
+	if (v->count && v->cell[0]->type == LVAL_SYM &&
+		(strcmp(v->cell[0]->sym, "quasiquote") == 0 || strcmp(v->cell[0]->sym, "defmacro") == 0))
+	{
+		return NULL;
+	}
+
+	for (int i = 0; i < v->count; i++)
+	{
+		lval *err = macro_walk(e, v->cell[i]);
+		if (err)
+		{
+			return err;
+		}
+	}
+	v->expanded = macro_epoch;
+	return NULL;
+}
+
+// expand the macro calls in the code v in place, NULL or an error
+lval *lval_expand(lenv *e, lval *v)
+{
+	if (macros == NULL)
+	{
+		return NULL;
+	}
+	return macro_walk(e, v);
+}
+
+// define a macro: defmacro {name args} {body}
+lval *builtin_defmacro(lenv *e, lval *a)
+{
+	LASSERT_NUM("defmacro", a, 2);
+	LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+	LASSERT(a, a->cell[0]->count > 0 && a->cell[0]->cell[0]->type == LVAL_SYM, "Function 'defmacro' passed no name for the macro.");
+
+	lval *name = lval_pop(a->cell[0], 0);
+	lval *f = builtin_lambda(e, a);
+	if (f->type == LVAL_ERR)
+	{
+		lval_del(name);
+		return f;
+	}
+
+	if (macros == NULL)
+	{
+		macros = lenv_new();
+	}
+	int i = 0;
+	while (i < macros->count && strcmp(macros->syms[i], name->sym) != 0)
+	{
+		i++;
+	}
+	if (i == macros->count)
+	{
+		macros->count++;
+		macros->syms = realloc(macros->syms, sizeof(char *) * macros->count);
+		macros->vals = realloc(macros->vals, sizeof(lval *) * macros->count);
+		macros->syms[i] = malloc(strlen(name->sym) + 1);
+		strcpy(macros->syms[i], name->sym);
+	}
+	else
+	{
+		lval_del(macros->vals[i]);
+	}
+	macros->vals[i] = f;
+	// lval.expanded keeps 26 bits of the epoch, and 0 marks code that was
+	// never expanded
+	macro_epoch = macro_epoch + 1 < (1u << 26) ? macro_epoch + 1 : 1;
+
+	lval_del(name);
+	return lval_sexpr();
+}
+
+// replace the unquoted parts of the code v, which is modified
+static lval *quasi_fill(lenv *e, lval *v)
+{
+	v->opt = OPT_NONE;
+	v->fused = 0;
+	for (int i = 0; i < v->count; i++)
+	{
+		lval *c = v->cell[i];
+		if (c->type != LVAL_SEXPR && c->type != LVAL_QEXPR)
+		{
+			continue;
+		}
+		char *head = c->count == 2 && c->cell[0]->type == LVAL_SYM ? c->cell[0]->sym : "";
+		if (strcmp(head, "quasiquote") == 0)
+		{
+			continue;
+		}
+		if (strcmp(head, "unquote") == 0 || strcmp(head, "unquote-splicing") == 0)
+		{
+			lval *x = lval_eval(e, lval_pop(c, 1));
+			if (x->type == LVAL_ERR)
+			{
+				return x;
+			}
+			if (head[7] == '\0')
+			{
+				lval_del(v->cell[i]);
+				v->cell[i] = x;
+				continue;
+			}
+			if (x->type != LVAL_QEXPR && x->type != LVAL_SEXPR)
+			{
+				lval *err = lval_err("Function 'unquote-splicing' passed incorrect type. Got %s, Expected %s.", ltype_name(x->type), ltype_name(LVAL_QEXPR));
+				lval_del(x);
+				return err;
+			}
+			// put the items of x in place of c
+			lval_del(lval_pop(v, i));
+			v->cell = realloc(v->cell, sizeof(lval *) * (v->count + x->count));
+			memmove(&v->cell[i + x->count], &v->cell[i], sizeof(lval *) * (v->count - i));
+			memcpy(&v->cell[i], x->cell, sizeof(lval *) * x->count);
+			v->count += x->count;
+			i += x->count - 1;
+			x->count = 0;
+			lval_del(x);
+			continue;
+		}
+		lval *err = quasi_fill(e, c);
+		if (err)
+		{
+			return err;
+		}
+	}
+	return NULL;
+}
+
+// the code a q-expression with the values of its unquoted parts filled in
+lval *builtin_quasiquote(lenv *e, lval *a)
+{
+	LASSERT_NUM("quasiquote", a, 1);
+	LASSERT_TYPE("quasiquote", a, 0, LVAL_QEXPR);
+
+	lval *v = lval_take(a, 0);
+	lval *err = quasi_fill(e, v);
+	if (err)
+	{
+		lval_del(v);
+		return err;
+	}
+	return v;
+}
+
+// evaluate a top level form of a file, printing any error. The form is
+// expanded and fused in place.
+void lval_load_form(lenv *e, lval *form)
+{
+	lval *x = lval_expand(e, form);
+	if (x)
+	{
+		lval_println(x);
+		lval_del(x);
+		return;
+	}
+	lval_fuse(form);
+	int form_name = trace_file ? trace_form_name(form) : -1;
+	if (form_name != -1)
+	{
+		trace_event(form_name, 'f', 'B');
+	}
+	x = lval_eval_ref(e, form);
+	if (form_name != -1)
+	{
+		trace_event(form_name, 'f', 'E');
+	}
+	if (x->type == LVAL_ERR)
+	{
+		lval_println(x);
+	}
+	lval_del(x);
+}
+
+// load contents from a file given file name as a string
+lval *builtin_load(lenv *e, lval *a)
+{
+	LASSERT_NUM("load", a, 1);
+	LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+	FILE *f = fopen(lval_cstr(a->cell[0]), "rb");
+	if (f == NULL)
+	{
+		lval *err = lval_err("Could not load Library %s", lval_cstr(a->cell[0]));
+		lval_del(a);
+		return err;
+	}
+
+	int trace_name = -1;
+	if (trace_file)
+	{
+		trace_name = lname_id(lval_cstr(a->cell[0]));
+		trace_event(trace_name, 'L', 'B');
+	}
+
+	// Read File Contents
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *input = calloc(length + 1, 1);
+	fread(input, 1, length, f);
+	fclose(f);
+
+	// Read from input to create an S-Expr
+	int pos = 0;
+	str_intern_begin();
+	lval *expr = lval_read_expr(input, &pos, '\0');
+	str_intern_end();
+	free(input);
+
+	// Evaluate all expressions contained in S-Expr
+	if (expr->type != LVAL_ERR)
+	{
+		while (expr->count)
+		{
+			lval *form = lval_pop(expr, 0);
+			lval_load_form(e, form);
+			lval_del(form);
+		}
+	}
+	else
+	{
+		lval_println(expr);
+	}
+
+	lval_del(expr);
+	lval_del(a);
+
+	if (trace_name != -1)
+	{
+		trace_event(trace_name, 'L', 'E');
+	}
+
+	return lval_sexpr();
+}
+
+lval *builtin_print(lenv *e, lval *a)
+{
+
+	/* Print each argument followed by a space */
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->cell[i]->type == LVAL_SEQ)
+		{
+			lval_print_seq(e, a->cell[i]);
+		}
+		else
+		{
+			lval_print(a->cell[i]);
+		}
+		out_char(' ');
+	}
+
+	/* Print a newline and delete arguments */
+	out_char('\n');
+	if (out_unbuffered)
+	{
+		out_flush();
+	}
+	lval_del(a);
+
+	return lval_sexpr();
+}
+
+// write out everything printed so far; takes any arguments, e.g. flush ()
+lval *builtin_flush(lenv *e, lval *a)
+{
+	out_flush();
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval *builtin_error(lenv *e, lval *a)
+{
+	LASSERT_NUM("error", a, 1);
+	LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+	/* Construct Error from first argument */
+	lval *err = lval_err("%s", lval_cstr(a->cell[0]));
+
+	/* Delete arguments and return */
+	lval_del(a);
+	return err;
+}
+
+// create a hash map from alternating keys and values
+lval *builtin_hashmap(lenv *e, lval *a)
+{
+	LASSERT(a, a->count % 2 == 0, "Function 'hashmap' passed an odd number of arguments. Got %i, Expected key value pairs.", a->count);
+
+	lval *m = lval_map();
+	while (a->count)
+	{
+		lval *k = lval_pop(a, 0);
+		lmap_put(m->map, k, lval_pop(a, 0));
+	}
+	lval_del(a);
+	return m;
+}
+
+// create a hash set from its arguments
+lval *builtin_hashset(lenv *e, lval *a)
+{
+	lval *m = lval_set();
+	while (a->count)
+	{
+		lmap_put(m->map, lval_pop(a, 0), NULL);
+	}
+	lval_del(a);
+	return m;
+}
+
+// insert m k v for maps, insert s k for sets
+lval *builtin_insert(lenv *e, lval *a)
+{
+	LASSERT(a, a->count > 0, "Function 'insert' passed no arguments.");
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP,
+			"Function 'insert' passed incorrect type for argument 0. Got %s, Expected Map, Set or Ordered Map.", ltype_name(t));
+	int expect = t == LVAL_SET ? 2 : 3;
+	LASSERT_NUM("insert", a, expect);
+
+	lval *m = lval_pop(a, 0);
+	lval *k = lval_pop(a, 0);
+	lval *v = t == LVAL_SET ? NULL : lval_pop(a, 0);
+	if (t == LVAL_OMAP)
+	{
+		lbtree_put(m, k, v);
+	}
+	else
+	{
+		lmap_put(lmap_own(m), k, v);
+	}
+	lval_del(a);
+	return m;
+}
+
+lval *builtin_get(lenv *e, lval *a)
+{
+	LASSERT_NUM("get", a, 2);
+	LASSERT_TWOTYPES("get", a, 0, LVAL_MAP, LVAL_OMAP);
+
+	if (a->cell[0]->type == LVAL_OMAP)
+	{
+		lval *x = lbtree_get(a->cell[0]->root, a->cell[1]);
+		LASSERT(a, x != NULL, "Function 'get' passed a key that is not in the map.");
+		x = lval_copy(x);
+		lval_del(a);
+		return x;
+	}
+
+	lmap *m = a->cell[0]->map;
+	int i = lmap_find(m, a->cell[1], lval_hash(a->cell[1]));
+	LASSERT(a, m->keys[i] != NULL, "Function 'get' passed a key that is not in the map.");
+
+	lval *v = lval_copy(m->vals[i]);
+	lval_del(a);
+	return v;
+}
+
+lval *builtin_remove(lenv *e, lval *a)
+{
+	LASSERT_NUM("remove", a, 2);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP,
+			"Function 'remove' passed incorrect type for argument 0. Got %s, Expected Map, Set or Ordered Map.", ltype_name(t));
+
+	lval *m = lval_pop(a, 0);
+	if (t == LVAL_OMAP)
+	{
+		lbtree_remove(m, a->cell[0]);
+	}
+	else
+	{
+		lmap_remove(lmap_own(m), a->cell[0]);
+	}
+	lval_del(a);
+	return m;
+}
+
+lval *builtin_contains(lenv *e, lval *a)
+{
+	LASSERT_NUM("contains", a, 2);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP,
+			"Function 'contains' passed incorrect type for argument 0. Got %s, Expected Map, Set or Ordered Map.", ltype_name(t));
+
+	lval *b = lval_bool();
+	if (t == LVAL_OMAP)
+	{
+		b->num = lbtree_get(a->cell[0]->root, a->cell[1]) != NULL;
+	}
+	else
+	{
+		lmap *m = a->cell[0]->map;
+		b->num = m->keys[lmap_find(m, a->cell[1], lval_hash(a->cell[1]))] != NULL;
+	}
+	lval_del(a);
+	return b;
+}
+
+// q-expression of the keys of a map or the elements of a set
+lval *builtin_keys(lenv *e, lval *a)
+{
+	LASSERT_NUM("keys", a, 1);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP,
+			"Function 'keys' passed incorrect type for argument 0. Got %s, Expected Map, Set or Ordered Map.", ltype_name(t));
+
+	lval *v = lval_qexpr();
+	if (t == LVAL_OMAP)
+	{
+		// keys come out of the tree in order
+		lval *pairs = lval_entries(a->cell[0]);
+		for (int i = 0; i < pairs->count; i++)
+		{
+			lval_add(v, lval_pop(pairs->cell[i], 0));
+		}
+		lval_del(pairs);
+		lval_del(a);
+		return v;
+	}
+
+	lmap *m = a->cell[0]->map;
+	for (int i = 0; i < m->cap; i++)
+	{
+		if (m->keys[i])
+		{
+			lval_add(v, lval_copy(m->keys[i]));
+		}
+	}
+	lval_del(a);
+	return v;
+}
+
+lval *builtin_size(lenv *e, lval *a)
+{
+	LASSERT_NUM("size", a, 1);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_MAP || t == LVAL_SET || t == LVAL_OMAP || t == LVAL_PQ,
+			"Function 'size' passed incorrect type for argument 0. Got %s, Expected a collection.", ltype_name(t));
+
+	lval *v = lval_num(lval_len(a->cell[0]));
+	lval_del(a);
+	return v;
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op)
+// create an ordered map from alternating keys and values
+lval *builtin_omap(lenv *e, lval *a)
 {
+	LASSERT(a, a->count % 2 == 0, "Function 'omap' passed an odd number of arguments. Got %i, Expected key value pairs.", a->count);
 
-	// Ensure all arguments are numbers
-	for (int i = 0; i < a->count; i++)
+	lval *m = lval_omap();
+	while (a->count)
 	{
-		if (a->cell[i]->type != LVAL_NUM)
-		{
-			char *type = ltype_name(a->cell[i]->type);
-			lval_del(a);
-			return lval_err("Function '%s' passed incorrect type for argument %i. Got %s, Expected Number.", op, i, type);
-		}
+		lval *k = lval_pop(a, 0);
+		lbtree_put(m, k, lval_pop(a, 0));
 	}
+	lval_del(a);
+	return m;
+}
 
-	lval *x = lval_pop(a, 0);
+// {k v} pairs of an ordered map with lo <= k <= hi, in key order
+lval *builtin_range(lenv *e, lval *a)
+{
+	if (a->count > 0 && a->cell[0]->type != LVAL_OMAP)
+	{
+		return builtin_range_seq(e, a);
+	}
+	LASSERT_NUM("range", a, 3);
+	LASSERT_TYPE("range", a, 0, LVAL_OMAP);
 
-	// If no arguments and sub then perform unary negation
-	if ((strcmp(op, "-") == 0) && a->count == 0)
+	lval *v = lval_qexpr();
+	lbtree_range(a->cell[0]->root, a->cell[1], a->cell[2], v);
+	lval_del(a);
+	return v;
+}
+
+// create a priority queue from its arguments
+lval *builtin_pq(lenv *e, lval *a)
+{
+	lval *q = lval_pq();
+	while (a->count)
 	{
-		x->num = -x->num;
+		lheap_push(q->heap, lval_pop(a, 0));
 	}
+	lval_del(a);
+	return q;
+}
 
-	while (a->count > 0)
+lval *builtin_pq_push(lenv *e, lval *a)
+{
+	LASSERT(a, a->count >= 2, "Function 'pq-push' passed incorrect number of arguments. Got %i, Expected at least 2.", a->count);
+	LASSERT_TYPE("pq-push", a, 0, LVAL_PQ);
+
+	lval *q = lval_pop(a, 0);
+	lheap *h = lheap_own(q);
+	while (a->count)
 	{
+		lheap_push(h, lval_pop(a, 0));
+	}
+	lval_del(a);
+	return q;
+}
 
-		/* Pop the next element */
-		lval *y = lval_pop(a, 0);
+// priority queue without its smallest item
+lval *builtin_pq_pop(lenv *e, lval *a)
+{
+	LASSERT_NUM("pq-pop", a, 1);
+	LASSERT_TYPE("pq-pop", a, 0, LVAL_PQ);
+	LASSERT(a, a->cell[0]->heap->count > 0, "Function 'pq-pop' passed an empty priority queue.");
 
-		if (strcmp(op, "+") == 0)
-		{
-			x->num += y->num;
-		}
-		if (strcmp(op, "-") == 0)
-		{
-			x->num -= y->num;
-		}
-		if (strcmp(op, "*") == 0)
-		{
-			x->num *= y->num;
-		}
-		if (strcmp(op, "%") == 0)
-		{
-			x->num = fmod(x->num, y->num);
-		}
-		if (strcmp(op, "/") == 0)
-		{
-			if (y->num == 0)
-			{
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division By Zero!");
-				break;
-			}
-			x->num /= y->num;
-		}
+	lval *q = lval_pop(a, 0);
+	lval_del(lheap_pop(lheap_own(q)));
+	lval_del(a);
+	return q;
+}
 
-		lval_del(y);
-	}
+// smallest item of a priority queue
+lval *builtin_pq_peek(lenv *e, lval *a)
+{
+	LASSERT_NUM("pq-peek", a, 1);
+	LASSERT_TYPE("pq-peek", a, 0, LVAL_PQ);
+	LASSERT(a, a->cell[0]->heap->count > 0, "Function 'pq-peek' passed an empty priority queue.");
 
+	lval *x = lval_copy(a->cell[0]->heap->items[0]);
 	lval_del(a);
 	return x;
 }
 
-lval *builtin_add(lenv *e, lval *a)
+// lazy numbers from start up to but not including end, by step (default 1)
+lval *builtin_range_seq(lenv *e, lval *a)
 {
-	return builtin_op(e, a, "+");
+	LASSERT(a, a->count == 2 || a->count == 3, "Function 'range' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+	for (int i = 0; i < a->count; i++)
+	{
+		LASSERT_TYPE("range", a, i, LVAL_NUM);
+	}
+	double step = a->count == 3 ? a->cell[2]->num : 1;
+	LASSERT(a, step != 0, "Function 'range' passed a step of 0.");
+
+	lseq *s = lseq_new(LSEQ_RANGE);
+	s->start = a->cell[0]->num;
+	s->end = a->cell[1]->num;
+	s->step = step;
+	lval_del(a);
+	return lval_seq(s);
 }
 
-lval *builtin_sub(lenv *e, lval *a)
+// the endless lazy sequence x, f x, f (f x), ...
+lval *builtin_iterate(lenv *e, lval *a)
 {
-	return builtin_op(e, a, "-");
+	LASSERT_NUM("iterate", a, 2);
+	LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+	lseq *s = lseq_new(LSEQ_ITERATE);
+	s->fn = lval_pop(a, 0);
+	s->val = lval_pop(a, 0);
+	lval_del(a);
+	return lval_seq(s);
 }
 
-lval *builtin_mul(lenv *e, lval *a)
+// a map or filter sequence over the list or sequence argument. With eval the
+// items are evaluated before f sees them, as the stdlib map and filter did.
+lval *builtin_lazy(lval *a, char *func, int kind, int eval)
 {
-	return builtin_op(e, a, "*");
+	LASSERT_NUM(func, a, 2);
+	LASSERT_TYPE(func, a, 0, LVAL_FUN);
+	LASSERT_TWOTYPES(func, a, 1, LVAL_SEQ, LVAL_QEXPR);
+
+	lseq *s = lseq_new(kind);
+	s->fn = lval_pop(a, 0);
+	s->name = func;
+	s->eval = eval;
+	s->src = lseq_of(lval_pop(a, 0));
+	lval_del(a);
+	return lval_seq(s);
 }
 
-lval *builtin_div(lenv *e, lval *a)
+lval *builtin_lazy_map(lenv *e, lval *a)
 {
-	return builtin_op(e, a, "/");
+	return builtin_lazy(a, "lazy-map", LSEQ_MAP, 0);
 }
 
-lval *builtin_mod(lenv *e, lval *a)
+lval *builtin_lazy_filter(lenv *e, lval *a)
 {
-	return builtin_op(e, a, "%");
+	return builtin_lazy(a, "lazy-filter", LSEQ_FILTER, 0);
 }
 
-lval *builtin_ord(lenv *e, lval *a, char *op)
+// first n items of a list, or a lazy sequence of the first n elements
+lval *builtin_take(lenv *e, lval *a)
 {
-	bool r;
-
-	if (strcmp(op, "!") == 0)
+	LASSERT_NUM("take", a, 2);
+	LASSERT_TYPE("take", a, 0, LVAL_NUM);
+	LASSERT_TWOTYPES("take", a, 1, LVAL_SEQ, LVAL_QEXPR);
+	LASSERT_INT("take", a, 0);
+	LASSERT(a, a->cell[0]->num >= 0, "Function 'take' passed a negative count.");
+
+	long n = a->cell[0]->num;
+	lval *l = lval_pop(a, 1);
+	lval_del(a);
+	if (l->type == LVAL_QEXPR)
 	{
-		LASSERT_NUM(op, a, 1);
-
-		if (a->cell[0]->type != LVAL_NUM && a->cell[0]->type != LVAL_BOOL)
+		while (l->count > n)
 		{
-			lval_err("Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.", a->cell[0]->type, "Boolean or Number");
+			lval_del(lval_pop(l, l->count - 1));
 		}
-
-		r = !(a->cell[0]->num);
+		return l;
 	}
-	else
-	{
-
-		LASSERT_NUM(op, a, 2);
-		// LASSERT_TYPE(op, a, 0, LVAL_NUM);
-		// LASSERT_TYPE(op, a, 1, LVAL_NUM);
-
-		// check types, could be num or bool. both args need not be of the same type
-		if (a->cell[0]->type != LVAL_NUM && a->cell[0]->type != LVAL_BOOL)
-		{
-			lval_err("Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.", a->cell[0]->type, "Boolean or Number");
-		}
 
-		if (a->cell[1]->type != LVAL_NUM && a->cell[1]->type != LVAL_BOOL)
-		{
-			lval_err("Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.", a->cell[1]->type, "Boolean or Number");
-		}
+	lseq *s = lseq_new(LSEQ_TAKE);
+	s->n = n;
+	s->src = lseq_of(l);
+	return lval_seq(s);
+}
 
-		if (strcmp(op, ">") == 0)
-		{
-			r = (a->cell[0]->num > a->cell[1]->num);
-		}
-		if (strcmp(op, "<") == 0)
-		{
-			r = (a->cell[0]->num < a->cell[1]->num);
-		}
-		if (strcmp(op, ">=") == 0)
-		{
-			r = (a->cell[0]->num >= a->cell[1]->num);
-		}
-		if (strcmp(op, "<=") == 0)
-		{
-			r = (a->cell[0]->num <= a->cell[1]->num);
-		}
-		if (strcmp(op, "||") == 0)
-		{
-			r = (a->cell[0]->num || a->cell[1]->num);
-		}
-		if (strcmp(op, "&&") == 0)
+// f (... (f (f z x0) x1) ...) over a list or sequence. Like the stdlib
+// foldl it replaces, items are evaluated first, so {a 1} folds the value of a.
+lval *builtin_foldl(lenv *e, lval *a)
+{
+	LASSERT_NUM("foldl", a, 3);
+	LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+	LASSERT_TWOTYPES("foldl", a, 2, LVAL_SEQ, LVAL_QEXPR);
+
+	lval *f = lval_pop(a, 0);
+	lval *z = lval_pop(a, 0);
+	lseq *s = lseq_of(lval_pop(a, 0));
+	lseq_it *it = lseq_iter(s);
+	lval *x;
+	while (z->type != LVAL_ERR && (x = lseq_next(e, it)) != NULL)
+	{
+		x = lval_eval(e, x);
+		if (x->type == LVAL_ERR)
 		{
-			r = (a->cell[0]->num && a->cell[1]->num);
+			lval_del(z);
+			z = x;
+			break;
 		}
+		z = lval_call(e, f, lval_add(lval_add(lval_sexpr(), z), x));
 	}
-
+	lseq_it_del(it);
+	lseq_del(s);
+	lval_del(f);
 	lval_del(a);
-	lval *b = lval_bool();
-	b->num = r;
-	return b;
+	return z;
 }
 
-lval *builtin_gt(lenv *e, lval *a)
+// apply f to the value of every item of a list or sequence
+lval *builtin_map(lenv *e, lval *a)
 {
-	return builtin_ord(e, a, ">");
+	lval *s = builtin_lazy(a, "map", LSEQ_MAP, 1);
+	return s->type == LVAL_ERR ? s : builtin_seq_to_list(e, lval_add(lval_sexpr(), s));
 }
 
-lval *builtin_lt(lenv *e, lval *a)
+// items of a list or sequence whose value f is true for
+lval *builtin_filter(lenv *e, lval *a)
 {
-	return builtin_ord(e, a, "<");
+	lval *s = builtin_lazy(a, "filter", LSEQ_FILTER, 1);
+	return s->type == LVAL_ERR ? s : builtin_seq_to_list(e, lval_add(lval_sexpr(), s));
 }
 
-lval *builtin_ge(lenv *e, lval *a)
+lval *builtin_seq_to_list(lenv *e, lval *a)
 {
-	return builtin_ord(e, a, ">=");
-}
+	LASSERT_NUM("seq->list", a, 1);
+	LASSERT_TYPE("seq->list", a, 0, LVAL_SEQ);
 
-lval *builtin_le(lenv *e, lval *a)
-{
-	return builtin_ord(e, a, "<=");
+	lval *l = lval_qexpr();
+	lseq_it *it = lseq_iter(a->cell[0]->seq);
+	lval *x;
+	while ((x = lseq_next(e, it)) != NULL)
+	{
+		if (x->type == LVAL_ERR)
+		{
+			lval_del(l);
+			l = x;
+			break;
+		}
+		lval_add(l, x);
+	}
+	lseq_it_del(it);
+	lval_del(a);
+	return l;
 }
 
-lval *builtin_or(lenv *e, lval *a)
+// create a persistent vector from a q-expression
+lval *builtin_pvec(lenv *e, lval *a)
 {
-	return builtin_ord(e, a, "||");
-}
+	LASSERT_NUM("pvec", a, 1);
+	LASSERT_TYPE("pvec", a, 0, LVAL_QEXPR);
 
-lval *builtin_and(lenv *e, lval *a)
-{
-	return builtin_ord(e, a, "&&");
+	lval *l = a->cell[0];
+	lval *v = lval_pvec();
+	while (l->count)
+	{
+		lpvec_push(v, lval_pop(l, 0));
+	}
+	lval_del(a);
+	return v;
 }
 
-lval *builtin_not(lenv *e, lval *a)
+lval *builtin_pvec_to_list(lenv *e, lval *a)
 {
-	return builtin_ord(e, a, "!");
-}
+	LASSERT_NUM("pvec->list", a, 1);
+	LASSERT_TYPE("pvec->list", a, 0, LVAL_PVEC);
 
-lval *builtin_cmp(lenv *e, lval *a, char *op)
-{
-	LASSERT_NUM(op, a, 2);
-	bool r;
-	if (strcmp(op, "==") == 0)
-	{
-		r = lval_eq(a->cell[0], a->cell[1]);
-	}
-	if (strcmp(op, "!=") == 0)
-	{
-		r = !lval_eq(a->cell[0], a->cell[1]);
-	}
+	lval *x = lval_entries(a->cell[0]);
 	lval_del(a);
-	lval *b = lval_bool();
-	b->num = r;
-	return b;
-	return b;
+	return x;
 }
 
-lval *builtin_eq(lenv *e, lval *a)
+lval *builtin_vnth(lenv *e, lval *a)
 {
-	return builtin_cmp(e, a, "==");
+	LASSERT_NUM("vnth", a, 2);
+	LASSERT_TYPE("vnth", a, 0, LVAL_PVEC);
+	LASSERT_TYPE("vnth", a, 1, LVAL_NUM);
+	LASSERT_INT("vnth", a, 1);
+
+	int i = a->cell[1]->num, count = a->cell[0]->count;
+	LASSERT(a, 0 <= i && i < count, "Function 'vnth' passed index %i for a vector of length %i.", i, count);
+
+	lval *x = lval_copy(lpvec_nth(a->cell[0], i));
+	lval_del(a);
+	return x;
 }
 
-lval *builtin_ne(lenv *e, lval *a)
+// vector with item i replaced, sharing everything off the path to it
+lval *builtin_vset(lenv *e, lval *a)
 {
-	return builtin_cmp(e, a, "!=");
+	LASSERT_NUM("vset", a, 3);
+	LASSERT_TYPE("vset", a, 0, LVAL_PVEC);
+	LASSERT_TYPE("vset", a, 1, LVAL_NUM);
+	LASSERT_INT("vset", a, 1);
+
+	int i = a->cell[1]->num, count = a->cell[0]->count;
+	LASSERT(a, 0 <= i && i < count, "Function 'vset' passed index %i for a vector of length %i.", i, count);
+
+	lval *x = lval_pop(a, 2);
+	lval *v = lval_pop(a, 0);
+	lpvec_set(v, i, x);
+	lval_del(a);
+	return v;
 }
 
-lval *builtin_head(lenv *e, lval *a)
+lval *builtin_vpush(lenv *e, lval *a)
 {
-	// a should contain a valid q expr
-	// q expr should not be empty
-	// head should only receive 1 argument
-	LASSERT_NUM("head", a, 1);
-	LASSERT_TWOTYPES("head", a, 0, LVAL_QEXPR, LVAL_STR);
-	LASSERT_NOT_EMPTY("head", a, 1);
+	LASSERT(a, a->count >= 2, "Function 'vpush' passed incorrect number of arguments. Got %i, Expected at least 2.", a->count);
+	LASSERT_TYPE("vpush", a, 0, LVAL_PVEC);
 
-	lval *v = lval_take(a, 0); // takes the first arg
-	if (v->type == LVAL_QEXPR)
+	lval *v = lval_pop(a, 0);
+	while (a->count)
 	{
-		while (v->count > 1)
-		{
-			// lval* x = lval_pop(v,1);
-			// lval_print(x);
-			// printf("\n");
-			lval_del(lval_pop(v, 1));
-		}
+		lpvec_push(v, lval_pop(a, 0));
 	}
+	lval_del(a);
+	return v;
+}
 
-	if (v->type == LVAL_STR)
+lval *builtin_vconcat(lenv *e, lval *a)
+{
+	for (int i = 0; i < a->count; i++)
 	{
-		memset((v->str) + 1, 0, strlen(v->str) * sizeof(char));
-		char *first = realloc(v->str, sizeof(char));
-		v = lval_str(first);
+		LASSERT_TYPE("vconcat", a, i, LVAL_PVEC);
 	}
+	LASSERT(a, a->count >= 1, "Function 'vconcat' passed no arguments.");
 
+	lval *v = lval_pop(a, 0);
+	for (int i = 0; i < a->count; i++)
+	{
+		lpvec_concat(v, a->cell[i]);
+	}
+	lval_del(a);
 	return v;
 }
 
-lval *builtin_tail(lenv *e, lval *a)
+// create a vector from a q-expression of numbers
+lval *builtin_vec(lenv *e, lval *a)
 {
-	LASSERT_NUM("tail", a, 1);
-	LASSERT_TWOTYPES("tail", a, 0, LVAL_QEXPR, LVAL_STR);
-	LASSERT_NOT_EMPTY("tail", a, 1);
-
-	lval *v = lval_take(a, 0);
+	LASSERT_NUM("vec", a, 1);
+	LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
 
-	if (v->type == LVAL_QEXPR)
+	lval *l = a->cell[0];
+	for (int i = 0; i < l->count; i++)
 	{
-		lval_del(lval_pop(v, 0));
+		LASSERT(a, l->cell[i]->type == LVAL_NUM, "Function 'vec' passed a list containing %s at index %i, Expected Number.", ltype_name(l->cell[i]->type), i);
 	}
 
-	if (v->type == LVAL_STR)
+	lval *v = lval_f64vec(l->count);
+	for (int i = 0; i < l->count; i++)
 	{
-		v = lval_str(v->str + 1);
+		v->vec->data[i] = l->cell[i]->num;
 	}
-
+	lval_del(a);
 	return v;
 }
 
-lval *builtin_list(lenv *e, lval *a)
-{
-	a->type = LVAL_QEXPR;
-	return a;
-}
-
-lval *builtin_eval(lenv *e, lval *a)
+// q-expression of the numbers in a vector
+lval *builtin_vec_list(lenv *e, lval *a)
 {
-	LASSERT_NUM("eval", a, 1);
-	LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-
-	// change qexpr type to sexpr and evaluate
-	lval *x = lval_take(a, 0);
-	x->type = LVAL_SEXPR;
-	return lval_eval(e, x);
+	LASSERT_NUM("vec->list", a, 1);
+	LASSERT_TYPE("vec->list", a, 0, LVAL_F64VEC);
+
+	lvec *x = a->cell[0]->vec;
+	lval *l = lval_qexpr();
+	l->count = x->count;
+	l->cell = malloc(sizeof(lval *) * x->count);
+	for (int i = 0; i < x->count; i++)
+	{
+		l->cell[i] = lval_num(x->data[i]);
+	}
+	lval_del(a);
+	return l;
 }
 
-lval *builtin_join(lenv *e, lval *a)
+// sum of a vector or of a q-expression of numbers
+lval *builtin_sum(lenv *e, lval *a)
 {
+	LASSERT_NUM("sum", a, 1);
+	int t = a->cell[0]->type;
+	LASSERT(a, t == LVAL_F64VEC || t == LVAL_QEXPR || t == LVAL_SEQ,
+			"Function 'sum' passed incorrect type for argument 0. Got %s, Expected F64 Vector, Q-Expression or Lazy Sequence.", ltype_name(t));
 
-	bool not_all_qexpr = false;
-	bool not_all_strs = false;
-
-	for (int i = 0; i < a->count; i++)
+	double r = 0;
+	if (t == LVAL_F64VEC)
 	{
-		if (a->cell[i]->type != LVAL_QEXPR)
+		r = vec_sum(a->cell[0]->vec->data, a->cell[0]->vec->count);
+	}
+	else if (t == LVAL_SEQ)
+	{
+		lseq_it *it = lseq_iter(a->cell[0]->seq);
+		lval *x;
+		for (int i = 0; (x = lseq_next(e, it)) != NULL; i++)
 		{
-			not_all_qexpr = true;
+			if (x->type != LVAL_NUM)
+			{
+				lseq_it_del(it);
+				lval_del(a);
+				if (x->type == LVAL_ERR)
+				{
+					return x;
+				}
+				lval *err = lval_err("Function 'sum' passed a sequence containing %s at index %i, Expected Number.", ltype_name(x->type), i);
+				lval_del(x);
+				return err;
+			}
+			r += x->num;
+			lval_del(x);
 		}
-		// LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type. Got %s, Expected %s.", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+		lseq_it_del(it);
 	}
-
-	for (int i = 0; i < a->count; i++)
+	else
 	{
-		if (a->cell[i]->type != LVAL_STR)
+		lval *l = a->cell[0];
+		for (int i = 0; i < l->count; i++)
 		{
-			not_all_strs = true;
+			LASSERT(a, l->cell[i]->type == LVAL_NUM, "Function 'sum' passed a list containing %s at index %i, Expected Number.", ltype_name(l->cell[i]->type), i);
+			r += l->cell[i]->num;
 		}
 	}
+	lval_del(a);
+	return lval_num(r);
+}
 
-	// either all should be qexprs or all should be strs
-	if (not_all_qexpr ^ not_all_strs)
-	{
-		lval *x;
+lval *builtin_dot(lenv *e, lval *a)
+{
+	LASSERT_NUM("dot", a, 2);
+	LASSERT_TYPE("dot", a, 0, LVAL_F64VEC);
+	LASSERT_TYPE("dot", a, 1, LVAL_F64VEC);
+	LASSERT(a, a->cell[0]->vec->count == a->cell[1]->vec->count,
+			"Function 'dot' passed vectors of different lengths. Got %i and %i.", a->cell[0]->vec->count, a->cell[1]->vec->count);
 
-		if (not_all_strs)
-		{
-			x = lval_pop(a, 0);
+	double r = vec_dot(a->cell[0]->vec->data, a->cell[1]->vec->data, a->cell[0]->vec->count);
+	lval_del(a);
+	return lval_num(r);
+}
 
-			while (a->count)
-			{
-				x = lval_join(x, lval_pop(a, 0));
-			}
+// min or max of a single vector, or of number arguments
+lval *builtin_minmax(lval *a, char *func, int is_max)
+{
+	LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", func);
 
-			lval_del(a);
+	double r;
+	if (a->count == 1 && a->cell[0]->type == LVAL_F64VEC)
+	{
+		lvec *x = a->cell[0]->vec;
+		LASSERT(a, x->count > 0, "Function '%s' passed an empty vector.", func);
+		r = is_max ? vec_max(x->data, x->count) : vec_min(x->data, x->count);
+	}
+	else
+	{
+		for (int i = 0; i < a->count; i++)
+		{
+			LASSERT_TYPE(func, a, i, LVAL_NUM);
 		}
-
-		if (not_all_qexpr)
+		r = a->cell[0]->num;
+		for (int i = 1; i < a->count; i++)
 		{
+			double x = a->cell[i]->num;
+			r = is_max ? (x > r ? x : r) : (x < r ? x : r);
+		}
+	}
+	lval_del(a);
+	return lval_num(r);
+}
 
-			// allocated memory for larger string and concatenate
-			int total_size = 0;
-			for (int i = 0; i < a->count; i++)
-			{
-				total_size += strlen(a->cell[i]->str);
-			}
+lval *builtin_min(lenv *e, lval *a)
+{
+	return builtin_minmax(a, "min", 0);
+}
 
-			// allocate mem for a larger string
-			char *concat_str = malloc(sizeof(char) * (total_size + 1));
+lval *builtin_max(lenv *e, lval *a)
+{
+	return builtin_minmax(a, "max", 1);
+}
 
-			// concatenate strings
-			for (int i = 0; i < a->count; i++)
-			{
-				strcat(concat_str, a->cell[i]->str);
-			}
+// create a matrix from a q-expression of equally long rows of numbers
+lval *builtin_mat(lenv *e, lval *a)
+{
+	LASSERT_NUM("mat", a, 1);
+	LASSERT_TYPE("mat", a, 0, LVAL_QEXPR);
 
-			lval_del(a);
-			x = lval_str(concat_str);
+	lval *l = a->cell[0];
+	LASSERT(a, l->count > 0, "Function 'mat' passed {} for argument 0.");
+	int cols = l->cell[0]->type == LVAL_QEXPR ? l->cell[0]->count : 0;
+	for (int i = 0; i < l->count; i++)
+	{
+		lval *r = l->cell[i];
+		LASSERT(a, r->type == LVAL_QEXPR && r->count == cols && cols > 0,
+				"Function 'mat' passed an invalid row %i. Expected a Q-Expression of %i numbers.", i, cols);
+		for (int j = 0; j < cols; j++)
+		{
+			LASSERT(a, r->cell[j]->type == LVAL_NUM, "Function 'mat' passed a row containing %s at index %i, Expected Number.", ltype_name(r->cell[j]->type), j);
 		}
-
-		return x;
 	}
-	else
-	{
 
-		if (not_all_qexpr)
+	LASSERT(a, mat_shape_ok(l->count, cols), "Function 'mat' passed a %ix%i matrix, which is too large.", l->count, cols);
+
+	lval *m = lval_mat(l->count, cols);
+	for (int i = 0; i < l->count; i++)
+	{
+		for (int j = 0; j < cols; j++)
 		{
-			for (int i = 0; i < a->count; i++)
-			{
-				LASSERT(a, a->cell[i]->type == LVAL_QEXPR, "Function 'join' passed incorrect type for argument %i. Got %s, Expected %s.", i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
-			}
+			m->vec->data[i * cols + j] = l->cell[i]->cell[j]->num;
 		}
+	}
+	lval_del(a);
+	return m;
+}
 
-		if (not_all_strs)
+// q-expression of rows of a matrix
+lval *builtin_mat_list(lenv *e, lval *a)
+{
+	LASSERT_NUM("mat->list", a, 1);
+	LASSERT_TYPE("mat->list", a, 0, LVAL_MAT);
+
+	lval *m = a->cell[0];
+	lval *l = lval_qexpr();
+	for (int i = 0; i < m->rows; i++)
+	{
+		lval *r = lval_qexpr();
+		for (int j = 0; j < m->cols; j++)
 		{
-			for (int i = 0; i < a->count; i++)
-			{
-				LASSERT(a, a->cell[i]->type == LVAL_STR, "Function 'join' passed incorrect type for argument %i. Got %s, Expected %s.", i, ltype_name(a->cell[i]->type), ltype_name(LVAL_STR));
-			}
+			lval_add(r, lval_num(m->vec->data[i * m->cols + j]));
 		}
-
-		return lval_err("Incorrect types to join. Only Q-expressions or strings can be joined.");
+		lval_add(l, r);
 	}
+	lval_del(a);
+	return l;
 }
 
-lval *builtin_len(lenv *e, lval *a)
+lval *builtin_transpose(lenv *e, lval *a)
 {
-	LASSERT_NUM("len", a, 1);
-	LASSERT_TWOTYPES("len", a, 0, LVAL_QEXPR, LVAL_STR);
-	printf("HERE"); 
+	LASSERT_NUM("transpose", a, 1);
+	LASSERT_TYPE("transpose", a, 0, LVAL_MAT);
 
-	if(a->type == LVAL_QEXPR){
-		double len = a->cell[0]->count;
-		lval_del(a);
-		return lval_num(len);
-	}
+	lval *m = a->cell[0];
+	lval *t = lval_mat(m->cols, m->rows);
+	mat_transpose(t->vec->data, m->vec->data, m->rows, m->cols);
+	lval_del(a);
+	return t;
+}
 
-	if(a->type == LVAL_STR){
-		int len = strlen(a->str); 
-		lval_del(a); 
-		return lval_num(len); 
+// mslice m r0 r1 c0 c1: rows r0 to r1 and columns c0 to c1, ends exclusive
+lval *builtin_mslice(lenv *e, lval *a)
+{
+	LASSERT_NUM("mslice", a, 5);
+	LASSERT_TYPE("mslice", a, 0, LVAL_MAT);
+	for (int i = 1; i < 5; i++)
+	{
+		LASSERT_TYPE("mslice", a, i, LVAL_NUM);
+		LASSERT_INT("mslice", a, i);
 	}
 
-	return lval_err("This error is not possible"); 
+	lval *m = a->cell[0];
+	int r0 = a->cell[1]->num, r1 = a->cell[2]->num;
+	int c0 = a->cell[3]->num, c1 = a->cell[4]->num;
+	LASSERT(a, 0 <= r0 && r0 < r1 && r1 <= m->rows && 0 <= c0 && c0 < c1 && c1 <= m->cols,
+			"Function 'mslice' passed an invalid range [%i %i) x [%i %i) for a %ix%i matrix.", r0, r1, c0, c1, m->rows, m->cols);
+
+	lval *s = lval_mat(r1 - r0, c1 - c0);
+	for (int i = r0; i < r1; i++)
+	{
+		memcpy(s->vec->data + (i - r0) * s->cols, m->vec->data + i * m->cols + c0, sizeof(double) * s->cols);
+	}
+	lval_del(a);
+	return s;
 }
 
-lval *builtin_cons(lenv *e, lval *a)
+lval *builtin_matmul(lenv *e, lval *a)
 {
-	LASSERT_NUM("cons", a, 2);
-	LASSERT_TYPE("cons", a, 0, LVAL_NUM);
-	LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+	LASSERT_NUM("matmul", a, 2);
+	LASSERT_TYPE("matmul", a, 0, LVAL_MAT);
+	LASSERT_TYPE("matmul", a, 1, LVAL_MAT);
 
-	lval *v = lval_qexpr();
-	lval_add(v, a->cell[0]);
-	v = lval_join(v, a->cell[1]);
-	return v;
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+	LASSERT(a, x->cols == y->rows, "Function 'matmul' passed incompatible shapes %ix%i and %ix%i.", x->rows, x->cols, y->rows, y->cols);
+	LASSERT(a, mat_shape_ok(x->rows, y->cols), "Function 'matmul' would make a %ix%i matrix, which is too large.", x->rows, y->cols);
+
+	lval *r = lval_mat(x->rows, y->cols);
+	mat_mul(r->vec->data, x->vec->data, y->vec->data, x->rows, x->cols, y->cols);
+	lval_del(a);
+	return r;
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func)
-{
-	LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* Sorting */
 
-	lval *syms = a->cell[0];
-	for (int i = 0; i < syms->count; i++)
+// Lists of numbers or strings at least this long are sorted with one thread
+// per core
+#define SORT_PARALLEL_MIN 65536
+#define SORT_MAX_THREADS 8
+
+typedef int (*sort_cmp)(const void *, const void *);
+
+typedef struct
+{
+	char *base;
+	char *tmp; // scratch space of the same size as base
+	size_t n;
+	size_t size;
+	sort_cmp cmp;
+	int depth; // levels of the recursion still allowed to spawn a thread
+} sort_job;
+
+static void *merge_sort(void *arg)
+{
+	sort_job *j = arg;
+	if (j->depth == 0)
 	{
-		LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot define non-symbol. Got %s, Expected %s.", func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+		qsort(j->base, j->n, j->size, j->cmp);
+		return NULL;
 	}
 
-	LASSERT(a, (syms->count == a->count - 1), "Function '%s' passed too many arguments for symbols. Got %i, Expected %i.", func, syms->count, a->count - 1);
+	// sort both halves, the left one on a new thread
+	size_t half = j->n / 2;
+	sort_job left = {j->base, j->tmp, half, j->size, j->cmp, j->depth - 1};
+	sort_job right = {j->base + half * j->size, j->tmp + half * j->size, j->n - half, j->size, j->cmp, j->depth - 1};
 
-	for (int i = 0; i < syms->count; i++)
+	pthread_t t;
+	int spawned = pthread_create(&t, NULL, merge_sort, &left) == 0;
+	if (!spawned)
 	{
-		/* If 'def' define in globally. If 'put' define in locally */
-		if (strcmp(func, "def") == 0)
+		merge_sort(&left);
+	}
+	merge_sort(&right);
+	if (spawned)
+	{
+		pthread_join(t, NULL);
+	}
+
+	// merge into tmp and copy back
+	char *a = left.base, *a_end = right.base;
+	char *b = right.base, *b_end = j->base + j->n * j->size;
+	char *out = j->tmp;
+	while (a < a_end && b < b_end)
+	{
+		if (j->cmp(b, a) < 0)
 		{
-			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+			memcpy(out, b, j->size);
+			b += j->size;
 		}
-
-		if (strcmp(func, "=") == 0)
+		else
 		{
-			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+			memcpy(out, a, j->size);
+			a += j->size;
 		}
+		out += j->size;
 	}
-
-	lval_del(a);
-	return lval_sexpr();
+	memcpy(out, a, a_end - a);
+	out += a_end - a;
+	memcpy(out, b, b_end - b);
+	memcpy(j->base, j->tmp, j->n * j->size);
+	return NULL;
 }
 
-lval *builtin_def(lenv *e, lval *a)
+// sort an array like qsort, using several threads for large inputs
+void parallel_sort(void *base, size_t n, size_t size, sort_cmp cmp)
 {
-	// LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type. Got %s, Expected %s", ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
-
-	// // first argument is symbol list
-	// lval* syms = a->cell[0];
-
-	// for(int i = 0; i < syms->count; i++){
-	//   LASSERT(a, syms->cell[i]->type == LVAL_SYM, "Function 'def' can not define non-symbol. Got %s", ltype_name(syms->cell[i]->type));
-	// }
+	int depth = 0;
+	if (n >= SORT_PARALLEL_MIN)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long t = 1; t * 2 <= cores && t * 2 <= SORT_MAX_THREADS; t *= 2)
+		{
+			depth++;
+		}
+	}
 
-	// LASSERT(a, syms->count == a->count - 1, "Function 'def' can not define incorrect number of values to symbols. Got %i symbols and %i values", syms->count, a->count-1);
+	if (depth == 0)
+	{
+		qsort(base, n, size, cmp);
+		return;
+	}
 
-	// // assign values to symbols
-	// for(int i = 0; i < syms->count; i++){
-	//   lenv_put(e, syms->cell[i], a->cell[i+1]);
-	// }
+	sort_job j = {base, malloc(n * size), n, size, cmp, depth};
+	merge_sort(&j);
+	free(j.tmp);
+}
 
-	// lval_del(a);
-	// return lval_sexpr();
+// sort keys for the number and string fast paths
+typedef struct
+{
+	double num;
+	char *str;
+	size_t len;
+	lval *v;
+} sort_key;
 
-	return builtin_var(e, a, "def");
+static int sort_num_cmp(const void *x, const void *y)
+{
+	double a = ((const sort_key *)x)->num;
+	double b = ((const sort_key *)y)->num;
+	return (a > b) - (a < b);
 }
 
-lval *builtin_put(lenv *e, lval *a)
+static int sort_str_cmp(const void *x, const void *y)
 {
-	return builtin_var(e, a, "=");
+	const sort_key *a = x, *b = y;
+	int c = memcmp(a->str, b->str, a->len < b->len ? a->len : b->len);
+	return c != 0 ? c : (a->len > b->len) - (a->len < b->len);
 }
 
-lval *builtin_lambda(lenv *e, lval *a)
+static int sort_lval_cmp(const void *x, const void *y)
 {
-	LASSERT_NUM("\\", a, 2);
-	LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-	LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+	return lval_cmp(((const sort_key *)x)->v, ((const sort_key *)y)->v);
+}
 
-	// first q expression should only contain symbols
-	for (int i = 0; i < a->cell[0]->count; i++)
+// stable merge sort of cells calling a user comparator. Sets *err on failure.
+static void sort_with_fn(lenv *e, lval *f, lval **cells, lval **tmp, int n, lval **err)
+{
+	if (n < 2)
 	{
-		LASSERT(a, (a->cell[0]->cell[i]->type) == LVAL_SYM, "Cannot define non-symbol. Got %s, Expected %s.", ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM))
+		return;
 	}
 
-	lval *formals = lval_pop(a, 0);
-	lval *body = lval_pop(a, 0);
-	lval_del(a);
-
-	return lval_lambda(formals, body);
-}
-
-lval *builtin_if(lenv *e, lval *a)
-{
-	LASSERT_NUM("if", a, 3);
-	LASSERT_TWOTYPES("if", a, 0, LVAL_NUM, LVAL_BOOL);
-	LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-	LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+	int half = n / 2;
+	sort_with_fn(e, f, cells, tmp, half, err);
+	sort_with_fn(e, f, cells + half, tmp, n - half, err);
 
-	// to evaluate both expressions
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
+	int i = 0, j = half, k = 0;
+	while (i < half && j < n)
+	{
+		int before = 0;
+		if (*err == NULL)
+		{
+			// does the right item order strictly before the left one?
+			lval *args = lval_sexpr();
+			lval_add(args, lval_copy(cells[j]));
+			lval_add(args, lval_copy(cells[i]));
+			lval *r = lval_call(e, f, args);
 
-	lval *x;
-	if (a->cell[0]->num)
+			if (r->type == LVAL_NUM || r->type == LVAL_BOOL)
+			{
+				before = r->num != 0;
+				lval_del(r);
+			}
+			else if (r->type == LVAL_ERR)
+			{
+				*err = r;
+			}
+			else
+			{
+				*err = lval_err("Function 'sort' comparator returned %s, Expected Number or Boolean.", ltype_name(r->type));
+				lval_del(r);
+			}
+		}
+		tmp[k++] = before ? cells[j++] : cells[i++];
+	}
+	while (i < half)
 	{
-		x = lval_eval(e, lval_pop(a, 1));
+		tmp[k++] = cells[i++];
 	}
-	else
+	while (j < n)
 	{
-		x = lval_eval(e, lval_pop(a, 2));
+		tmp[k++] = cells[j++];
 	}
-
-	lval_del(a);
-	return x;
+	memcpy(cells, tmp, sizeof(lval *) * n);
 }
 
-// load contents from a file given file name as a string
-lval *builtin_load(lenv *e, lval *a)
+// sort l, or sort l less-than, returns the sorted list
+lval *builtin_sort(lenv *e, lval *a)
 {
-	LASSERT_NUM("load", a, 1);
-	LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-	FILE *f = fopen(a->cell[0]->str, "rb");
-	if (f == NULL)
+	LASSERT(a, a->count == 1 || a->count == 2, "Function 'sort' passed incorrect number of arguments. Got %i, Expected 1 or 2.", a->count);
+	LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+	if (a->count == 2)
 	{
-		lval *err = lval_err("Could not load Library %s", a->cell[0]->str);
-		lval_del(a);
-		return err;
+		LASSERT_TYPE("sort", a, 1, LVAL_FUN);
 	}
 
-	// Read File Contents
-	fseek(f, 0, SEEK_END);
-	long length = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	char *input = calloc(length + 1, 1);
-	fread(input, 1, length, f);
-	fclose(f);
-
-	// Read from input to create an S-Expr
-	int pos = 0;
-	lval *expr = lval_read_expr(input, &pos, '\0');
-	free(input);
+	lval *l = a->cell[0];
+	int n = l->count;
 
-	// Evaluate all expressions contained in S-Expr
-	if (expr->type != LVAL_ERR)
+	if (a->count == 2)
 	{
-		while (expr->count)
+		lval *err = NULL;
+		lval **tmp = malloc(sizeof(lval *) * n);
+		sort_with_fn(e, a->cell[1], l->cell, tmp, n, &err);
+		free(tmp);
+		if (err)
 		{
-			lval *x = lval_eval(e, lval_pop(expr, 0));
-			if (x->type == LVAL_ERR)
-			{
-				lval_println(x);
-			}
-			lval_del(x);
+			lval_del(a);
+			return err;
 		}
+		lval_del(lval_pop(a, 1));
+		return lval_take(a, 0);
 	}
-	else
+
+	// numbers and strings compare on a key copied next to the item,
+	// anything else goes through lval_cmp
+	int all_num = 1, all_str = 1;
+	for (int i = 0; i < n; i++)
 	{
-		lval_println(expr);
+		all_num = all_num && l->cell[i]->type == LVAL_NUM;
+		all_str = all_str && l->cell[i]->type == LVAL_STR;
 	}
 
-	lval_del(expr);
-	lval_del(a);
+	sort_key *keys = malloc(sizeof(sort_key) * n);
+	for (int i = 0; i < n; i++)
+	{
+		keys[i].v = l->cell[i];
+		keys[i].num = all_num ? l->cell[i]->num : 0;
+		keys[i].str = all_str ? lval_sdata(l->cell[i]) : NULL;
+		keys[i].len = all_str ? l->cell[i]->slen : 0;
+	}
 
-	return lval_sexpr();
+	// lval_cmp may copy and free values, which is not safe off the main thread
+	if (all_num || all_str)
+	{
+		parallel_sort(keys, n, sizeof(sort_key), all_num ? sort_num_cmp : sort_str_cmp);
+	}
+	else
+	{
+		qsort(keys, n, sizeof(sort_key), sort_lval_cmp);
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		l->cell[i] = keys[i].v;
+	}
+	free(keys);
+	return lval_take(a, 0);
 }
 
-lval *builtin_print(lenv *e, lval *a)
+// evaluate a q-expression and return {result milliseconds allocations}
+lval *builtin_time(lenv *e, lval *a)
 {
+	LASSERT_NUM("time", a, 1);
+	LASSERT_TYPE("time", a, 0, LVAL_QEXPR);
 
-	/* Print each argument followed by a space */
-	for (int i = 0; i < a->count; i++)
+	long long allocs = lval_allocs;
+	long long start = clock_ns();
+	lval *x = builtin_eval(e, a);
+	double ms = (clock_ns() - start) / 1e6;
+	allocs = lval_allocs - allocs;
+
+	if (x->type == LVAL_ERR)
 	{
-		lval_print(a->cell[i]);
-		putchar(' ');
+		return x;
 	}
 
-	/* Print a newline and delete arguments */
-	putchar('\n');
-	lval_del(a);
+	lval *v = lval_qexpr();
+	lval_add(v, x);
+	lval_add(v, lval_num(ms));
+	lval_add(v, lval_num(allocs));
+	return v;
+}
 
-	return lval_sexpr();
+// most iterations 'bench' times, so that counts and the timings array fit
+#define BENCH_MAX_RUNS 10000000
+
+static int bench_cmp(const void *x, const void *y)
+{
+	double a = *(const double *)x;
+	double b = *(const double *)y;
+	return (a > b) - (a < b);
 }
 
-lval *builtin_error(lenv *e, lval *a)
+// evaluate a q-expression n times after a warm-up and
+// return {min median p99 allocations-per-iteration}, times in milliseconds
+lval *builtin_bench(lenv *e, lval *a)
 {
-	LASSERT_NUM("error", a, 1);
-	LASSERT_TYPE("error", a, 0, LVAL_STR);
+	LASSERT_NUM("bench", a, 2);
+	LASSERT_TYPE("bench", a, 0, LVAL_QEXPR);
+	LASSERT_TYPE("bench", a, 1, LVAL_NUM);
+	LASSERT(a, a->cell[1]->num >= 1, "Function 'bench' expects at least 1 iteration. Got %.0f.", a->cell[1]->num);
+	LASSERT(a, a->cell[1]->num <= BENCH_MAX_RUNS, "Function 'bench' expects at most %i iterations. Got %.0f.", BENCH_MAX_RUNS, a->cell[1]->num);
+	LASSERT(a, a->cell[1]->num == floor(a->cell[1]->num), "Function 'bench' expects a whole number of iterations. Got %g.", a->cell[1]->num);
+
+	lval *body = a->cell[0];
+	int n = a->cell[1]->num;
+	int warmup = n / 10 > 0 ? n / 10 : 1;
+	double *times = malloc(sizeof(double) * n);
+	LASSERT(a, times != NULL, "Function 'bench' could not allocate room for %i timings.", n);
+	long long allocs = 0;
+
+	for (int i = 0; i < warmup + n; i++)
+	{
+		long long before = lval_allocs;
+		long long start = clock_ns();
+		lval *x = builtin_eval(e, lval_add(lval_sexpr(), lval_copy(body)));
+		long long elapsed = clock_ns() - start;
 
-	/* Construct Error from first argument */
-	lval *err = lval_err(a->cell[0]->str);
+		if (x->type == LVAL_ERR)
+		{
+			free(times);
+			lval_del(a);
+			return x;
+		}
+		lval_del(x);
 
-	/* Delete arguments and return */
+		if (i >= warmup)
+		{
+			times[i - warmup] = elapsed / 1e6;
+			allocs += lval_allocs - before;
+		}
+	}
+
+	qsort(times, n, sizeof(double), bench_cmp);
+	int p99 = (int)ceil(n * 0.99) - 1;
+
+	lval *v = lval_qexpr();
+	lval_add(v, lval_num(times[0]));
+	lval_add(v, lval_num(times[n / 2]));
+	lval_add(v, lval_num(times[p99]));
+	lval_add(v, lval_num((double)allocs / n));
+
+	free(times);
 	lval_del(a);
-	return err;
+	return v;
 }
 
 // add builtin functions to the environment
@@ -1537,7 +9104,10 @@ void lenv_add_builtins(lenv *e)
 	lenv_add_builtin(e, "eval", builtin_eval);
 	lenv_add_builtin(e, "join", builtin_join);
 	lenv_add_builtin(e, "len", builtin_len);
+	lenv_add_builtin(e, "substr", builtin_substr);
+	lenv_add_builtin(e, "nth-char", builtin_nth_char);
 	lenv_add_builtin(e, "cons", builtin_cons);
+	lenv_add_builtin(e, "sort", builtin_sort);
 	lenv_add_builtin(e, "\\", builtin_lambda);
 	lenv_add_builtin(e, "def", builtin_def);
 	lenv_add_builtin(e, "=", builtin_put);
@@ -1549,6 +9119,21 @@ void lenv_add_builtins(lenv *e)
 	lenv_add_builtin(e, "*", builtin_mul);
 	lenv_add_builtin(e, "/", builtin_div);
 	lenv_add_builtin(e, "%", builtin_mod);
+	lenv_add_builtin(e, "min", builtin_min);
+	lenv_add_builtin(e, "max", builtin_max);
+
+	/* Vector Functions */
+	lenv_add_builtin(e, "vec", builtin_vec);
+	lenv_add_builtin(e, "vec->list", builtin_vec_list);
+	lenv_add_builtin(e, "sum", builtin_sum);
+	lenv_add_builtin(e, "dot", builtin_dot);
+
+	/* Matrix Functions */
+	lenv_add_builtin(e, "mat", builtin_mat);
+	lenv_add_builtin(e, "mat->list", builtin_mat_list);
+	lenv_add_builtin(e, "transpose", builtin_transpose);
+	lenv_add_builtin(e, "mslice", builtin_mslice);
+	lenv_add_builtin(e, "matmul", builtin_matmul);
 
 	/* Comparison Functions */
 	lenv_add_builtin(e, "if", builtin_if);
@@ -1562,10 +9147,73 @@ void lenv_add_builtins(lenv *e)
 	lenv_add_builtin(e, "&&", builtin_and);
 	lenv_add_builtin(e, "!", builtin_not);
 
+	/* Control Flow Functions */
+	lenv_add_builtin(e, "do", builtin_do);
+	lenv_add_builtin(e, "let", builtin_let);
+	lenv_add_builtin(e, "select", builtin_select);
+	lenv_add_builtin(e, "cond", builtin_select);
+	lenv_add_builtin(e, "case", builtin_case_of);
+	lenv_add_builtin(e, "while", builtin_while);
+
+	/* Macro Functions */
+	lenv_add_builtin(e, "defmacro", builtin_defmacro);
+	lenv_add_builtin(e, "quasiquote", builtin_quasiquote);
+	lval *t = lval_bool();
+	t->num = true;
+	lenv_bind(e, "true", t);
+	lenv_bind(e, "false", lval_bool());
+
 	/* String Functions */
 	lenv_add_builtin(e, "load", builtin_load);
 	lenv_add_builtin(e, "error", builtin_error);
 	lenv_add_builtin(e, "print", builtin_print);
+	lenv_add_builtin(e, "flush", builtin_flush);
+	lenv_add_builtin(e, "find", builtin_find);
+	lenv_add_builtin(e, "split", builtin_split);
+	lenv_add_builtin(e, "replace", builtin_replace);
+	lenv_add_builtin(e, "trim", builtin_trim);
+	lenv_add_builtin(e, "starts-with", builtin_starts_with);
+	lenv_add_builtin(e, "to-number", builtin_to_number);
+	lenv_add_builtin(e, "str-upper", builtin_str_upper);
+	lenv_add_builtin(e, "str-lower", builtin_str_lower);
+
+	/* Map and Set Functions */
+	lenv_add_builtin(e, "hashmap", builtin_hashmap);
+	lenv_add_builtin(e, "hashset", builtin_hashset);
+	lenv_add_builtin(e, "insert", builtin_insert);
+	lenv_add_builtin(e, "get", builtin_get);
+	lenv_add_builtin(e, "remove", builtin_remove);
+	lenv_add_builtin(e, "contains", builtin_contains);
+	lenv_add_builtin(e, "keys", builtin_keys);
+	lenv_add_builtin(e, "size", builtin_size);
+	lenv_add_builtin(e, "omap", builtin_omap);
+	lenv_add_builtin(e, "range", builtin_range);
+	lenv_add_builtin(e, "pq", builtin_pq);
+	lenv_add_builtin(e, "pq-push", builtin_pq_push);
+	lenv_add_builtin(e, "pq-pop", builtin_pq_pop);
+	lenv_add_builtin(e, "pq-peek", builtin_pq_peek);
+
+	/* Persistent Vector Functions */
+	lenv_add_builtin(e, "pvec", builtin_pvec);
+	lenv_add_builtin(e, "pvec->list", builtin_pvec_to_list);
+	lenv_add_builtin(e, "vnth", builtin_vnth);
+	lenv_add_builtin(e, "vset", builtin_vset);
+	lenv_add_builtin(e, "vpush", builtin_vpush);
+	lenv_add_builtin(e, "vconcat", builtin_vconcat);
+
+	/* Lazy Sequence Functions */
+	lenv_add_builtin(e, "iterate", builtin_iterate);
+	lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+	lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+	lenv_add_builtin(e, "take", builtin_take);
+	lenv_add_builtin(e, "foldl", builtin_foldl);
+	lenv_add_builtin(e, "map", builtin_map);
+	lenv_add_builtin(e, "filter", builtin_filter);
+	lenv_add_builtin(e, "seq->list", builtin_seq_to_list);
+
+	/* Timing Functions */
+	lenv_add_builtin(e, "time", builtin_time);
+	lenv_add_builtin(e, "bench", builtin_bench);
 }
 
 // lval* builtin(lval* a, char* func) {
@@ -1637,10 +9285,74 @@ char *lval_str_escape(char x)
 	return "";
 }
 
+#ifndef SHERLANG_NO_MAIN
 int main(int argc, char **argv)
 {
+	atexit(out_flush);
+
+	char stack_base;
+	eval_stack_init(&stack_base);
+
+	// parse command line options, leaving only file names in argv
+	int nfiles = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--trace") == 0)
+		{
+			if (i + 1 == argc)
+			{
+				fprintf(stderr, "Option '--trace' expects a file name\n");
+				return 1;
+			}
+			trace_open(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--perf") == 0)
+		{
+			perf_open();
+		}
+		else if (strcmp(argv[i], "--unbuffered") == 0)
+		{
+			out_unbuffered = true;
+		}
+		else if (strcmp(argv[i], "--cek") == 0)
+		{
+			eval_cek = true;
+		}
+		else if (strcmp(argv[i], "--infer") == 0)
+		{
+			infer_enabled = true;
+		}
+		else if (strcmp(argv[i], "--no-jit") == 0)
+		{
+			jit_enabled = false;
+		}
+		else if (strcmp(argv[i], "--max-depth") == 0)
+		{
+			if (i + 1 == argc || atol(argv[i + 1]) <= 0)
+			{
+				fprintf(stderr, "Option '--max-depth' expects a positive number\n");
+				return 1;
+			}
+			eval_max_depth = atol(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--opt-level") == 0)
+		{
+			if (i + 1 == argc || argv[i + 1][0] < '0' || argv[i + 1][0] > '2' || argv[i + 1][1] != '\0')
+			{
+				fprintf(stderr, "Option '--opt-level' expects 0, 1 or 2\n");
+				return 1;
+			}
+			opt_level = argv[++i][0] - '0';
+		}
+		else
+		{
+			argv[++nfiles] = argv[i];
+		}
+	}
+	argc = nfiles + 1;
 
 	lenv *e = lenv_new();
+	lenv_global = e;
 	lenv_add_builtins(e);
 
 	// load standard library
@@ -1648,6 +9360,7 @@ int main(int argc, char **argv)
 	lval *load_args = lval_qexpr();
 	lval_add(load_args, std_name);
 	builtin_load(e, load_args);
+	infer_report = infer_enabled;
 
 	//   printf("Current Environment: \n");
 	//   for(int i = 0; i < e->count; i++){
@@ -1662,19 +9375,47 @@ int main(int argc, char **argv)
 	// Run interactive prompt in terminal
 	if (argc == 1)
 	{
-		puts("SherLang Version 0.0.0.0.5");
-		puts("Press Ctrl+c to Exit\n");
+		out_str("SherLang Version 0.0.0.0.5\n");
+		out_str("Press Ctrl+c to Exit\n\n");
 
 		while (1)
 		{
+			out_flush();
 			char *input = readline("SherLang> ");
 			add_history(input);
 
 			int pos = 0;
 			lval *expr = lval_read_expr(input, &pos, '\0');
+			lval *err = lval_expand(e, expr);
+			if (err)
+			{
+				lval_println(err);
+				lval_del(err);
+				lval_del(expr);
+				free(input);
+				continue;
+			}
+			lval_fuse(expr);
 
+			int form_name = trace_file ? trace_form_name(expr) : -1;
+			if (form_name != -1)
+			{
+				trace_event(form_name, 'f', 'B');
+			}
 			lval *x = lval_eval(e, expr);
-			lval_println(x);
+			if (form_name != -1)
+			{
+				trace_event(form_name, 'f', 'E');
+			}
+			if (x->type == LVAL_SEQ)
+			{
+				lval_print_seq(e, x);
+				out_char('\n');
+			}
+			else
+			{
+				lval_println(x);
+			}
 			lval_del(x);
 			free(input);
 		}
@@ -1700,4 +9441,5 @@ int main(int argc, char **argv)
 
 	lenv_del(e);
 	return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -1,38 +1,249 @@
 #ifndef SHERLANG_H
 #define SHERLANG_H
 #include<stdbool.h>
+#include<stddef.h>
 
 
 struct lval; 
 struct lenv; 
+struct lmap; 
+struct lbnode; 
+struct lheap; 
+struct lvec; 
+struct lstrbuf; 
+struct lpnode; 
+struct lseq; 
+struct lseq_it; 
+struct lframe; 
+struct ljit; 
+struct lcode; 
 typedef struct lval lval; 
 typedef struct lenv lenv; 
+typedef struct lmap lmap; 
+typedef struct lbnode lbnode; 
+typedef struct lheap lheap; 
+typedef struct lvec lvec; 
+typedef struct lstrbuf lstrbuf; 
+typedef struct lpnode lpnode; 
+typedef struct lseq lseq; 
+typedef struct lseq_it lseq_it; 
+typedef struct lframe lframe; 
+typedef struct ljit ljit; 
+typedef struct lcode lcode; 
 typedef lval*(*lbuiltin)(lenv*, lval*); 
 
+#define STR_INLINE 16 // strings shorter than this are stored in the lval itself, in the space of a lambda's fields 
+
+
+// hints left on expressions by the optimizer, and from OPT_ADD on by type 
+// inference (see lval_infer) 
+enum { OPT_NONE, OPT_NUM, OPT_BOOL, OPT_THEN, OPT_ELSE, OPT_FST, OPT_SND, OPT_NOT, 
+       OPT_ADD, OPT_SUB, OPT_MUL, OPT_DIV, OPT_MOD, OPT_EQ, OPT_NE, OPT_GT, OPT_LT, OPT_GE, OPT_LE }; 
+
+// operators of the arithmetic, comparison and logic builtins, in the order 
+// of the typed hints from OPT_ADD 
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_EQ, OP_NE, OP_GT, OP_LT, OP_GE, OP_LE, OP_OR, OP_AND, OP_NOT }; 
+
+// what builtin_var does with the values: def binds them globally, = locally 
+enum { VAR_DEF, VAR_PUT }; 
 
 // Enum for LISP value types
-enum { LVAL_ERR, LVAL_NUM, LVAL_BOOL, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR }; 
+enum { LVAL_ERR, LVAL_NUM, LVAL_BOOL, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_MAP, LVAL_SET, LVAL_OMAP, LVAL_PQ, LVAL_F64VEC, LVAL_MAT, LVAL_PVEC, LVAL_SEQ }; 
 
 struct lval {
 
   // Basic 
   int type;
-  double num; 
-  char* err;
-  char* sym; 
-  char* str; 
-
-  // Functions 
-  lbuiltin builtin;
-  lenv* env; 
-  lval* formals; // function args 
-  lval* body;  // function body
+  unsigned fused : 1; // heads a map/filter chain, see lval_fuse 
+  unsigned opt : 5; // OPT_* hint left by lval_optimize, the folded value is kept in num 
+  unsigned expanded : 26; // macro_epoch the code was last expanded in, see lval_expand 
+  int refs; // owners besides the first of a shared lambda body or formals, see lval_share 
 
   // maintain count and pointer to list of sval* to represent s expressions/q expressions (this is the fundamental cons cell in LISP)
+  // ordered maps and persistent vectors keep their entry count here too 
   int count;
-  struct lval** cell;
+
+  double num; // also the value folded into an OPT_NUM or OPT_BOOL hint 
+
+  // the payload of the value, which depends on its type 
+  union {
+    char* err;
+    char* sym; 
+
+    // Functions 
+    struct {
+      lbuiltin builtin;
+      lenv* env; 
+      lval* formals; // function args 
+      lval* body;  // function body
+    };
+
+    // s-expressions and q-expressions 
+    struct {
+      struct lval** cell;
+      lcode* code; // state kept for a lambda body, NULL until needed, see lval_code 
+      unsigned opt_deps; // guarded names the hint in opt relies on, see opt_dirty 
+    };
+
+    // hash maps and hash sets (shared between copies, copied on write)
+    lmap* map; 
+
+    // ordered maps (B-tree root) and priority queues
+    lbnode* root; 
+    lheap* heap; 
+
+    // contiguous arrays of doubles (shared between copies, copied on write)
+    // also hold the row-major elements of a rows x cols matrix 
+    struct {
+      lvec* vec; 
+      int rows; 
+      int cols; 
+    };
+
+    // persistent vectors (tree root and its height) 
+    struct {
+      lpnode* pnode; 
+      int pshift; 
+    };
+
+    // Strings: slen bytes at offset soff of a shared buffer, or at the 
+    // start of sso when sbuf is NULL 
+    struct {
+      lstrbuf* sbuf; 
+      size_t slen; 
+      union {
+        size_t soff; 
+        char sso[STR_INLINE]; 
+      };
+    };
+
+    // lazy sequences (shared between copies, never modified) 
+    lseq* seq; 
+  };
 };
 
+// open addressing hash table backing LVAL_MAP and LVAL_SET values 
+struct lmap{
+  int rc; // number of lvals sharing this table 
+  int count; 
+  int cap; // always a power of two 
+  unsigned int* hashes; 
+  lval** keys; // NULL marks an empty slot 
+  lval** vals; // NULL for sets 
+}; 
+
+// B-tree node backing LVAL_OMAP. Nodes are reference counted so copies of a 
+// map share structure and an update only copies the nodes on its path. 
+#define BTREE_MIN_DEGREE 4 
+#define BTREE_MAX_KEYS (2 * BTREE_MIN_DEGREE - 1) // small nodes keep the path copies of an update cheap 
+struct lbnode{
+  int rc; 
+  int n; // number of keys in use 
+  int leaf; 
+  lval* keys[BTREE_MAX_KEYS]; 
+  lval* vals[BTREE_MAX_KEYS]; 
+  lbnode* kids[BTREE_MAX_KEYS + 1]; 
+}; 
+
+// node of the relaxed radix balanced tree backing LVAL_PVEC. Leaves hold the 
+// items. Internal nodes whose children are all full except the last are 
+// indexed by radix; the others are relaxed and are searched by their table 
+// of cumulative child sizes. Nodes are reference counted and shared between 
+// versions of a vector. 
+#define PVEC_BITS 5 
+#define PVEC_WIDTH (1 << PVEC_BITS) 
+struct lpnode{
+  int rc; 
+  int n; // items or children in use 
+  int leaf; 
+  int relaxed; 
+  int sizes[PVEC_WIDTH]; // internal nodes only 
+  lval* items[PVEC_WIDTH]; 
+  lpnode* kids[PVEC_WIDTH]; 
+}; 
+
+// recipe of an LVAL_SEQ. Elements are computed by an lseq_it cursor only 
+// when a consumer asks for them. 
+enum { LSEQ_RANGE, LSEQ_LIST, LSEQ_ITERATE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE }; 
+struct lseq{
+  int rc; 
+  int kind; 
+  double start, end, step; // ranges 
+  long n; // take 
+  lval* fn; // iterate, map and filter 
+  char* name; // builtin that made a map or filter, for errors 
+  int eval; // map and filter evaluate each item before calling fn, like fst 
+  lval* val; // first value of iterate, items of a list 
+  lseq* src; // map, filter and take 
+}; 
+
+struct lseq_it{
+  lseq* s; 
+  long i; // elements produced so far 
+  lval* state; // last value of iterate 
+  lseq_it* src; 
+}; 
+
+// frame of the explicit stack evaluator (--cek), waiting for a value: the 
+// next argument of a call, the condition of an if, the result of a lambda 
+// body or of an expanded fst, snd or not 
+enum { K_ARGS, K_IF, K_CALL, K_HINT, K_FREE }; 
+struct lframe{
+  int kind; 
+  int name; // name of the call for tracing and counters, or -1 
+  lval* v; // expression being evaluated 
+  lenv* e; // and its environment 
+  lval* a; // arguments evaluated so far, the running lambda, or a value to delete 
+  lenv* env; // environment of the running lambda 
+}; 
+
+// a lambda body being counted or compiled to machine code 
+struct ljit{
+  int state; 
+  int calls; // before it is compiled 
+  int bails; // returns to the interpreter 
+  int type; // of the result, LVAL_NUM or LVAL_BOOL 
+  unsigned deps; // names the code relies on, see opt_dirty 
+  char* self; // name the lambda calls itself by, or NULL 
+  lval* formals; // of the lambda the code was compiled for 
+  void* code; 
+  size_t size; 
+  size_t frame; // bytes of C stack used by each call 
+}; 
+
+// what is kept for a list used as a lambda body, so that other values do 
+// not carry it 
+struct lcode{
+  ljit* jit; // call count and compiled code, see jit_call 
+  lval* (*aot)(lenv*); // C function evaluating the body, see sherlangc.c 
+  char* sig; // type of the lambda inferred with --infer, see lval_infer 
+}; 
+
+// storage shared by LVAL_STR values and their slices. Strings never change 
+// bytes they can see, so a string whose bytes end at len can be extended in 
+// place while every other string viewing the buffer stays the same. 
+struct lstrbuf{
+  int rc; 
+  size_t len; // bytes in use, data[len] is always '\0' 
+  size_t cap; // bytes allocated, not counting the terminator 
+  char* data; 
+}; 
+
+// storage of an LVAL_F64VEC 
+struct lvec{
+  int rc; 
+  int count; 
+  double* data; 
+}; 
+
+// binary min-heap backing LVAL_PQ (shared between copies, copied on write) 
+struct lheap{
+  int rc; 
+  int count; 
+  int cap; 
+  lval** items; 
+}; 
+
 // maintains mapping of variable names and LISP Values 
 struct lenv{
   lenv* par; // parent environment to allow functions to access global environment (which contain other builtins)  
@@ -45,6 +256,7 @@ struct lenv{
 // Function declarations
 
 // LISP val functions
+lval* lval_alloc(void); 
 lval* lval_num(double x); 
 lval* lval_err(char* fmt, ...); 
 lval* lval_sym(char* s); 
@@ -54,41 +266,154 @@ lval* lval_fun(lbuiltin func);
 lval* lval_lambda(lval* formals, lval* body); 
 lval* lval_bool(void); 
 lval* lval_str(char* s); 
+lval* lval_str_n(char* s, size_t n); 
+lval* lval_str_literal(char* s, size_t n); 
+char* lval_cstr(lval* v); 
+char* lval_sdata(lval* v); 
+char* lval_str_reserve(lval* v, size_t n); 
+void lval_str_setlen(lval* v, size_t n); 
+void lval_str_slice(lval* v, size_t i, size_t n); 
+void lval_str_append(lval* v, const char* s, size_t n); 
+lstrbuf* lstrbuf_new(size_t cap); 
+void lstrbuf_del(lstrbuf* b); 
+void str_intern_begin(void); 
+void str_intern_end(void); 
+lval* lval_map(void); 
+lval* lval_set(void); 
+lval* lval_omap(void); 
+lval* lval_pq(void); 
+lval* lval_f64vec(int count); 
+lval* lval_mat(int rows, int cols); 
 void lval_del(lval* v); 
 lval* lval_add(lval* v, lval* x); 
 lval* lval_pop(lval* v, int i); 
 lval* lval_take(lval* v, int i); 
+lval* lval_share(lval* v); 
+lcode* lval_code(lval* v); 
 lval* lval_copy(lval* v); 
 int lval_eq(lval* x, lval* y); 
+unsigned int lval_hash(lval* v); 
+int lval_cmp(lval* x, lval* y); 
+int lval_len(lval* v); 
+lval* lval_entries(lval* v); 
+lval* lval_pvec(void); 
 lval* lval_read_str(char* s, int* i);
 lval* lval_read_sym(char* s, int* i); 
 lval* lval_read_expr(char* s, int* i, char end);  
 lval* lval_read(char* s, int* i); 
 lval* lval_eval_sexpr(lenv* e, lval* v); 
 lval* lval_eval(lenv* e, lval* v); 
+lval* lval_eval_ref(lenv* e, lval* v); 
+lval* lval_eval_rec(lenv* e, lval* v); 
+lval* lval_eval_cek(lenv* e, lval* v); 
+lval* jit_call(lenv* e, lval* f, lval* a); 
+void eval_stack_init(char* base); 
+bool eval_stack_low(void); 
+void jit_free(ljit* j); 
 void lval_expr_print(lval* v, char open, char close); 
 void lval_print_str(lval* v); 
 void lval_print(lval* v); 
 void lval_println(lval* v); 
+void out_flush(void); 
+void out_write(const char* s, size_t n); 
+void out_char(char c); 
+void out_str(const char* s); 
+void out_num(double x); 
 lval* lval_call(lenv* e, lval* f, lval* a); 
+lval* lval_bind(lenv* e, lval* f, lval* a, lenv** env_out); 
+lval* lval_call_named(lenv* e, lval* f, lval* a, int name); 
+void lval_fuse(lval* v); 
+void lval_optimize(lenv* e, lval* v); 
+int opt_name(char* sym); 
+void opt_note(char* sym, lval* v); 
+lval* lval_eval_opt(lenv* e, lval* v); 
+void lval_infer(lenv* e, char* name, lval* f); 
+lval* lval_eval_typed(lenv* e, lval* v); 
+lval* lval_eval_fused(lenv* e, lval* v); 
+
+// hash table functions 
+lmap* lmap_new(int is_set, int cap); 
+void lmap_del(lmap* m); 
+lmap* lmap_own(lval* v); 
+int lmap_find(lmap* m, lval* k, unsigned int h); 
+void lmap_put(lmap* m, lval* k, lval* v); 
+int lmap_remove(lmap* m, lval* k); 
+
+// ordered map and priority queue functions 
+lbnode* lbnode_new(int leaf); 
+void lbnode_del(lbnode* n); 
+lval* lbtree_get(lbnode* n, lval* k); 
+int lbtree_put(lval* m, lval* k, lval* v); 
+int lbtree_remove(lval* m, lval* k); 
+void lbtree_range(lbnode* n, lval* lo, lval* hi, lval* out); 
+lheap* lheap_own(lval* v); 
+void lheap_del(lheap* h); 
+void lheap_push(lheap* h, lval* x); 
+lval* lheap_pop(lheap* h); 
+
+// sorting functions 
+void parallel_sort(void* base, size_t n, size_t size, int (*cmp)(const void*, const void*)); 
+
+// persistent vector functions 
+lpnode* lpnode_new(int leaf); 
+void lpnode_del(lpnode* p); 
+lval* lpvec_nth(lval* v, int i); 
+void lpvec_set(lval* v, int i, lval* x); 
+void lpvec_push(lval* v, lval* x); 
+void lpvec_concat(lval* v, lval* w); 
+void lpvec_items(lpnode* p, lval* x); 
+
+// lazy sequence functions 
+lval* lval_seq(lseq* s); 
+lseq* lseq_new(int kind); 
+void lseq_del(lseq* s); 
+lseq_it* lseq_iter(lseq* s); 
+void lseq_it_del(lseq_it* it); 
+lval* lseq_next(lenv* e, lseq_it* it); 
+void lval_print_seq(lenv* e, lval* v); 
+
+// numeric vector functions 
+lvec* lvec_own(lval* v); 
+void lvec_del(lvec* v); 
+void vec_arith(char op, double* out, const double* x, double xs, const double* y, double ys, int n); 
+void vec_compare(char* op, double* out, const double* x, double xs, const double* y, double ys, int n); 
+double vec_sum(const double* x, int n); 
+double vec_dot(const double* x, const double* y, int n); 
+double vec_min(const double* x, int n); 
+double vec_max(const double* x, int n); 
+lval* builtin_vec_op(lval* a, char* op); 
+lval* builtin_vec_ord(lval* a, char* op); 
+
+// matrix functions 
+int mat_shape_ok(int rows, int cols); 
+void mat_transpose(double* out, const double* x, int rows, int cols); 
+void mat_mul(double* out, const double* x, const double* y, int n, int k, int m); 
+
+// string functions 
+size_t str_find(const char* s, size_t n, const char* p, size_t m); 
+void str_case(char* out, const char* s, size_t n, int upper); 
 
 // env functions 
 lenv* lenv_new(void); 
 void lenv_del(lenv* v); 
 lval* lenv_get(lenv* e, lval* k); 
+lval* lenv_peek(lenv* e, char* sym); 
 void lenv_put(lenv* e, lval* k, lval* v); 
+void lenv_bind(lenv* e, char* sym, lval* v); 
 void lenv_def(lenv* e, lval* k, lval* v); 
 lenv* lenv_copy(lenv* e); 
 char* ltype_name(int t); 
 
 // builtin functions 
-lval* builtin_op(lenv* e, lval* a, char* op); 
+double op_arith(int op, double x, double y); 
+bool op_test(int op, double x, double y); 
+lval* builtin_op(lenv* e, lval* a, int op); 
 lval* builtin_add(lenv* e, lval* a); 
 lval* builtin_sub(lenv* e, lval* a); 
 lval* builtin_mul(lenv* e, lval* a); 
 lval* builtin_div(lenv* e, lval* a); 
 lval* builtin_mod(lenv* e, lval* a); 
-lval* builtin_ord(lenv* e, lval* a, char* op); 
+lval* builtin_ord(lenv* e, lval* a, int op); 
 lval* builtin_gt(lenv* e, lval* a); 
 lval* builtin_lt(lenv* e, lval* a); 
 lval* builtin_ge(lenv* e, lval* a); 
@@ -96,26 +421,110 @@ lval* builtin_le(lenv* e, lval* a);
 lval* builtin_or(lenv* e, lval* a); 
 lval* builtin_and(lenv* e, lval* a); 
 lval* builtin_not(lenv* e, lval* a); 
-lval* builtin_cmp(lenv* e, lval* a, char* op); 
+lval* builtin_cmp(lenv* e, lval* a, int op); 
+lval* builtin_eq(lenv* e, lval* a); 
+lval* builtin_ne(lenv* e, lval* a); 
 lval* builtin_head(lenv* e, lval* a); 
 lval* builtin_tail(lenv* e, lval* a); 
 lval* builtin_list(lenv* e, lval* a); 
 lval* builtin_eval(lenv* e, lval* a); 
 lval* builtin_join(lenv* e, lval* a); 
 lval* lval_join(lval* x, lval* y); 
-lval* builtin_len(lenv* e, lval* a); 
+lval* builtin_len(lenv* e, lval* a);
+lval* builtin_substr(lenv* e, lval* a);
+lval* builtin_nth_char(lenv* e, lval* a);
+lval* builtin_find(lenv* e, lval* a);
+lval* builtin_split(lenv* e, lval* a);
+lval* builtin_replace(lenv* e, lval* a);
+lval* builtin_trim(lenv* e, lval* a);
+lval* builtin_starts_with(lenv* e, lval* a);
+lval* builtin_to_number(lenv* e, lval* a);
+lval* builtin_case(lval* a, char* func, int upper);
+lval* builtin_str_upper(lenv* e, lval* a);
+lval* builtin_str_lower(lenv* e, lval* a); 
 lval* builtin_cons(lenv* e, lval* a); 
-lval* builtin_var(lenv* e, lval* a, char* func); 
+lval* builtin_var(lenv* e, lval* a, int kind); 
 lval* builtin_def(lenv* e, lval* a); 
 lval* builtin_put(lenv* e, lval* a); 
 lval* builtin_lambda(lenv* e, lval* a); 
 lval* builtin_if(lenv* e, lval* a); 
+int lval_form_literal(lbuiltin f, lval** cs, int n); 
+lval* lval_form(lenv* e, lbuiltin f, lval** cs, int n, int evaluated, lval** code, lenv** env); 
+lval* builtin_select(lenv* e, lval* a); 
+lval* builtin_case_of(lenv* e, lval* a); 
+lval* builtin_let(lenv* e, lval* a); 
+lval* builtin_while(lenv* e, lval* a); 
+lval* builtin_do(lenv* e, lval* a); 
+lval* lval_expand(lenv* e, lval* v); 
+lval* builtin_defmacro(lenv* e, lval* a); 
+lval* builtin_quasiquote(lenv* e, lval* a); 
+void lval_load_form(lenv* e, lval* form); 
 lval* builtin_load(lenv* e, lval* a); 
 lval* builtin_print(lenv* e, lval* a); 
+lval* builtin_flush(lenv* e, lval* a); 
 lval* builtin_error(lenv* e, lval* a); 
+lval* builtin_hashmap(lenv* e, lval* a); 
+lval* builtin_hashset(lenv* e, lval* a); 
+lval* builtin_insert(lenv* e, lval* a); 
+lval* builtin_get(lenv* e, lval* a); 
+lval* builtin_remove(lenv* e, lval* a); 
+lval* builtin_contains(lenv* e, lval* a); 
+lval* builtin_keys(lenv* e, lval* a); 
+lval* builtin_size(lenv* e, lval* a); 
+lval* builtin_omap(lenv* e, lval* a); 
+lval* builtin_range(lenv* e, lval* a); 
+lval* builtin_pq(lenv* e, lval* a); 
+lval* builtin_pq_push(lenv* e, lval* a); 
+lval* builtin_pq_pop(lenv* e, lval* a); 
+lval* builtin_pq_peek(lenv* e, lval* a); 
+lval* builtin_pvec(lenv* e, lval* a); 
+lval* builtin_pvec_to_list(lenv* e, lval* a); 
+lval* builtin_vnth(lenv* e, lval* a); 
+lval* builtin_vset(lenv* e, lval* a); 
+lval* builtin_vpush(lenv* e, lval* a); 
+lval* builtin_vconcat(lenv* e, lval* a); 
+lval* builtin_range_seq(lenv* e, lval* a); 
+lval* builtin_iterate(lenv* e, lval* a); 
+lval* builtin_lazy(lval* a, char* func, int kind, int eval); 
+lval* builtin_lazy_map(lenv* e, lval* a); 
+lval* builtin_lazy_filter(lenv* e, lval* a); 
+lval* builtin_take(lenv* e, lval* a); 
+lval* builtin_foldl(lenv* e, lval* a); 
+lval* builtin_map(lenv* e, lval* a); 
+lval* builtin_filter(lenv* e, lval* a); 
+lval* builtin_seq_to_list(lenv* e, lval* a); 
+lval* builtin_sort(lenv* e, lval* a); 
+lval* builtin_vec(lenv* e, lval* a); 
+lval* builtin_vec_list(lenv* e, lval* a); 
+lval* builtin_sum(lenv* e, lval* a); 
+lval* builtin_dot(lenv* e, lval* a); 
+lval* builtin_minmax(lval* a, char* func, int is_max); 
+lval* builtin_min(lenv* e, lval* a); 
+lval* builtin_max(lenv* e, lval* a); 
+lval* builtin_mat(lenv* e, lval* a); 
+lval* builtin_mat_list(lenv* e, lval* a); 
+lval* builtin_transpose(lenv* e, lval* a); 
+lval* builtin_mslice(lenv* e, lval* a); 
+lval* builtin_matmul(lenv* e, lval* a); 
+lval* builtin_time(lenv* e, lval* a); 
+lval* builtin_bench(lenv* e, lval* a); 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func); 
 void lenv_add_builtins(lenv* e); 
 
+// name table and tracing functions 
+int lname_id(char* s); 
+char* lname_str(int id); 
+long long clock_ns(void); 
+void trace_open(char* path); 
+void trace_close(void); 
+void trace_event(int name, char cat, char ph); 
+
+// hardware performance counter functions 
+void perf_open(void); 
+void perf_read(long long* counts); 
+void perf_account(int name, long long* before); 
+void perf_report(void); 
+
 // parsing functions 
 lval* lval_read_expr(char* s, int* i, char end); 
 char lval_str_unescape(char x); 
@@ -0,0 +1,629 @@
+#include "parsing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sherlangc translates a SherLang program to C. The program and the
+// definitions of the standard library it uses are built directly as values,
+// so nothing is parsed at start up, and every lambda body in them becomes a
+// C function that lval_call runs instead of interpreting the body. Calls of
+// arithmetic and comparison builtins go straight to the builtin while their
+// names keep their meaning (see opt_dirty), and ifs pick their branch in C.
+// Anything else, like eval, load or select, is left to the interpreter.
+//
+// The generated file is linked against the runtime:
+//
+//   gcc -O2 -DSHERLANG_NO_MAIN sherlangc.c parsing.c -o sherlangc -lreadline -lm -lpthread
+//   ./sherlangc prog.slang
+//   gcc -O2 -DSHERLANG_NO_MAIN prog.c parsing.c -o prog -lreadline -lm -lpthread
+
+// builtins called directly by the generated code
+static struct
+{
+	char *name;
+	char *fn;
+} sl_ops[] = {
+	{"+", "builtin_add"}, {"-", "builtin_sub"}, {"*", "builtin_mul"}, {"/", "builtin_div"}, {"%", "builtin_mod"},
+	{"min", "builtin_min"}, {"max", "builtin_max"}, {"==", "builtin_eq"}, {"!=", "builtin_ne"}, {">", "builtin_gt"},
+	{"<", "builtin_lt"}, {">=", "builtin_ge"}, {"<=", "builtin_le"}, {"||", "builtin_or"}, {"&&", "builtin_and"},
+	{"!", "builtin_not"}, {"if", "builtin_if"},
+};
+#define SL_OPS (int)(sizeof(sl_ops) / sizeof(sl_ops[0]))
+#define SL_OP_IF (SL_OPS - 1)
+
+static FILE *out;
+
+// Nodes
+
+// values the generated code refers to get an index in N, kept in a table by
+// address
+static lval **node_vals;
+static int *node_ids;
+static int node_cap;
+static int node_count;
+
+static int *node_slot(lval *v)
+{
+	if (2 * (node_count + 1) > node_cap)
+	{
+		lval **vals = node_vals;
+		int *ids = node_ids;
+		int cap = node_cap;
+		node_cap = cap ? 2 * cap : 256;
+		node_vals = calloc(node_cap, sizeof(lval *));
+		node_ids = calloc(node_cap, sizeof(int));
+		for (int i = 0; i < cap; i++)
+		{
+			if (vals[i])
+			{
+				*node_slot(vals[i]) = ids[i];
+			}
+		}
+		free(vals);
+		free(ids);
+	}
+	size_t j = ((size_t)v >> 4) & (node_cap - 1);
+	while (node_vals[j] && node_vals[j] != v)
+	{
+		j = (j + 1) & (node_cap - 1);
+	}
+	if (node_vals[j] == NULL)
+	{
+		node_vals[j] = v;
+		node_ids[j] = -1;
+	}
+	return &node_ids[j];
+}
+
+// index of v in N, -1 when it has none
+static int node_find(lval *v)
+{
+	for (size_t j = ((size_t)v >> 4) & (node_cap - 1); node_cap && node_vals[j]; j = (j + 1) & (node_cap - 1))
+	{
+		if (node_vals[j] == v)
+		{
+			return node_ids[j];
+		}
+	}
+	return -1;
+}
+
+static int node_id(lval *v)
+{
+	int *id = node_slot(v);
+	if (*id == -1)
+	{
+		*id = node_count++;
+	}
+	return *id;
+}
+
+// Compiled code is emitted for code nodes, numbered by N index
+static int *code_nodes;
+static int code_count;
+static lval **code_vals;
+
+static char *code_mark;
+static int code_mark_cap;
+
+// has node id got a function?
+static int code_marked(int id)
+{
+	return id < code_mark_cap && code_mark[id];
+}
+
+static void code_add(lval *v, int id)
+{
+	if (id >= code_mark_cap)
+	{
+		int cap = code_mark_cap ? code_mark_cap : 256;
+		while (cap <= id)
+		{
+			cap *= 2;
+		}
+		code_mark = realloc(code_mark, cap);
+		memset(code_mark + code_mark_cap, 0, cap - code_mark_cap);
+		code_mark_cap = cap;
+	}
+	code_mark[id] = 1;
+	code_nodes = realloc(code_nodes, sizeof(int) * (code_count + 1));
+	code_vals = realloc(code_vals, sizeof(lval *) * (code_count + 1));
+	code_nodes[code_count] = id;
+	code_vals[code_count] = v;
+	code_count++;
+}
+
+// the C function evaluating the list v as an s-expression, given it
+static int code_of(lval *v)
+{
+	int id = node_id(v);
+	if (!code_marked(id))
+	{
+		code_add(v, id);
+	}
+	return id;
+}
+
+// Emitting C
+
+static void emit_str(char *s, size_t n)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < n; i++)
+	{
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\' || c == '?')
+		{
+			fprintf(out, "\\%c", c);
+		}
+		else if (c < ' ' || c >= 127)
+		{
+			fprintf(out, "\\%03o", c);
+		}
+		else
+		{
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static int op_index(char *sym)
+{
+	for (int i = 0; i < SL_OPS; i++)
+	{
+		if (strcmp(sl_ops[i].name, sym) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// an expression for the value of x, as lval_eval_ref gives it
+static void emit_value(lval *x)
+{
+	switch (x->type)
+	{
+	case LVAL_NUM:
+		fprintf(out, "lval_num(%a)", x->num);
+		break;
+	case LVAL_SYM:
+		fprintf(out, "sl_get(e, ");
+		emit_str(x->sym, strlen(x->sym));
+		fprintf(out, ")");
+		break;
+	case LVAL_SEXPR:
+		fprintf(out, "sl_%i(e)", code_of(x));
+		break;
+	default:
+		fprintf(out, "lval_copy(N[%i])", node_id(x));
+		break;
+	}
+}
+
+// statements adding the values of cells from..v->count of v to a
+static void emit_args(lval *v, int from)
+{
+	for (int i = from; i < v->count; i++)
+	{
+		fprintf(out, "\tlval_add(a, ");
+		emit_value(v->cell[i]);
+		fprintf(out, ");\n");
+	}
+}
+
+// the function evaluating the list v, with index id, as lval_eval_rec does
+static void emit_code(lval *v, int id)
+{
+	fprintf(out, "static lval *sl_%i(lenv *e)\n{\n", id);
+
+	if (v->count == 0)
+	{
+		fprintf(out, "\treturn lval_sexpr();\n}\n\n");
+		return;
+	}
+	if (v->fused)
+	{
+		fprintf(out, "\treturn lval_eval_sexpr(e, N[%i]);\n}\n\n", id);
+		return;
+	}
+
+	lval *h = v->cell[0];
+	int op = h->type == LVAL_SYM ? op_index(h->sym) : -1;
+	int n = v->count - 1;
+
+	if (op == SL_OP_IF && n == 3 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR)
+	{
+		fprintf(out, "\tif (!(opt_dirty & sl_bit[%i]))\n\t{\n\t\tlval *c = ", op);
+		emit_value(v->cell[1]);
+		fprintf(out, ";\n\t\tif (c->type == LVAL_NUM || c->type == LVAL_BOOL)\n\t\t{\n");
+		fprintf(out, "\t\t\tint then = c->num != 0;\n\t\t\tlval_del(c);\n");
+		fprintf(out, "\t\t\treturn then ? sl_%i(e) : sl_%i(e);\n\t\t}\n", code_of(v->cell[2]), code_of(v->cell[3]));
+		fprintf(out, "\t\tlval *a = lval_add(lval_sexpr(), c);\n");
+		fprintf(out, "\t\tlval_add(a, lval_copy(N[%i]));\n\t\tlval_add(a, lval_copy(N[%i]));\n", node_id(v->cell[2]), node_id(v->cell[3]));
+		fprintf(out, "\t\treturn sl_builtin(e, builtin_if, a);\n\t}\n");
+	}
+	else if (op != -1 && op != SL_OP_IF && n > 0)
+	{
+		fprintf(out, "\tif (!(opt_dirty & sl_bit[%i]))\n\t{\n\t\tlval *a = lval_sexpr();\n", op);
+		for (int i = 1; i < v->count; i++)
+		{
+			fprintf(out, "\t\tlval_add(a, ");
+			emit_value(v->cell[i]);
+			fprintf(out, ");\n");
+		}
+		fprintf(out, "\t\treturn sl_builtin(e, %s, a);\n\t}\n", sl_ops[op].fn);
+	}
+
+	fprintf(out, "\tlval *f = ");
+	emit_value(h);
+	fprintf(out, ";\n");
+
+	// the forms the evaluator runs in place
+	if (n == 3 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR)
+	{
+		fprintf(out, "\tif (f->type == LVAL_FUN && f->builtin == builtin_if)\n\t{\n\t\tlval *c = ");
+		emit_value(v->cell[1]);
+		fprintf(out, ";\n\t\tif (c->type == LVAL_NUM || c->type == LVAL_BOOL)\n\t\t{\n");
+		fprintf(out, "\t\t\tint then = c->num != 0;\n\t\t\tlval_del(c);\n\t\t\tlval_del(f);\n");
+		fprintf(out, "\t\t\treturn then ? sl_%i(e) : sl_%i(e);\n\t\t}\n", code_of(v->cell[2]), code_of(v->cell[3]));
+		fprintf(out, "\t\tlval *a = lval_add(lval_add(lval_sexpr(), f), c);\n");
+		fprintf(out, "\t\tlval_add(a, lval_copy(N[%i]));\n\t\tlval_add(a, lval_copy(N[%i]));\n", node_id(v->cell[2]), node_id(v->cell[3]));
+		fprintf(out, "\t\treturn sl_apply(e, a);\n\t}\n");
+	}
+	if (n == 1 && v->cell[1]->type == LVAL_QEXPR)
+	{
+		fprintf(out, "\tif (f->type == LVAL_FUN && f->builtin == builtin_eval)\n\t{\n");
+		fprintf(out, "\t\tlval_del(f);\n\t\treturn sl_%i(e);\n\t}\n", code_of(v->cell[1]));
+	}
+	fprintf(out, "\tif (f->type == LVAL_FUN && f->builtin && lval_form_literal(f->builtin, N[%i]->cell + 1, %i))\n\t{\n", id, n);
+	fprintf(out, "\t\tlval_del(f);\n\t\treturn lval_eval_sexpr(e, N[%i]);\n\t}\n", id);
+
+	fprintf(out, "\tlval *a = lval_add(lval_sexpr(), f);\n");
+	emit_args(v, 1);
+	fprintf(out, "\treturn sl_apply(e, a);\n}\n\n");
+}
+
+// an expression building v, giving N indexes to the nodes that have one
+static void emit_build(lval *v, int depth)
+{
+	int id = node_find(v);
+	if (id != -1)
+	{
+		fprintf(out, "(N[%i] = ", id);
+	}
+	switch (v->type)
+	{
+	case LVAL_NUM:
+		fprintf(out, "lval_num(%a)", v->num);
+		break;
+	case LVAL_SYM:
+		fprintf(out, "lval_sym(");
+		emit_str(v->sym, strlen(v->sym));
+		fprintf(out, ")");
+		break;
+	case LVAL_STR:
+		fprintf(out, "lval_str_literal(");
+		emit_str(lval_sdata(v), v->slen);
+		fprintf(out, ", %zu)", v->slen);
+		break;
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		fprintf(out, "sl_list(%s, %i", v->type == LVAL_SEXPR ? "LVAL_SEXPR" : "LVAL_QEXPR", v->count);
+		for (int i = 0; i < v->count; i++)
+		{
+			fprintf(out, ",\n%*s", 2 * (depth + 1), "");
+			emit_build(v->cell[i], depth + 1);
+		}
+		fprintf(out, ")");
+		break;
+	}
+	if (id != -1)
+	{
+		fprintf(out, ")");
+	}
+}
+
+// Program
+
+// bodies of the lambdas in v, (\ {formals} {body}) and (fun {name formals} {body})
+static void find_bodies(lval *v, lval ***bodies, int *count)
+{
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+	{
+		return;
+	}
+	if (v->count == 3 && v->cell[0]->type == LVAL_SYM && v->cell[2]->type == LVAL_QEXPR &&
+		(strcmp(v->cell[0]->sym, "\\") == 0 || strcmp(v->cell[0]->sym, "fun") == 0))
+	{
+		*bodies = realloc(*bodies, sizeof(lval *) * (*count + 1));
+		(*bodies)[(*count)++] = v->cell[2];
+	}
+	for (int i = 0; i < v->count; i++)
+	{
+		find_bodies(v->cell[i], bodies, count);
+	}
+}
+
+// does v use the symbol sym anywhere?
+static int uses(lval *v, char *sym)
+{
+	if (v->type == LVAL_SYM)
+	{
+		return strcmp(v->sym, sym) == 0;
+	}
+	for (int i = 0; (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && i < v->count; i++)
+	{
+		if (uses(v->cell[i], sym))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// names a standard library form defines with fun or def
+static lval *defined_names(lval *form)
+{
+	if (form->type != LVAL_SEXPR || form->count < 2 || form->cell[0]->type != LVAL_SYM ||
+		form->cell[1]->type != LVAL_QEXPR || form->cell[1]->count == 0)
+	{
+		return NULL;
+	}
+	if (strcmp(form->cell[0]->sym, "fun") == 0)
+	{
+		return lval_add(lval_qexpr(), lval_copy(form->cell[1]->cell[0]));
+	}
+	if (strcmp(form->cell[0]->sym, "def") == 0)
+	{
+		return form->cell[1];
+	}
+	return NULL;
+}
+
+// keep the standard library forms the program needs, in their order
+static lval *select_stdlib(lval *lib, lval *prog)
+{
+	int *keep = calloc(lib->count, sizeof(int));
+	lval *used = lval_qexpr();
+	lval_add(used, lval_copy(prog));
+
+	for (int changed = 1; changed;)
+	{
+		changed = 0;
+		for (int i = 0; i < lib->count; i++)
+		{
+			if (keep[i])
+			{
+				continue;
+			}
+			lval *names = defined_names(lib->cell[i]);
+			int need = names == NULL;
+			for (int k = 0; names && k < names->count && !need; k++)
+			{
+				need = names->cell[k]->type == LVAL_SYM && uses(used, names->cell[k]->sym);
+			}
+			if (names && strcmp(lib->cell[i]->cell[0]->sym, "fun") == 0)
+			{
+				lval_del(names);
+			}
+			if (need)
+			{
+				keep[i] = 1;
+				lval_add(used, lval_copy(lib->cell[i]));
+				changed = 1;
+			}
+		}
+	}
+	lval_del(used);
+
+	lval *r = lval_sexpr();
+	for (int i = 0; i < lib->count; i++)
+	{
+		if (keep[i])
+		{
+			lval_add(r, lval_copy(lib->cell[i]));
+		}
+	}
+	free(keep);
+	lval_del(lib);
+	return r;
+}
+
+static lval *read_file(char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "sherlangc: could not open %s\n", path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *input = calloc(length + 1, 1);
+	fread(input, 1, length, f);
+	fclose(f);
+
+	int pos = 0;
+	lval *forms = lval_read_expr(input, &pos, '\0');
+	free(input);
+	if (forms->type == LVAL_ERR)
+	{
+		fprintf(stderr, "sherlangc: %s: %s\n", path, forms->err);
+		exit(1);
+	}
+	return forms;
+}
+
+static void emit_program(lval *forms, char *source, int compile)
+{
+	lval **bodies = NULL;
+	int nbodies = 0;
+	if (compile)
+	{
+		for (int i = 0; i < forms->count; i++)
+		{
+			lval_fuse(forms->cell[i]);
+			find_bodies(forms->cell[i], &bodies, &nbodies);
+		}
+		for (int i = 0; i < nbodies; i++)
+		{
+			code_of(bodies[i]);
+		}
+	}
+
+	fprintf(out, "// Generated by sherlangc from %s. Build with\n", source);
+	fprintf(out, "// gcc -O2 -DSHERLANG_NO_MAIN <this file> parsing.c -lreadline -lm -lpthread\n\n");
+	fprintf(out, "#include \"parsing.h\"\n#include <stdarg.h>\n#include <stdlib.h>\n\n");
+	fprintf(out, "extern lenv *lenv_global;\nextern unsigned opt_dirty;\n\n");
+
+	// emitting functions can give more nodes an index, so they are written
+	// to a buffer first and the table sized afterwards
+	FILE *file = out;
+	char *text;
+	size_t size;
+	out = open_memstream(&text, &size);
+	for (int i = 0; i < code_count; i++)
+	{
+		emit_code(code_vals[i], code_nodes[i]);
+	}
+	for (int i = 0; i < nbodies; i++)
+	{
+		int id = node_find(bodies[i]);
+		fprintf(out, "static lval *sl_body_%i(lenv *e)\n{\n", id);
+		fprintf(out, "\tif (eval_stack_low())\n\t{\n\t\treturn lval_eval_sexpr(e, N[%i]);\n\t}\n", id);
+		fprintf(out, "\treturn sl_%i(e);\n}\n\n", id);
+	}
+	fclose(out);
+	out = file;
+
+	fprintf(out, "static lval *N[%i];\nstatic unsigned sl_bit[%i];\n\n", node_count ? node_count : 1, SL_OPS);
+	fprintf(out, "static lval *sl_list(int type, int n, ...)\n{\n");
+	fprintf(out, "\tlval *v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();\n\tva_list va;\n\tva_start(va, n);\n");
+	fprintf(out, "\tfor (int i = 0; i < n; i++)\n\t{\n\t\tlval_add(v, va_arg(va, lval *));\n\t}\n\tva_end(va);\n\treturn v;\n}\n\n");
+	fprintf(out, "static lval *sl_get(lenv *e, char *sym)\n{\n\tlval *v = lenv_peek(e, sym);\n");
+	fprintf(out, "\treturn v ? lval_copy(v) : lval_err(\"Unbound Symbol '%%s'\", sym);\n}\n\n");
+	fprintf(out, "// the first error in a, or f called on a\n");
+	fprintf(out, "static lval *sl_builtin(lenv *e, lbuiltin f, lval *a)\n{\n");
+	fprintf(out, "\tfor (int i = 0; i < a->count; i++)\n\t{\n\t\tif (a->cell[i]->type == LVAL_ERR)\n\t\t{\n\t\t\treturn lval_take(a, i);\n\t\t}\n\t}\n");
+	fprintf(out, "\treturn f(e, a);\n}\n\n");
+	fprintf(out, "// call the function heading the evaluated s-expression a, as lval_eval_rec does\n");
+	fprintf(out, "static lval *sl_apply(lenv *e, lval *a)\n{\n");
+	fprintf(out, "\tfor (int i = 0; i < a->count; i++)\n\t{\n\t\tif (a->cell[i]->type == LVAL_ERR)\n\t\t{\n\t\t\treturn lval_take(a, i);\n\t\t}\n\t}\n");
+	fprintf(out, "\tif (a->count == 1)\n\t{\n\t\treturn lval_take(a, 0);\n\t}\n");
+	fprintf(out, "\tlval *f = lval_pop(a, 0);\n\tif (f->type != LVAL_FUN)\n\t{\n");
+	fprintf(out, "\t\tlval *err = lval_err(\"S-Expression starts with incorrect type. Got %%s, Expected %%s.\", ltype_name(f->type), ltype_name(LVAL_FUN));\n");
+	fprintf(out, "\t\tlval_del(a);\n\t\tlval_del(f);\n\t\treturn err;\n\t}\n");
+	fprintf(out, "\tlval *r = lval_call(e, f, a);\n\tlval_del(f);\n\treturn r;\n}\n\n");
+	for (int i = 0; i < code_count; i++)
+	{
+		fprintf(out, "static lval *sl_%i(lenv *e);\n", code_nodes[i]);
+	}
+	fprintf(out, "\n");
+	fwrite(text, 1, size, out);
+	free(text);
+
+	fprintf(out, "static lval *forms[%i];\n\n", forms->count ? forms->count : 1);
+	fprintf(out, "static void sl_init(void)\n{\n");
+	for (int i = 0; i < SL_OPS; i++)
+	{
+		fprintf(out, "\tsl_bit[%i] = 1u << opt_name(", i);
+		emit_str(sl_ops[i].name, strlen(sl_ops[i].name));
+		fprintf(out, ");\n");
+	}
+	fprintf(out, "\tstr_intern_begin();\n");
+	for (int i = 0; i < forms->count; i++)
+	{
+		fprintf(out, "\tforms[%i] = ", i);
+		emit_build(forms->cell[i], 1);
+		fprintf(out, ";\n");
+	}
+	fprintf(out, "\tstr_intern_end();\n");
+	for (int i = 0; i < nbodies; i++)
+	{
+		int id = node_find(bodies[i]);
+		fprintf(out, "\tlval_code(N[%i])->aot = sl_body_%i;\n", id, id);
+	}
+	fprintf(out, "}\n\n");
+
+	fprintf(out, "int main(int argc, char **argv)\n{\n\tatexit(out_flush);\n\n");
+	fprintf(out, "\tchar stack_base;\n\teval_stack_init(&stack_base);\n\n");
+	fprintf(out, "\tlenv *e = lenv_new();\n\tlenv_global = e;\n\tlenv_add_builtins(e);\n\tsl_init();\n\n");
+	fprintf(out, "\tfor (int i = 0; i < %i; i++)\n\t{\n\t\tlval_load_form(e, forms[i]);\n\t}\n\n", forms->count);
+	fprintf(out, "\tlenv_del(e);\n\tfor (int i = 0; i < %i; i++)\n\t{\n\t\tlval_del(forms[i]);\n\t}\n\treturn 0;\n}\n", forms->count);
+	free(bodies);
+}
+
+int main(int argc, char **argv)
+{
+	char *source = NULL;
+	char *target = NULL;
+	char *stdlib = "stdlib.slang";
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--stdlib") == 0) && i + 1 < argc)
+		{
+			*(argv[i][1] == 'o' ? &target : &stdlib) = argv[i + 1];
+			i++;
+		}
+		else if (source == NULL && argv[i][0] != '-')
+		{
+			source = argv[i];
+		}
+		else
+		{
+			source = NULL;
+			break;
+		}
+	}
+	if (source == NULL)
+	{
+		fprintf(stderr, "usage: sherlangc file.slang [-o file.c] [--stdlib stdlib.slang]\n");
+		return 1;
+	}
+
+	char *name = NULL;
+	if (target == NULL)
+	{
+		size_t n = strlen(source);
+		if (n > 6 && strcmp(source + n - 6, ".slang") == 0)
+		{
+			n -= 6;
+		}
+		name = malloc(n + 3);
+		memcpy(name, source, n);
+		strcpy(name + n, ".c");
+		target = name;
+	}
+
+	lval *prog = read_file(source);
+	lval *forms = select_stdlib(read_file(stdlib), prog);
+	while (prog->count)
+	{
+		lval_add(forms, lval_pop(prog, 0));
+	}
+	lval_del(prog);
+
+	// macros rewrite code when it is loaded, so the code compiled here
+	// would not be the code that runs
+	int compile = !uses(forms, "defmacro");
+	if (!compile)
+	{
+		fprintf(stderr, "sherlangc: %s defines macros, lambda bodies are left to the interpreter\n", source);
+	}
+
+	out = fopen(target, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "sherlangc: could not write %s\n", target);
+		return 1;
+	}
+	emit_program(forms, source, compile);
+	fclose(out);
+
+	lval_del(forms);
+	free(name);
+	return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Regression scripts. Every tests/*.slang must exit normally, print the same
+# output with the JIT, without it (--no-jit), on the heap evaluator (--cek) and
+# without the optimizer and fusion (--opt-level 0), and print no FAIL line.
+# Run from the repository root after building the interpreter:
+#   sh tests/run.sh [./parsing]
+
+bin=${1:-./parsing}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+status=0
+
+for t in tests/*.slang
+do
+	# helpers loaded by the other scripts
+	[ "$t" = tests/lib.slang ] && continue
+
+	crashed=0
+	"$bin" "$t" > "$out/jit" 2>&1 || crashed=1
+	"$bin" --no-jit "$t" > "$out/no-jit" 2>&1 || crashed=1
+	"$bin" --cek "$t" > "$out/cek" 2>&1 || crashed=1
+	"$bin" --opt-level 0 "$t" > "$out/opt-0" 2>&1 || crashed=1
+
+	if [ $crashed -ne 0 ]
+	then
+		echo "$t: interpreter exited abnormally"
+		status=1
+	elif grep -q FAIL "$out/jit" "$out/no-jit" "$out/cek" "$out/opt-0"
+	then
+		echo "$t: failed"
+		grep FAIL "$out/jit" "$out/no-jit" "$out/cek" "$out/opt-0" | head -20
+		status=1
+	elif ! cmp -s "$out/jit" "$out/no-jit" || ! cmp -s "$out/jit" "$out/cek" || ! cmp -s "$out/jit" "$out/opt-0"
+	then
+		echo "$t: output differs between modes"
+		diff "$out/jit" "$out/no-jit" | head -20
+		diff "$out/jit" "$out/cek" | head -20
+		diff "$out/jit" "$out/opt-0" | head -20
+		status=1
+	else
+		echo "$t: ok"
+	fi
+done
+
+exit $status